@@ -0,0 +1,137 @@
+//===- BranchTrace.h - Rebuild basic blocks from branch outcomes -*- C++ -*-===//
+//
+//                          Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file provides a class which rebuilds the basic block and select records
+// of a trace recorded with -giri-branch-trace from its branch outcome stream.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef GIRI_BRANCHTRACE_H
+#define GIRI_BRANCHTRACE_H
+
+#include "Giri/Runtime.h"
+#include "Utility/BasicBlockNumbering.h"
+#include "Utility/LoadStoreNumbering.h"
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+
+#include <map>
+#include <pthread.h>
+#include <vector>
+
+using namespace llvm;
+using namespace dg;
+
+namespace giri {
+
+/// \class Follows the control flow of every thread of a branch trace through
+/// the CFG, and rebuilds the trace the thread would have recorded with basic
+/// block records.
+///
+/// Every thread starts in the function named by its first function entry
+/// record. Its walk goes from instruction to instruction, and matches the
+/// records of the thread to the instructions which made them in order. A call
+/// record descends into the callee, which is found from the call instruction,
+/// or from the address in the record if the call is indirect. The end of a
+/// basic block yields its record, and its branch takes the next outcome of
+/// the thread to find the successor. A select takes the next outcome as well,
+/// and yields a select record.
+///
+/// The rebuilt records of a thread come right before the next record the
+/// thread made. A thread whose walk can't reach its next record, e.g. after
+/// an unreachable instruction, terminates its active blocks like the
+/// run-time does on exit and keeps its remaining records as they are.
+class BranchTraceDecoder {
+public:
+  /// \param bbNums - The pass that maps basic blocks to identifiers.
+  /// \param lsNums - The pass that maps loads and stores to identifiers.
+  /// \param funAddrMap - The functions with their addresses in the trace.
+  BranchTraceDecoder(const QueryBasicBlockNumbers *bbNums,
+                     const QueryLoadStoreNumbers *lsNums,
+                     const std::map<Function *, uintptr_t> &funAddrMap);
+
+  /// Determine whether a trace was recorded with -giri-branch-trace.
+  /// \param trace - The records of the trace, terminated by an END record.
+  static bool isBranchTrace(const Entry *trace);
+
+  /// Rebuild the basic block and select records of a branch trace.
+  ///
+  /// \param trace - The records of the trace, terminated by an END record.
+  /// \param[out] Output - The rebuilt trace, terminated by an END record. It
+  /// has no branch outcome or function entry records.
+  /// \param[out] Origins - The index in trace of each record of Output, or
+  /// -1 for the records rebuilt from the branch outcomes.
+  void decode(const Entry *trace, std::vector<Entry> &Output,
+              std::vector<long> &Origins);
+
+private:
+  /// A function a thread is executing
+  struct Frame {
+    Function *F;
+    BasicBlock::iterator It; ///< The instruction being executed
+    unsigned seen; ///< The types of the records *It has made, one bit each
+    bool descended; ///< Whether the call *It has been followed
+    unsigned callID; ///< The ID of the recorded call, or ~0 if there is none
+  };
+
+  /// The walk of one thread
+  struct ThreadWalk {
+    std::vector<uint64_t> bits; ///< The branch outcomes of the thread
+    unsigned long count; ///< Number of branch outcomes
+    unsigned long next; ///< The next branch outcome to take
+    std::vector<Frame> frames; ///< Active functions, outermost first
+    bool stuck; ///< Whether the walk can't be followed anymore
+  };
+
+  /// Walk the thread to the instruction which made a record, and append the
+  /// rebuilt records and then the record to the output.
+  void follow(ThreadWalk &T, const Entry &entry, long index);
+
+  /// Take one step of the walk of a thread, which doesn't need a record.
+  /// \param draining - Whether the trace has ended, in which case the walk
+  /// stops before any instruction which would have made a record.
+  /// \return false if the walk can't go on.
+  bool advance(ThreadWalk &T, pthread_t tid, bool draining);
+
+  /// Leave the basic block of the innermost function of a thread.
+  /// \return false if the successor isn't known.
+  bool finishBlock(ThreadWalk &T, pthread_t tid);
+
+  /// Terminate the active basic blocks of a thread, innermost first, and stop
+  /// following it.
+  void strand(ThreadWalk &T, pthread_t tid);
+
+  /// Start executing a function in a thread.
+  void enter(ThreadWalk &T, Function *F, unsigned callID);
+
+  /// Find the instrumented function a recorded call enters, if any.
+  Function *getCallee(Instruction *I, uintptr_t address) const;
+
+  bool takeBit(ThreadWalk &T, bool &bit);
+  bool takeVarint(ThreadWalk &T, uint64_t &value);
+
+  void emit(const Entry &entry, long origin);
+  void emitBlock(BasicBlock *BB, pthread_t tid, unsigned callID);
+
+private:
+  const QueryBasicBlockNumbers *bbNums;
+  const QueryLoadStoreNumbers *lsNums;
+  const std::map<Function *, uintptr_t> &funAddrMap;
+
+  /// The instrumented functions by their address in the trace
+  std::map<uintptr_t, Function *> funByAddress;
+
+  std::vector<Entry> *Output;
+  std::vector<long> *Origins;
+};
+
+}
+
+#endif
@@ -40,13 +40,19 @@ class TracingNoGiri : public BasicBlockPass,
                       public InstVisitor<TracingNoGiri> {
 public:
   static char ID;
-  TracingNoGiri() : BasicBlockPass(ID) {}
+  TracingNoGiri() : BasicBlockPass(ID), Coverage(nullptr) {}
 
   /// This method does module level changes needed for adding tracing
   /// instrumentation for dynamic slicing. Specifically, we add the function
   /// prototypes for the dynamic slicing functionality here.
   virtual bool doInitialization(Module &M);
-  virtual bool doFinalization(Module &M) { return false; }
+
+  /// This method registers the instrumented functions with the run-time, so
+  /// that it writes their addresses next to the trace. With -giri-dual-clone,
+  /// it also adds an uninstrumented clone of every instrumented function,
+  /// which the function dispatches to while tracing is disabled. With
+  /// -giri-inline-runtime, it inlines the fast path of the run-time.
+  virtual bool doFinalization(Module &M);
   virtual bool doInitialization(Function &F) { return false; }
   virtual bool doFinalization(Function &F) { return false; }
 
@@ -83,6 +89,11 @@ public:
   /// to call insts.
   void visitCallInst(CallInst &CI);
 
+  /// Visit an alloca instruction. This method instruments the alloca
+  /// instruction with a call to the tracing run-time that will record, in the
+  /// dynamic trace, the stack memory allocated by this alloca instruction.
+  void visitAllocaInst(AllocaInst &AI);
+
   /// Visit a select instruction.  This method instruments the select
   /// instruction with a call to the tracing run-time that will record, in the
   /// dynamic trace, the boolean value that the select instruction will use to
@@ -98,6 +109,26 @@ public:
   /// otherwise false.
   bool visitSpecialCall(CallInst &CI);
 
+  /// Instrument a call to a pthread synchronization function with the records
+  /// of the synchronization it performs. Releases are recorded before the
+  /// given instruction, and acquires after it.
+  ///
+  /// \param CI - The call instruction which may synchronize.
+  /// \param Release - The instruction before which releases are recorded.
+  /// \param Acquire - The instruction after which acquires are recorded.
+  void visitSyncCall(CallInst &CI, Instruction *Release, Instruction *Acquire);
+
+  /// Instrument a call to a heap allocation or deallocation function with the
+  /// record of the object it allocates or frees. Frees are recorded before the
+  /// given instruction, and allocations after it. calloc() is recorded by
+  /// visitSpecialCall() along with its store.
+  ///
+  /// \param CI - The call instruction which may allocate or free memory.
+  /// \param Free - The instruction before which frees are recorded.
+  /// \param Alloc - The instruction after which allocations are recorded.
+  void visitAllocationCall(CallInst &CI, Instruction *Free,
+                           Instruction *Alloc);
+
 private:
   // Pointers to other passes
   const DataLayout *TD;
@@ -122,6 +153,38 @@ private:
   Function *Init;
   Function *RecordLock;
   Function *RecordUnlock;
+  Function *RecordSync;
+  Function *RecordAlloc;
+  Function *RecordFree;
+  Function *RecordRealloc;
+  Function *RecordFunctions;
+  Function *RecordBlock;
+  Function *RecordCoverage;
+  Function *RecordBranch;
+  Function *RecordSwitch;
+  Function *RecordEnter;
+  Function *RecordClonedCall;
+  Function *RecordTracedEntry;
+
+  /// Number of access sizes with their own load and store record functions
+  static const unsigned NumSizeClasses = 5;
+
+  /// The record functions of loads and stores of 1, 2, 4, 8 and 16 bytes,
+  /// which don't take the size as an argument
+  Function *RecordSizedLoad[NumSizeClasses];
+  Function *RecordSizedStore[NumSizeClasses];
+
+  /// The array marking the executed basic blocks with -giri-coverage-only
+  GlobalVariable *Coverage;
+
+  /// The instrumented functions with the IDs of their entry blocks
+  std::vector<std::pair<unsigned, Function *> > TracedFunctions;
+
+  /// The functions linked in from the fast path of the run-time
+  std::set<const Function *> FastPathFunctions;
+
+  /// The run-time flag telling instrumented functions whether to trace
+  GlobalVariable *TracingEnabled;
 
   // Integer types
   // Removed const modifier since method signatures have changed
@@ -130,6 +193,7 @@ private:
   Type *Int64Type;
   Type *VoidType;
   Type *VoidPtrType;
+  StructType *BlockOpType;
 
 private:
   /// Instrument the unlock function for load/store instructions
@@ -140,17 +204,116 @@ private:
   /// This should insert a function call after the I;
   void instrumentUnlock(Instruction *I);
 
+  /// Get the name of an instruction passed to the lock and unlock functions.
+  Constant *getLockName(Instruction *I);
+
+  /// Insert a synchronization record of the given kind before InsertPt.
+  void instrumentSync(CallInst &CI, SyncRecord Kind, Value *Object,
+                      Value *Result, Instruction *InsertPt);
+
   /// Instrument the function to record it's thread id, if it is a function
   /// started from pthread_create
   void instrumentPthreadCreatedFunctions(Function *F);
 
   /// This method instruments a basic block so that it records its execution at
   /// run-time.
-  void instrumentBasicBlock(BasicBlock &BB);
+  ///
+  /// \param Batch - The loads, stores and selects of the block which are
+  /// recorded at its end, by the same run-time call as the end of the block.
+  void instrumentBasicBlock(BasicBlock &BB,
+                            const std::vector<Instruction *> &Batch);
+
+  /// This method instruments a basic block with -giri-branch-trace, so that it
+  /// records the outcome of its conditional branch or switch at run-time, and
+  /// the entry of its function if it is the entry block.
+  void instrumentBranches(BasicBlock &BB);
+
+  /// Record a call and its return around a call instruction.
+  ///
+  /// \param Record - The run-time function recording the call.
+  /// \return the call recording the return.
+  Instruction *instrumentCallReturn(CallInst &CI, Function *Record);
+
+  /// Determine whether the records of the loads, stores and selects of a basic
+  /// block may be written at its end. The block must not call any function,
+  /// since the records of the callee would then come before them.
+  bool canBatchBlock(BasicBlock &BB) const;
+
+  /// Insert a call to recordBlock() before InsertPt, recording the given loads,
+  /// stores and selects and then the end of their basic block.
+  ///
+  /// \param Batch - The instructions recorded, in the order of the block.
+  /// \param BBArgs - The arguments which recordBB() would be called with.
+  /// \return the call to the run-time.
+  Instruction *createBlockRecord(const std::vector<Instruction *> &Batch,
+                                 std::vector<Value *> &BBArgs,
+                                 Instruction *InsertPt);
 
   /// Create a global constructor (ctor) function that can be called when the
   /// program starts up.
   void createCtor(Module &M);
+
+  /// Add the table of the instrumented functions to the module, and pass it to
+  /// the run-time from the global constructor.
+  bool createFunctionTable(Module &M);
+
+  /// Instrument a basic block so that it marks its ID in the coverage array
+  /// when it is executed, which is all that -giri-coverage-only records.
+  void instrumentCoverage(BasicBlock &BB);
+
+  /// Pass the coverage array to the run-time from the global constructor.
+  void registerCoverage(Module &M);
+
+  /// Determine whether an instruction is a call to the tracing run-time.
+  bool isRuntimeCall(const Instruction *I) const;
+
+  /// Get the record function of a load or store of the given size from
+  /// RecordSizedLoad or RecordSizedStore.
+  /// \return the function, or nullptr if the size has none or the fast path
+  /// is inlined, in which case the generic function must be called.
+  Function *getSizedRecord(Function *const *Records, uint64_t Size) const;
+
+  /// Link the fast path of the run-time from the bitcode module given by
+  /// -giri-inline-runtime, and record loads, stores and selects by calling it.
+  void linkFastPath(Module &M);
+
+  /// Inline the calls to the fast path of the run-time.
+  void inlineFastPath();
+
+  /// Add an untraced clone of every instrumented function.
+  bool createUntracedClones(Module &M);
+
+  /// Record the entry of the instrumented body of F, which pushes the call of
+  /// F with -giri-dual-clone. The untraced clone doesn't push it, and neither
+  /// does its last basic block pop it.
+  void instrumentTracedEntry(Function &F);
+
+  /// Clone the instrumented function F without the calls to the run-time, and
+  /// make F enter the clone unless tracing is enabled. The basic blocks and
+  /// instructions of F keep their identity, so their IDs stay valid.
+  void createUntracedClone(Function &F);
+};
+
+/// This pass redirects the calls to nondeterministic library functions (input,
+/// time, random numbers, signals and pthread synchronization) to the giri_rr_
+/// wrappers of the run-time, which record their results or replay them.
+///
+/// Only the called function of each call is replaced, so the pass may run
+/// after -trace-giri without changing the IDs of the instrumented program.
+class InterceptNondeterminism : public ModulePass {
+public:
+  static char ID;
+  InterceptNondeterminism() : ModulePass(ID) {}
+
+  virtual bool runOnModule(Module &M);
+
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.setPreservesCFG();
+  }
+
+  /// Determine whether calls to the function with the given name are
+  /// intercepted.
+  static bool isIntercepted(StringRef Name);
 };
 
 /// This pass finds the backwards dynamic slice of LLVM values.
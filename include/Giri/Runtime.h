@@ -27,8 +27,17 @@ enum class RecordType : unsigned {
   STType  = 'S',  // Store record
   CLType  = 'C',  // Call record
   RTType  = 'R',  // Call return record
-  ENType  = 'E',  // End record
-  PDType  = 'P'   // Select (predicated) record
+  ENType  = 'E',  // End record, whose address is the ID of the run
+  PDType  = 'P',  // Select (predicated) record
+  SGType  = 'G',  // Segment header record
+  CKType  = 'K',  // Checkpoint record
+  SYType  = 'Y',  // Synchronization record
+  ALType  = 'A',  // Allocation record
+  FRType  = 'F',  // Deallocation record
+  LWType  = 'W',  // Last writer record
+  BRType  = 'O',  // Branch outcome record
+  FNType  = 'N',  // Function entry record
+  SHType  = 'H'   // Stride hit record
 //static const unsigned char EXType = 'X';  // External Function record
 };
 
@@ -49,7 +58,10 @@ struct Entry {
   /// The ID of the basic block, or the load/store instruction
   unsigned id;
 
-  pthread_t tid; ///< The thread ID
+  /// The thread ID. Threads are numbered from 1 in the order they are created
+  /// or first record, so a thread which reuses the pthread_t of an exited one
+  /// gets an ID of its own.
+  pthread_t tid;
 
   /// For a load or store, it is the memory address which is read or written.
   /// For special external functions (e.g., memcpy, memset), it is the
@@ -89,4 +101,292 @@ struct Entry {
   Entry() { }
 };
 
+/// Flags describing how the records of one trace segment are laid out.
+enum SegmentFlags : unsigned {
+  /// The tid field of every record in the segment holds a global sequence
+  /// number instead of the thread ID. The owning thread is stored once in the
+  /// segment header. Sorting the records of all such segments by sequence
+  /// number restores the global order of the trace.
+  SequencedSegment = 0x1,
+
+  /// The count of the header is final and all records it covers have been
+  /// written. The writer sets this flag only after the count, so a reader
+  /// drops segments lacking it, e.g. the ones still open at a crash which the
+  /// signal handler could not commit.
+  CommittedSegment = 0x2,
+
+  /// The tid field of every record in the segment holds a timestamp of a clock
+  /// shared by all threads instead of the thread ID, which is stored in the
+  /// segment header. Merging the records of the segments of all threads by
+  /// timestamp, while keeping the order of the records of each thread,
+  /// restores the global order of the trace.
+  TimestampedSegment = 0x4
+};
+
+/// \class This is the header stored in the first slot of a trace segment.
+///
+/// A segment is a run of entries appended by a single writer, e.g. one thread
+/// in the per-thread buffer mode. A trace file which starts with a segment
+/// header is a sequence of segments, each one occupying capacity slots. The
+/// run-time commits a segment when it is full, on exit and on a fatal signal,
+/// so a trace left by a crashed program can be read up to its last committed
+/// segment.
+///
+/// The header has the same size as an Entry so that a segment is simply an
+/// array of entries whose first slot is overloaded.
+struct SegmentHeader {
+  RecordType type; ///< Always RecordType::SGType
+  unsigned flags; ///< Bitwise or of SegmentFlags
+  pthread_t tid; ///< The thread owning the records of this segment
+  uintptr_t capacity; ///< Number of entry slots including the header
+  uintptr_t count; ///< Number of valid records following the header
+
+  /// Padding to keep the header exactly as large as an Entry
+#ifndef __LP64__
+  char padding[12];
+#endif
+};
+
+static_assert(sizeof(SegmentHeader) == sizeof(Entry),
+              "A segment header must occupy exactly one trace entry!");
+
+/// The kinds of checkpoint records, which are stored in their length field.
+///
+/// A checkpoint captures the nesting state of one thread, which is otherwise
+/// only implied by the prefix of the trace. It starts with a CheckpointBegin
+/// record whose id is the number of frame records following it. The frames
+/// are the traced calls to instrumented functions not yet returned, outermost
+/// first. A frame holds the ID of the call instruction and the address of the
+/// function. Records of other threads may be interleaved with the frames.
+///
+/// The run-time writes a checkpoint right before the first record of each
+/// thread and before every GIRI_CHECKPOINT_INTERVAL records of it after that,
+/// so a reader may decode the trace of a thread from any checkpoint on without
+/// looking at the records before it.
+enum CheckpointRecord : uintptr_t {
+  CheckpointBegin = 0,
+  CallFrame = 1
+};
+
+/// The kinds of synchronization records, which are stored in their length
+/// field. The id of a synchronization record is the ID of the call to the
+/// pthread function and its address is the synchronization object, or the
+/// thread ID (not the pthread_t) for ThreadCreated and ThreadJoin.
+///
+/// A release is recorded before the call releasing the object, and an acquire
+/// after the call acquiring it, if it succeeded. The records of a thread up to
+/// a release happen before the records of a thread after a later acquire of
+/// the same object. The records of a thread before creating another thread
+/// happen before all of its records, and all records of a thread happen
+/// before the records of the thread which joined it after the join.
+enum SyncRecord : uintptr_t {
+  MutexLock = 1, ///< Acquire a mutex, read-write lock or spin lock
+  MutexUnlock,   ///< Release a mutex, read-write lock or spin lock
+  ThreadCreate,  ///< Release before creating a thread
+  ThreadCreated, ///< The ID of the thread created after the last ThreadCreate
+  ThreadJoin,    ///< Acquire the records of a joined thread
+  CondSignal,    ///< Release a condition variable by signalling it
+  CondWake,      ///< Acquire a condition variable after waiting for it
+  BarrierArrive, ///< Release a barrier before waiting for it
+  BarrierLeave   ///< Acquire a barrier after waiting for it
+};
+
+/// With GIRI_LAST_WRITER=1, every load record is followed by the last writer
+/// records of the stores it reads, unless the run-time doesn't know all of
+/// them. Their id numbers them from 0, in the order of the memory read. The
+/// address of a last writer record is the ordinal of the store among the store
+/// records of its thread, counting from 1, and its length is the thread ID of
+/// the store. An ordinal of 0 stands for memory which no store has written
+/// since it was allocated.
+///
+/// The records of other threads may come between a load and its last writer
+/// records, but those of the same thread don't.
+
+/// With -giri-branch-trace, basic blocks and selects are not recorded. Every
+/// thread records the outcomes of its conditional branches, switches and
+/// selects as a stream of bits instead, in the order it executes them:
+///  - A conditional branch or a select appends one bit, which is set if its
+///    condition is true.
+///  - A switch appends the value of its condition as a varint, i.e. in groups
+///    of 7 bits starting with the lowest ones, each followed by a bit which is
+///    set if another group follows.
+///
+/// The stream is written in branch outcome records of up to BranchRecordBits
+/// bits. The id of such a record is its number of bits, which are stored from
+/// the lowest bit of address on and continue in length. The last record of a
+/// thread is only written when the trace ends.
+///
+/// A function entry record is written when a thread enters an instrumented
+/// function other than through the call it has just recorded, e.g. main(), the
+/// start routine of a thread or a callback from external code. Its id is the
+/// ID of the entry block and its address the function. Together with the call
+/// records, this lets the trace reader follow the control flow of each thread
+/// through the CFG and rebuild the basic block and select records.
+static const unsigned BranchRecordBits = 128;
+
+/// With GIRI_STRIDE_PREDICTION=1, every thread predicts the address of each
+/// load and store from the stride between the last two executions of the same
+/// instruction. A load or store whose address and size were predicted isn't
+/// written as a record of its own. The keys of up to StrideHitsPerRecord such
+/// hits are packed into a stride hit record instead, which is written before
+/// the next other record of the thread, so the records of a thread stay in the
+/// order it made them.
+///
+/// The key of a hit is the ID of the instruction, with the top bit set for a
+/// store. The keys are stored in id, then in the lower and upper half of
+/// address and of length, and the unused ones are 0. The trace reader replays
+/// the predictions of every thread to recover the records.
+static const unsigned StrideHitsPerRecord = 5;
+
+/// \class The stride predictor of one thread. It is a direct-mapped table
+/// indexed by the key of an instruction, so instructions whose keys collide
+/// only mispredict each other.
+class StridePredictor {
+public:
+  /// Number of bits indexing the table
+  static const unsigned SlotBits = 10;
+
+  StridePredictor() {
+    for (unsigned i = 0; i < (1U << SlotBits); ++i)
+      slots[i].key = 0;
+  }
+
+  /// Get the key of a load or store record.
+  /// \return 0 if the record can't be predicted.
+  static unsigned getKey(RecordType type, unsigned id) {
+    if (!id || id >> 31 ||
+        (type != RecordType::LDType && type != RecordType::STType))
+      return 0;
+    return type == RecordType::STType ? id | (1U << 31) : id;
+  }
+
+  /// Get the record of a load or store from its key and its access.
+  static Entry getRecord(unsigned key, pthread_t tid, uintptr_t address,
+                         uintptr_t length) {
+    return Entry(key >> 31 ? RecordType::STType : RecordType::LDType,
+                 key & ~(1U << 31), tid,
+                 reinterpret_cast<unsigned char *>(address), length);
+  }
+
+  /// Update the prediction of an instruction with its latest access.
+  /// \return true if the access was predicted.
+  bool update(unsigned key, uintptr_t address, uintptr_t length) {
+    Slot &S = slots[index(key)];
+    bool hit = S.key == key && address == S.address + S.stride &&
+               length == S.length;
+    S.stride = S.key == key ? address - S.address : 0;
+    S.key = key;
+    S.address = address;
+    S.length = length;
+    return hit;
+  }
+
+  /// Take the access predicted for an instruction, as if it was made.
+  /// \return false if there is no prediction for the instruction.
+  bool take(unsigned key, uintptr_t &address, uintptr_t &length) {
+    Slot &S = slots[index(key)];
+    if (S.key != key)
+      return false;
+    S.address += S.stride;
+    address = S.address;
+    length = S.length;
+    return true;
+  }
+
+  /// Pack the keys of hits into a stride hit record.
+  static Entry packHits(pthread_t tid, const unsigned *keys, unsigned count) {
+    uint64_t words[2] = { 0, 0 };
+    for (unsigned i = 1; i < count; ++i)
+      words[(i - 1) / 2] |= static_cast<uint64_t>(keys[i]) << ((i - 1) % 2 * 32);
+    return Entry(RecordType::SHType, keys[0], tid,
+                 reinterpret_cast<unsigned char *>(words[0]), words[1]);
+  }
+
+  /// Unpack the keys of the hits of a stride hit record.
+  /// \return the number of keys.
+  static unsigned unpackHits(const Entry &entry, unsigned *keys) {
+    uint64_t words[2] = { entry.address, entry.length };
+    unsigned count = 0;
+    if (entry.id)
+      keys[count++] = entry.id;
+    for (unsigned i = 0; i < 4 && count == i + 1; ++i)
+      if (unsigned key = static_cast<unsigned>(words[i / 2] >> (i % 2 * 32)))
+        keys[count++] = key;
+    return count;
+  }
+
+private:
+  struct Slot {
+    unsigned key; ///< The instruction, or 0 if the slot is empty
+    uintptr_t address; ///< The address of its last access
+    uintptr_t stride; ///< The difference between its last two addresses
+    uintptr_t length; ///< The size of its last access
+  };
+
+  static unsigned index(unsigned key) {
+    return (key * 2654435761U) >> (32 - SlotBits);
+  }
+
+  Slot slots[1U << SlotBits];
+};
+
+/// \class This describes one record of a basic block instrumented with
+/// -giri-batch-blocks. Such a block stores the address of each load and store,
+/// and the flag of each select, into a stack array and passes it to a single
+/// recordBlock() call at its end, together with a constant table of these
+/// descriptions, which the run-time expands into the usual records.
+struct BlockOp {
+  RecordType type; ///< LDType, STType or PDType
+  unsigned id; ///< The ID of the load, store or select instruction
+  uintptr_t length; ///< The size of the memory access in bytes
+};
+
+//===----------------------------------------------------------------------===//
+// Basic block coverage
+//===----------------------------------------------------------------------===//
+
+/// \class This is the header of the file a program instrumented with
+/// -giri-coverage-only writes in place of a trace. It is followed by one byte
+/// for each basic block ID, counting from 0, which is nonzero if the basic
+/// block was executed.
+struct CoverageHeader {
+  char magic[8]; ///< "GIRICOV1"
+  uint64_t blocks; ///< Number of bytes following the header
+};
+
+//===----------------------------------------------------------------------===//
+// Live trace streams in shared memory
+//===----------------------------------------------------------------------===//
+
+/// Maximum number of slots in a trace stream
+static const unsigned MaxStreamSlots = 64;
+
+/// Offset of the first slot in the shared memory object of a stream
+static const unsigned long StreamDataOffset = 4096;
+
+/// \class This is the header of a trace stream in shared memory, which the
+/// run-time publishes the trace into with GIRI_SINK=shm.
+///
+/// The stream is a single-producer single-consumer ring of slots. Each slot
+/// holds one window of the entry cache, laid out as in a trace file. The
+/// run-time fills a slot in place, stores its length and then advances head.
+/// The consumer reads the slot in place and advances tail to release it.
+/// Both sides access head, tail, dropped and done atomically.
+struct StreamHeader {
+  char magic[8]; ///< "GIRISTRM", stored last when creating the stream
+  uint64_t slots; ///< Number of slots in the ring
+  uint64_t slotBytes; ///< Size of one slot in bytes
+  uint64_t head; ///< Number of slots published by the run-time
+  char headPadding[32];
+  uint64_t tail; ///< Number of slots released by the consumer
+  uint32_t attached; ///< Set once a consumer has attached
+  char tailPadding[52];
+  uint64_t dropped; ///< Number of windows dropped as the ring was full
+  uint32_t done; ///< Set after the run-time has published its last slot
+  uint64_t lengths[MaxStreamSlots]; ///< Bytes of entries in each slot
+};
+
+static_assert(sizeof(StreamHeader) <= StreamDataOffset,
+              "The stream header must fit in front of the first slot!");
+
 #endif
@@ -17,6 +17,7 @@
 #include "Giri/Runtime.h"
 #include "Utility/BasicBlockNumbering.h"
 #include "Utility/LoadStoreNumbering.h"
+#include "Utility/TraceReader.h"
 
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
@@ -24,10 +25,12 @@
 
 #include <deque>
 #include <iterator>
+#include <map>
 #include <pthread.h>
 #include <set>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 using namespace llvm;
 using namespace dg;
@@ -151,7 +154,9 @@ public:
 
   /// Initialize a new trace file object. We'll open the trace file and attempt
   /// to mmap() it into memory. This method may not work on 32-bit systems;
-  /// simple trace files are easily 12 GB in size.
+  /// simple trace files are easily 12 GB in size. The segments of the trace
+  /// are merged back into global order while loading, dropping the ones a
+  /// crashed program left uncommitted.
   ///
   /// \param[in] Filename - The name of the trace file.
   /// \param[in] bbNums   - A pointer to the analysis pass that numbers basic blocks.
@@ -229,7 +234,39 @@ public:
 private:
   void fixupLostLoads();
 
-  void buildTraceFunAddrMap();
+  /// Map the functions to their addresses in the traced run.
+  /// \param Filename - The name of the trace, whose function table is read.
+  void buildTraceFunAddrMap(const std::string &Filename);
+
+  /// Rebuild the basic block and select records of a trace recorded with
+  /// -giri-branch-trace from its branch outcomes, and use the rebuilt trace
+  /// instead of the loaded one.
+  void rebuildBranchTrace();
+
+  /// Find the stores a load reads, as linked by the run-time.
+  /// \see TraceReader::findStoreLinks
+  bool findStoreLinks(unsigned long load, std::vector<long> &stores) const;
+
+  /// Index the stores of each thread, and compute the vector clocks of the
+  /// threads from the synchronization records.
+  void buildSyncIndex();
+
+  /// Find the records which happen before a record. Entry U of the result is
+  /// the index of the last record of thread U which happens before the record
+  /// at the given index, or -1 if there is none. Without synchronization
+  /// records or -giri-use-sync, every earlier record is assumed to happen
+  /// before it.
+  std::vector<long> getOrderedBefore(unsigned long index) const;
+
+  /// Find the allocation of the object read by each load from an object whose
+  /// allocation was recorded.
+  void buildAllocationIndex();
+
+  /// Find the allocation of the object read by a load. No store before the
+  /// allocation can be the source of the load.
+  ///
+  /// \return The index of the allocation record, or -1 if it isn't known.
+  long getAllocation(unsigned long load_index) const;
 
   //===--------------------------------------------------------------------===//
   //          Utility methods for scanning through the trace file
@@ -267,10 +304,16 @@ private:
                                 pthread_t tid,
                                 const uintptr_t address);
 
+  void addStoreSource(DynValue &DV,
+                      Worklist_t &Sources,
+                      unsigned long store_index);
+
   void findAllStoresForLoad(DynValue &DV,
                             Worklist_t &Sources,
                             long store_index,
-                            const Entry load_entry);
+                            const Entry load_entry,
+                            const std::vector<long> &bounds,
+                            long allocation);
 
   void getSourcesForPHI(DynValue &DV, Worklist_t &Sources);
 
@@ -295,15 +338,50 @@ private:
   /// The pass that maps loads and stores to identifiers
   const QueryLoadStoreNumbers *lsNumPass;
 
+  /// The loaded trace file which owns the entries
+  TraceReader Reader;
+
   /// Map from functions to their runtime address in trace
   std::map<Function *,  uintptr_t> traceFunAddrMap;
 
+  /// The entries rebuilt from a trace recorded with -giri-branch-trace
+  std::vector<Entry> Rebuilt;
+
+  /// The index in the loaded trace of each rebuilt entry, or -1 for the entries
+  /// rebuilt from the branch outcomes
+  std::vector<long> RebuiltOrigins;
+
+  /// The index in the rebuilt trace of each entry of the loaded trace
+  std::vector<long> RebuiltIndices;
+
   /// Array of entries in the trace
   Entry *trace;
 
   /// Maximum index of trace
   unsigned long maxIndex;
 
+  /// The vector clock of a thread after one of its acquires
+  struct ClockSnapshot {
+    unsigned long index;     ///< Index of the acquire in the trace
+    std::vector<long> clock; ///< The clock, as returned by getOrderedBefore
+  };
+
+  /// Dense numbers of the threads in the trace, by their thread ID
+  std::map<pthread_t, unsigned> ThreadNumbers;
+
+  /// The trace indices of the stores of each thread, in increasing order
+  std::vector<std::vector<unsigned long> > ThreadStores;
+
+  /// The vector clocks of each thread, in increasing order of index
+  std::vector<std::vector<ClockSnapshot> > ThreadClocks;
+
+  /// Whether the trace has synchronization records
+  bool HasSyncRecords;
+
+  /// Pairs of the index of a load and the index of the allocation of the
+  /// object it reads, in increasing order of load index
+  std::vector<std::pair<unsigned long, unsigned long> > LoadAllocations;
+
   /// Set of errorneous Static Values which have issues like missing matching
   /// entries during normalization for some reason
   std::unordered_set<Value *> BuggyValues;
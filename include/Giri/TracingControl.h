@@ -0,0 +1,37 @@
+/*===- TracingControl.h - Pause and resume the tracing run-time -*- C -*-===*\
+|*                                                                          *|
+|*                     Giri: Dynamic Slicing in LLVM                        *|
+|*                                                                          *|
+|* This file was developed by the LLVM research group and is distributed    *|
+|* under the University of Illinois Open Source License. See LICENSE.TXT    *|
+|* for details.                                                             *|
+|*                                                                          *|
+|*===----------------------------------------------------------------------===*|
+|*                                                                          *|
+|* This file declares the functions an instrumented program may call to     *|
+|* trace only some regions of its execution. It can be included from C.     *|
+|*                                                                          *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef GIRI_TRACINGCONTROL_H
+#define GIRI_TRACINGCONTROL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Stop recording entries until giriTracingResume() is called. Tracing can
+ * also be started paused with GIRI_START_PAUSED=1, and it is flipped by the
+ * signal GIRI_TOGGLE_SIGNAL. The signal defaults to SIGRTMIN when starting
+ * paused, and no signal is taken over otherwise. */
+void giriTracingPause(void);
+
+/* Record entries again. Only basic blocks which start after this call are
+ * traced, so every basic block in the trace is complete. */
+void giriTracingResume(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -94,6 +94,11 @@ public:
     return 0;
   }
 
+  /// \return the largest ID of a basic block, or 0 if there is none.
+  unsigned getMaxID() const {
+    return BBMap.empty() ? 0 : BBMap.rbegin()->first;
+  }
+
 protected:
   /// \brief Maps a basic block to the number to which it was assigned.
   /// Note that *multiple* basic blocks can be assigned the same ID (e.g., if a
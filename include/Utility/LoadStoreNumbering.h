@@ -24,6 +24,7 @@
 #include "llvm/InstVisitor.h"
 
 #include <unordered_map>
+#include <vector>
 
 using namespace llvm;
 
@@ -59,6 +60,9 @@ public:
   void visitSelectInst(SelectInst &SI) {
     MD->addOperand(assignID(&SI, ++count));
   }
+  void visitAllocaInst(AllocaInst &AI) {
+    Allocas.push_back(&AI);
+  }
   void visitCallInst(CallInst &CI) {
     // Don't instrument functions that are part of the dynamic tracing
     // run-time libraries.
@@ -73,6 +77,9 @@ private:
 private:
   unsigned count; ///< Counter for assigning unique IDs
   NamedMDNode *MD; ///< Store metadata of each load and store
+
+  /// The allocas, which are numbered after all other instructions
+  std::vector<AllocaInst *> Allocas;
 };
 
 /// \class This pass is an analysis pass that reads the metadata added by the
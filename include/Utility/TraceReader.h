@@ -0,0 +1,163 @@
+//===- TraceReader.h - Load a dynamic trace into memory ---------*- C++ -*-===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file provides a class which loads a trace file written by the tracing
+// run-time and presents it as one array of entries in global order.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DG_TRACEREADER_H
+#define DG_TRACEREADER_H
+
+#include "Giri/Runtime.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace dg {
+
+/// \class The nesting state of one thread, as saved by a checkpoint.
+struct ThreadContext {
+  /// A call being executed
+  struct Frame {
+    unsigned id; ///< The ID of the call instruction
+    uintptr_t function; ///< The address of the function
+  };
+
+  pthread_t tid; ///< The thread
+  unsigned long index; ///< Index of the first record after the checkpoint
+  std::vector<Frame> calls; ///< Traced calls not yet returned, outermost first
+};
+
+/// \class This class loads a trace file into memory.
+///
+/// A flat trace (a flight recorder dump) is mapped directly. A trace made of
+/// segments is merged into an anonymous mapping: segment headers and the
+/// segments which were never committed are dropped, and sequenced records
+/// are put back into their global order with their thread ID restored.
+/// Timestamped records are merged thread by thread in timestamp order.
+///
+/// A chunked trace is opened through its manifest. The segments of all chunks
+/// are merged as if they were one file.
+///
+/// The stride hit records of a trace recorded with GIRI_STRIDE_PREDICTION are
+/// expanded back into the loads and stores they stand for, by replaying the
+/// predictions of every thread.
+///
+/// Either way the loaded trace is terminated by exactly one END record. The
+/// entries are mapped privately, so clients may modify them.
+///
+/// Checkpoint records are taken out of the loaded trace, so clients only see
+/// the records of the program. The nesting state they hold is kept aside, so
+/// that a client can split the trace into ranges and decode each range on its
+/// own, starting from the last checkpoint of each thread. Last writer records
+/// are taken out as well, and the stores they name are kept aside for each
+/// load.
+class TraceReader {
+public:
+  /// Load the trace file. This reports a fatal error if it can't be read.
+  explicit TraceReader(const std::string &Filename);
+  ~TraceReader();
+
+  /// Get the array of entries in the trace
+  Entry *getEntries() const { return trace; }
+
+  /// Get the number of entries including the END record
+  unsigned long size() const { return numEntries; }
+
+  /// Get the checkpoints of all threads in the order of their indices
+  const std::vector<ThreadContext> &getCheckpoints() const {
+    return checkpoints;
+  }
+
+  /// Find the last checkpoint of a thread at or before an index of the trace.
+  /// \return the checkpoint, or nullptr if the thread has none before index.
+  const ThreadContext *findCheckpoint(pthread_t tid, unsigned long index) const;
+
+  /// Split the records before the END record into at most the given number of
+  /// ranges of similar size. A range starts at a checkpoint whenever there is
+  /// one close to the even split, so its decoder replays few records.
+  /// \return the indices where the ranges start followed by the index of the
+  /// END record.
+  std::vector<unsigned long> partition(unsigned parts) const;
+
+  /// Find the stores a load reads, as linked by the run-time.
+  ///
+  /// \param[in] load - The index of the load record.
+  /// \param[out] stores - The indices of the store records, with -1 for
+  ///                      memory which no store wrote.
+  /// \return true if the run-time linked the load to all the stores it reads.
+  bool findStoreLinks(unsigned long load, std::vector<long> &stores) const;
+
+  /// Read the manifest of a chunked trace. Chunks of an incomplete manifest,
+  /// e.g. one left by a killed program, are looked up on disk.
+  ///
+  /// \param[in] Filename - The name of the trace file.
+  /// \param[out] Chunks - The paths of the chunk files in order.
+  /// \return true if the trace file is a manifest, otherwise false.
+  static bool readManifest(const std::string &Filename,
+                           std::vector<std::string> &Chunks);
+
+private:
+  typedef std::vector<std::pair<const Entry *, unsigned long>> FileList;
+
+  /// Committed segments with their number of valid records
+  typedef std::vector<std::pair<const SegmentHeader *, unsigned long>>
+    SegmentList;
+
+  TraceReader(const TraceReader &) = delete;
+  TraceReader &operator=(const TraceReader &) = delete;
+
+  /// Map a file privately and get its number of entries. An empty file is not
+  /// mapped and yields a null pointer.
+  static const Entry *mapFile(const std::string &Filename,
+                              unsigned long &fileEntries);
+
+  /// Merge the segments of the mapped files into a new anonymous mapping.
+  void loadSegments(const FileList &Files);
+
+  /// Merge timestamped segments with a k-way merge of the threads' records.
+  void mergeTimestamped(const SegmentList &Segments);
+
+  /// Squeeze empty slots out of the first slots merged entries, and terminate
+  /// the trace at its first END record.
+  void finishMerge(unsigned long slots);
+
+  /// Expand the stride hit records in the first count entries into loads and
+  /// stores. The entries are moved to a larger mapping if there are any.
+  /// \return the number of entries after expanding them.
+  unsigned long expandStrideHits(unsigned long count);
+
+  /// Take the checkpoint records out of the first count entries, and collect
+  /// the complete checkpoints.
+  /// \return the number of entries left.
+  unsigned long extractCheckpoints(unsigned long count);
+
+  /// Take the last writer records out of the first count entries, and link
+  /// their loads to the stores they name.
+  /// \return the number of entries left.
+  unsigned long extractStoreLinks(unsigned long count);
+
+  /// Map an anonymous, zeroed array of entries.
+  static Entry *allocate(unsigned long entries);
+
+private:
+  Entry *trace; ///< The entries of the trace
+  unsigned long numEntries; ///< Number of entries including the END record
+  size_t mappedBytes; ///< Size of the mapping holding the entries
+  std::vector<ThreadContext> checkpoints; ///< The checkpoints by index
+
+  /// Pairs of the index of a load and the index of a store it reads, by load
+  std::vector<std::pair<unsigned long, long>> links;
+};
+
+} // END namespace dg
+
+#endif
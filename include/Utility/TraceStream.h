@@ -0,0 +1,66 @@
+//===- TraceStream.h - Read a live trace from shared memory -----*- C++ -*-===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file provides a class which consumes the trace a running program
+// publishes in shared memory with GIRI_SINK=shm.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef DG_TRACESTREAM_H
+#define DG_TRACESTREAM_H
+
+#include "Giri/Runtime.h"
+
+#include <string>
+
+namespace dg {
+
+/// \class This class attaches to the trace stream of a running program.
+///
+/// The records are read in place from the slots of the stream, one committed
+/// segment at a time. A slot is released to the program once the client asks
+/// for the next segment, so the records returned by next() stay valid until
+/// then. The program waits for the client when all slots are taken, unless
+/// it drops windows instead (see dropped()).
+class TraceStream {
+public:
+  /// Attach to the stream with the given shared memory name, waiting up to
+  /// the given number of seconds for the program to create it. This reports
+  /// a fatal error if the stream can't be attached to.
+  explicit TraceStream(const std::string &Name, unsigned Timeout = 10);
+  ~TraceStream();
+
+  /// Get the records of the next committed segment, waiting for the program
+  /// to publish one.
+  ///
+  /// \param[out] Records - The records of the segment.
+  /// \param[out] Count - The number of records.
+  /// \return false once the program has finished and all segments were read.
+  bool next(const Entry *&Records, unsigned long &Count);
+
+  /// Get the number of windows the program has dropped so far
+  unsigned long dropped() const;
+
+  /// Get the default stream name of a trace file.
+  static std::string defaultName(const std::string &TraceFilename);
+
+private:
+  TraceStream(const TraceStream &) = delete;
+  TraceStream &operator=(const TraceStream &) = delete;
+
+private:
+  StreamHeader *stream; ///< The mapped stream
+  size_t mappedBytes; ///< Size of the mapping
+  uint64_t tail; ///< The slot being read
+  bool reading; ///< Whether the slot at tail has been handed out
+};
+
+} // END namespace dg
+
+#endif
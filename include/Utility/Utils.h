@@ -261,6 +261,11 @@ static inline bool isTracerFunction(Function *fun) {
           name == "recordStartBB" ||
           name == "recordLoad" ||
           name == "recordStore" ||
+          name == "recordLoad1" || name == "recordStore1" ||
+          name == "recordLoad2" || name == "recordStore2" ||
+          name == "recordLoad4" || name == "recordStore4" ||
+          name == "recordLoad8" || name == "recordStore8" ||
+          name == "recordLoad16" || name == "recordStore16" ||
           name == "recordSelect" ||
           name == "recordStrLoad" ||
           name == "recordStrStore" ||
@@ -268,7 +273,26 @@ static inline bool isTracerFunction(Function *fun) {
           name == "recordLock" ||
           name == "recordUnlock" ||
           name == "recordCall" ||
+          name == "recordSync" ||
+          name == "recordAlloc" ||
+          name == "recordFree" ||
+          name == "recordRealloc" ||
+          name == "recordFunctions" ||
+          name == "recordBlock" ||
+          name == "recordCoverage" ||
+          name == "recordBranch" ||
+          name == "recordSwitch" ||
+          name == "recordEnter" ||
+          name == "recordClonedCall" ||
+          name == "recordTracedEntry" ||
+          name == "giriFastLoad" ||
+          name == "giriFastStore" ||
+          name == "giriFastSelect" ||
+          name == "giriFastLock" ||
+          name == "giriFastUnlock" ||
           name == "recordInit" ||
+          name == "giriTracingPause" ||
+          name == "giriTracingResume" ||
           name == "trace_fn_start" ||
           name == "trace_fn_end" ||
           name == "ddgtrace_init" ||
@@ -0,0 +1,321 @@
+//===- BranchTrace.cpp - Rebuild basic blocks from branch outcomes --------===//
+//
+//                          Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the class which rebuilds the basic block and select
+// records of a trace recorded with -giri-branch-trace.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "giri"
+
+#include "Giri/BranchTrace.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace giri;
+using namespace llvm;
+
+STATISTIC(NumRebuiltBBs, "Number of basic block records rebuilt");
+STATISTIC(NumStuckThreads, "Number of threads whose walk got stuck");
+
+/// Most steps a walk takes without taking a branch outcome. Only a loop which
+/// never branches on a condition is that long.
+static const unsigned MaxSteps = 1U << 20;
+
+/// Get the bit of a record type in the types an instruction has recorded.
+static inline unsigned typeBit(RecordType type) {
+  return 1U << ((static_cast<unsigned>(type) - 'A') & 31);
+}
+
+/// Determine whether an instruction makes a record other than a select record
+/// when it is executed.
+static bool isRecorded(const QueryLoadStoreNumbers *lsNums,
+                       const Instruction *I) {
+  if (isa<SelectInst>(I) || !lsNums->getID(I))
+    return false;
+  return !isa<IntrinsicInst>(I) || isa<MemIntrinsic>(I);
+}
+
+BranchTraceDecoder::BranchTraceDecoder(
+  const QueryBasicBlockNumbers *bbNums,
+  const QueryLoadStoreNumbers *lsNums,
+  const std::map<Function *, uintptr_t> &funAddrMap) :
+  bbNums(bbNums), lsNums(lsNums), funAddrMap(funAddrMap),
+  Output(nullptr), Origins(nullptr) {
+  for (std::map<Function *, uintptr_t>::const_iterator
+       I = funAddrMap.begin(), E = funAddrMap.end(); I != E; ++I)
+    funByAddress[I->second] = I->first;
+}
+
+bool BranchTraceDecoder::isBranchTrace(const Entry *trace) {
+  // Every thread starts with a function entry record, which is written even
+  // while tracing is paused.
+  return trace[0].type == RecordType::FNType;
+}
+
+void BranchTraceDecoder::decode(const Entry *trace, std::vector<Entry> &Output,
+                                std::vector<long> &Origins) {
+  this->Output = &Output;
+  this->Origins = &Origins;
+
+  // Collect the branch outcomes of every thread first, since the last record
+  // of a thread only comes at the end of the trace.
+  std::map<pthread_t, ThreadWalk> Threads;
+  std::vector<pthread_t> Order;
+  unsigned long index = 0;
+  for (; trace[index].type != RecordType::ENType; ++index) {
+    const Entry &entry = trace[index];
+    std::map<pthread_t, ThreadWalk>::iterator T = Threads.find(entry.tid);
+    if (T == Threads.end()) {
+      T = Threads.insert(std::make_pair(entry.tid, ThreadWalk())).first;
+      T->second.count = T->second.next = 0;
+      T->second.stuck = false;
+      Order.push_back(entry.tid);
+    }
+    if (entry.type != RecordType::BRType)
+      continue;
+    ThreadWalk &W = T->second;
+    uint64_t words[] = { entry.address, entry.length };
+    for (unsigned i = 0; i < entry.id && i < BranchRecordBits; ++i, ++W.count) {
+      if (W.count % 64 == 0)
+        W.bits.push_back(0);
+      W.bits.back() |= ((words[i / 64] >> (i % 64)) & 1) << (W.count % 64);
+    }
+  }
+  Output.reserve(index + 1);
+  Origins.reserve(index + 1);
+
+  for (index = 0; trace[index].type != RecordType::ENType; ++index)
+    if (trace[index].type != RecordType::BRType)
+      follow(Threads[trace[index].tid], trace[index], index);
+
+  // Let every thread go as far as it got without making another record, and
+  // terminate its active blocks.
+  for (unsigned i = 0; i < Order.size(); ++i) {
+    ThreadWalk &T = Threads[Order[i]];
+    if (T.stuck)
+      continue;
+    for (unsigned steps = 0;
+         !T.frames.empty() && steps < MaxSteps && advance(T, Order[i], true);
+         ++steps)
+      ;
+    strand(T, Order[i]);
+  }
+  emit(trace[index], index);
+  DEBUG(dbgs() << "Rebuilt " << Output.size() << " records from "
+               << index + 1 << " records of a branch trace\n");
+}
+
+void BranchTraceDecoder::follow(ThreadWalk &T, const Entry &entry,
+                                long index) {
+  // A function entered from outside the instrumented code starts a walk of
+  // its own on top of the interrupted one.
+  if (entry.type == RecordType::FNType) {
+    BasicBlock *BB = bbNums->getBlock(entry.id);
+    if (BB && !T.stuck)
+      enter(T, BB->getParent(), ~0U);
+    return;
+  }
+
+  if (T.stuck) {
+    emit(entry, index);
+    return;
+  }
+
+  Instruction *I = lsNums->getInstByID(entry.id);
+  unsigned long taken = T.next;
+  unsigned steps = 0;
+  while (!T.frames.empty()) {
+    Frame &F = T.frames.back();
+    if (&*F.It == I && !(F.seen & typeBit(entry.type))) {
+      F.seen |= typeBit(entry.type);
+      emit(entry, index);
+      if (entry.type == RecordType::CLType)
+        if (Function *Callee = getCallee(I, entry.address)) {
+          F.descended = true;
+          enter(T, Callee, entry.id);
+        }
+      return;
+    }
+
+    if (T.next != taken) {
+      taken = T.next;
+      steps = 0;
+    }
+    if (++steps > MaxSteps || !advance(T, entry.tid, false))
+      break;
+  }
+
+  // The record can't be reached from where the thread is.
+  strand(T, entry.tid);
+  emit(entry, index);
+}
+
+bool BranchTraceDecoder::advance(ThreadWalk &T, pthread_t tid,
+                                 bool draining) {
+  Frame &F = T.frames.back();
+  Instruction *I = F.It;
+
+  if (CallInst *CI = dyn_cast<CallInst>(I)) {
+    bool called = F.seen & typeBit(RecordType::CLType);
+    bool returned = F.seen & typeBit(RecordType::RTType);
+    if (draining && called && !returned)
+      return false;
+
+    // Follow a call to an instrumented function whose record was dropped.
+    if (!draining && !called && !F.descended && lsNums->getID(CI))
+      if (Function *Callee =
+            dyn_cast<Function>(CI->getCalledValue()->stripPointerCasts()))
+        if (!Callee->isDeclaration()) {
+          F.descended = true;
+          enter(T, Callee, ~0U);
+          return true;
+        }
+  }
+
+  if (draining && !F.seen && isRecorded(lsNums, I))
+    return false;
+
+  if (isa<SelectInst>(I) && !(F.seen & typeBit(RecordType::PDType))) {
+    bool flag;
+    if (!takeBit(T, flag))
+      return false;
+    F.seen |= typeBit(RecordType::PDType);
+    emit(Entry(RecordType::PDType, lsNums->getID(I), tid,
+               reinterpret_cast<unsigned char *>(static_cast<uintptr_t>(flag))),
+         -1);
+  }
+
+  if (isa<TerminatorInst>(I))
+    return finishBlock(T, tid);
+  ++F.It;
+  F.seen = 0;
+  F.descended = false;
+  return true;
+}
+
+bool BranchTraceDecoder::finishBlock(ThreadWalk &T, pthread_t tid) {
+  Frame &F = T.frames.back();
+  BasicBlock *BB = F.It->getParent();
+  TerminatorInst *TI = BB->getTerminator();
+
+  BasicBlock *Next = nullptr;
+  if (BranchInst *BI = dyn_cast<BranchInst>(TI)) {
+    bool taken = true;
+    if (BI->isConditional() && !takeBit(T, taken))
+      return false;
+    Next = BI->getSuccessor(taken ? 0 : 1);
+  } else if (SwitchInst *SI = dyn_cast<SwitchInst>(TI)) {
+    uint64_t value;
+    if (!takeVarint(T, value))
+      return false;
+    IntegerType *Ty = cast<IntegerType>(SI->getCondition()->getType());
+    Next = SI->findCaseValue(ConstantInt::get(Ty, value)).getCaseSuccessor();
+  } else if (!isa<ReturnInst>(TI)) {
+    return false;
+  }
+
+  // The last block of a function carries the ID of the call it returns from.
+  emitBlock(BB, tid, Next ? 0 : F.callID);
+  if (Next) {
+    F.It = Next->begin();
+    F.seen = 0;
+    F.descended = false;
+  } else {
+    T.frames.pop_back();
+  }
+  return true;
+}
+
+void BranchTraceDecoder::strand(ThreadWalk &T, pthread_t tid) {
+  if (!T.stuck && !T.frames.empty()) {
+    DEBUG(dbgs() << "Branch trace of thread " << tid << " can't be followed in "
+                 << T.frames.back().F->getName() << "\n");
+    ++NumStuckThreads;
+  }
+  for (unsigned i = T.frames.size(); i-- > 0; )
+    emitBlock(T.frames[i].It->getParent(), tid, 0);
+  T.frames.clear();
+  T.stuck = true;
+}
+
+void BranchTraceDecoder::enter(ThreadWalk &T, Function *F, unsigned callID) {
+  Frame Callee;
+  Callee.F = F;
+  Callee.It = F->getEntryBlock().begin();
+  Callee.seen = 0;
+  Callee.descended = false;
+  Callee.callID = callID;
+  T.frames.push_back(Callee);
+}
+
+Function *BranchTraceDecoder::getCallee(Instruction *I,
+                                        uintptr_t address) const {
+  CallInst *CI = dyn_cast<CallInst>(I);
+  if (!CI)
+    return nullptr;
+  if (Function *F = dyn_cast<Function>(CI->getCalledValue()->stripPointerCasts()))
+    return F->isDeclaration() ? nullptr : F;
+
+  // An indirect call is followed to the function at the recorded address.
+  std::map<uintptr_t, Function *>::const_iterator F = funByAddress.find(address);
+  return F == funByAddress.end() ? nullptr : F->second;
+}
+
+bool BranchTraceDecoder::takeBit(ThreadWalk &T, bool &bit) {
+  if (T.next == T.count)
+    return false;
+  bit = (T.bits[T.next / 64] >> (T.next % 64)) & 1;
+  ++T.next;
+  return true;
+}
+
+bool BranchTraceDecoder::takeVarint(ThreadWalk &T, uint64_t &value) {
+  // Groups of 7 bits, lowest first, each followed by a continuation bit.
+  unsigned long start = T.next;
+  value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    bool bit;
+    for (unsigned i = 0; i < 7; ++i) {
+      if (!takeBit(T, bit)) {
+        T.next = start;
+        return false;
+      }
+      if (shift + i < 64)
+        value |= static_cast<uint64_t>(bit) << (shift + i);
+    }
+    if (!takeBit(T, bit)) {
+      T.next = start;
+      return false;
+    }
+    if (!bit)
+      return true;
+  }
+  return true;
+}
+
+void BranchTraceDecoder::emit(const Entry &entry, long origin) {
+  Output->push_back(entry);
+  Origins->push_back(origin);
+}
+
+void BranchTraceDecoder::emitBlock(BasicBlock *BB, pthread_t tid,
+                                   unsigned callID) {
+  std::map<Function *, uintptr_t>::const_iterator F =
+    funAddrMap.find(BB->getParent());
+  uintptr_t address = F == funAddrMap.end() ? 0 : F->second;
+  emit(Entry(RecordType::BBType, bbNums->getID(BB), tid,
+             reinterpret_cast<unsigned char *>(address), callID), -1);
+  ++NumRebuiltBBs;
+}
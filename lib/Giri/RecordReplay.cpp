@@ -0,0 +1,108 @@
+//===- RecordReplay.cpp - Intercept nondeterministic library calls --------===//
+//
+//                          Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a pass which redirects the calls to nondeterministic
+// library functions to the record and replay wrappers of the run-time.
+//
+// A program built with -giri-intercept alone logs its nondeterministic inputs
+// when run with GIRI_RR=record, at a small fraction of the cost of tracing. A
+// program built with -trace-giri followed by -giri-intercept replays such a
+// log with GIRI_RR=replay and writes the full trace of the recorded run.
+//
+// fscanf() and scanf() are intercepted under both of the names the C library
+// may declare them with. The run-time takes the sizes of their outputs from
+// the format. The other variadic input functions are not intercepted.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "giri"
+
+#include "Giri/Giri.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/InstIterator.h"
+
+#include <string>
+#include <vector>
+
+using namespace giri;
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+//                        Pass Statistics
+//===----------------------------------------------------------------------===//
+
+STATISTIC(NumIntercepted, "Number of nondeterministic calls intercepted");
+
+//===----------------------------------------------------------------------===//
+//                   InterceptNondeterminism Implementations
+//===----------------------------------------------------------------------===//
+
+char InterceptNondeterminism::ID = 0;
+
+static RegisterPass<InterceptNondeterminism>
+X("giri-intercept", "Intercept nondeterministic calls for record and replay");
+
+/// The library functions which have a giri_rr_ wrapper in the run-time
+static const char *const InterceptedFunctions[] = {
+  "read", "fread", "fgets", "fgetc", "getc", "getchar",
+  "fscanf", "scanf", "__isoc99_fscanf", "__isoc99_scanf",
+  "time", "gettimeofday", "clock_gettime", "rand", "random",
+  "signal",
+  "pthread_create", "pthread_join",
+  "pthread_mutex_lock", "pthread_mutex_trylock", "pthread_mutex_unlock",
+  "pthread_cond_wait", "pthread_cond_timedwait",
+  "pthread_cond_signal", "pthread_cond_broadcast",
+  "pthread_barrier_wait"
+};
+
+bool InterceptNondeterminism::isIntercepted(StringRef Name) {
+  for (unsigned i = 0; i < array_lengthof(InterceptedFunctions); ++i)
+    if (Name == InterceptedFunctions[i])
+      return true;
+  return false;
+}
+
+bool InterceptNondeterminism::runOnModule(Module &M) {
+  // Collect the calls first, as inserting the wrappers changes the module.
+  std::vector<Instruction *> Calls;
+  for (Module::iterator F = M.begin(); F != M.end(); ++F)
+    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+      CallSite CS(&*I);
+      if (!CS)
+        continue;
+      // Calls through a cast of the function are intercepted as well.
+      Function *Callee =
+        dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts());
+      if (Callee && Callee->isDeclaration() && isIntercepted(Callee->getName()))
+        Calls.push_back(&*I);
+    }
+
+  for (unsigned i = 0; i < Calls.size(); ++i) {
+    CallSite CS(Calls[i]);
+    Function *Callee = cast<Function>(CS.getCalledValue()->stripPointerCasts());
+
+    // The wrapper has the type the program declared the function with, and is
+    // cast like the function if the call casts it.
+    std::string Name = "giri_rr_" + Callee->getName().str();
+    Constant *Wrapper = M.getOrInsertFunction(Name, Callee->getFunctionType());
+    if (CS.getCalledValue()->getType() != Wrapper->getType())
+      Wrapper = ConstantExpr::getBitCast(Wrapper,
+                                         CS.getCalledValue()->getType());
+    CS.setCalledFunction(Wrapper);
+    ++NumIntercepted;
+    DEBUG(dbgs() << "Intercepted call to " << Callee->getName() << "\n");
+  }
+
+  return !Calls.empty();
+}
@@ -14,28 +14,42 @@
 #define DEBUG_TYPE "giri"
 
 #include "Giri/TraceFile.h"
+#include "Giri/BranchTrace.h"
 
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/ErrorHandling.h"
 
+#include <algorithm>
 #include <cassert>
+#include <fstream>
+#include <queue>
 #include <vector>
 #include <iostream>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 
 using namespace giri;
 using namespace llvm;
 using namespace std;
 
+//===----------------------------------------------------------------------===//
+//                        Command Line Arguments
+//===----------------------------------------------------------------------===//
+// Pruning the stores by the synchronization records assumes that the program
+// is free of data races, and synchronizes only through the recorded pthread
+// calls. A load which reads a store through a race, or through an atomic or a
+// spin loop on a plain variable, would miss its source. It is off by default,
+// so that every earlier store is searched.
+static cl::opt<bool>
+UseSync("giri-use-sync",
+        cl::desc("Search only the earlier stores which happen before a load "
+                 "for its source, assuming the program is free of data races"),
+        cl::init(false));
+
 //===----------------------------------------------------------------------===//
 //                          Pass Statistics
 //===----------------------------------------------------------------------===//
@@ -48,32 +62,15 @@ STATISTIC(NumDynBuggyVal, "Number of possible missing matched dynamic values");
 TraceFile::TraceFile(string Filename,
                      const QueryBasicBlockNumbers *bbNums,
                      const QueryLoadStoreNumbers *lsNums) :
-  bbNumPass(bbNums), lsNumPass(lsNums),
-  trace(0), totalLoadsTraced(0), lostLoadsTraced(0) {
-  // Open the trace file for read-only access.
-  int fd = open(Filename.c_str(), O_RDONLY);
-  assert((fd > 0) && "Cannot open file!\n");
-
-  // Attempt to get the file size.
-  struct stat finfo;
-  int ret = fstat(fd, &finfo);
-  assert((ret == 0) && "Cannot fstat() file!\n");
-  // Calculate the index of the last record in the trace.
-  maxIndex = finfo.st_size / sizeof(Entry) - 1;
-
-  // Note that we map the whole file in the private memory space. If we don't
-  // have enough VM at this time, this will definitely fail.
-  trace = (Entry *)mmap(0,
-                        finfo.st_size,
-                        PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE,
-                        fd,
-                        0);
-  assert((trace != MAP_FAILED) && "Trace mmap() failed!\n");
-
+  bbNumPass(bbNums), lsNumPass(lsNums), Reader(Filename),
+  trace(Reader.getEntries()), maxIndex(Reader.size() - 1),
+  HasSyncRecords(false), totalLoadsTraced(0), lostLoadsTraced(0) {
+  buildTraceFunAddrMap(Filename);
+  rebuildBranchTrace();
   // Fixup lost loads.
   fixupLostLoads();
-  buildTraceFunAddrMap();
+  buildSyncIndex();
+  buildAllocationIndex();
 
   DEBUG(dbgs() << "TraceFile " << Filename << " successfully initialized.\n");
 }
@@ -351,15 +348,32 @@ void TraceFile::fixupLostLoads() {
 
 /// Build a map from functions to their runtime trace address
 ///
-/// FIXME: Can we record this during trace generation or similar to lsNumPass
-/// This also doesn't work with indirect calls.
-///
-/// Description: Scan forward through the entire trace and record the
-/// runtime function addresses from the trace.  and map the functions
-/// in this run to their corresponding trace function addresses which
-/// can possibly be different This algorithm should be n*c where n
-/// is the number of elements in the trace.
-void TraceFile::buildTraceFunAddrMap(void) {
+/// Description: Read the function table the run-time wrote next to the trace,
+/// which holds the address of every instrumented function, identified by the
+/// ID of its entry block. The table is only used if it was written by the run
+/// which wrote the trace, i.e. it starts with the run ID held by the end record
+/// of the trace. A trace cut short has no end record of its run. Traces
+/// without a table of their run fall back to scanning forward through the
+/// entire trace for call records, which only finds the functions called
+/// directly.
+void TraceFile::buildTraceFunAddrMap(const std::string &Filename) {
+  std::ifstream Table((Filename + ".functions").c_str());
+  unsigned long run;
+  if (Table && !(Table >> run && run && run == trace[maxIndex].address)) {
+    DEBUG(dbgs() << "Ignoring the function table of another run\n");
+    Table.close();
+  }
+  if (Table.is_open()) {
+    unsigned id;
+    unsigned long address;
+    while (Table >> id >> address)
+      if (BasicBlock *BB = bbNumPass->getBlock(id))
+        traceFunAddrMap[BB->getParent()] = address;
+    DEBUG(dbgs() << "traceFunAddrMap.size(): " << traceFunAddrMap.size()
+                 << "\n");
+    return;
+  }
+
   // Loop through the entire trace to look for Call records.
   for (unsigned long index = 0;
        trace[index].type != RecordType::ENType;
@@ -379,6 +393,220 @@ void TraceFile::buildTraceFunAddrMap(void) {
   DEBUG(dbgs() << "traceFunAddrMap.size(): " << traceFunAddrMap.size() << "\n");
 }
 
+void TraceFile::rebuildBranchTrace() {
+  if (!BranchTraceDecoder::isBranchTrace(trace))
+    return;
+
+  BranchTraceDecoder Decoder(bbNumPass, lsNumPass, traceFunAddrMap);
+  Decoder.decode(trace, Rebuilt, RebuiltOrigins);
+  RebuiltIndices.assign(maxIndex + 1, -1);
+  for (unsigned long index = 0; index < RebuiltOrigins.size(); ++index)
+    if (RebuiltOrigins[index] >= 0)
+      RebuiltIndices[RebuiltOrigins[index]] = index;
+
+  trace = &Rebuilt[0];
+  maxIndex = Rebuilt.size() - 1;
+}
+
+bool TraceFile::findStoreLinks(unsigned long load,
+                               std::vector<long> &stores) const {
+  if (RebuiltOrigins.empty())
+    return Reader.findStoreLinks(load, stores);
+
+  // The run-time linked the records of the trace as it was loaded.
+  if (!Reader.findStoreLinks(RebuiltOrigins[load], stores))
+    return false;
+  for (unsigned i = 0; i < stores.size(); ++i)
+    if (stores[i] >= 0)
+      stores[i] = RebuiltIndices[stores[i]];
+  return true;
+}
+
+/// Join the clock of a thread or an object with another clock.
+static void joinClock(std::vector<long> &clock,
+                      const std::vector<long> &other) {
+  for (unsigned i = 0; i < clock.size(); ++i)
+    clock[i] = std::max(clock[i], other[i]);
+}
+
+void TraceFile::buildSyncIndex(void) {
+  // Number the threads, and find the ThreadCreate record preceding the
+  // creation of each thread.
+  std::map<pthread_t, unsigned long> Creators;
+  std::map<pthread_t, unsigned long> LastCreate;
+  for (unsigned long index = 0;
+       trace[index].type != RecordType::ENType;
+       ++index) {
+    const Entry &entry = trace[index];
+    ThreadNumbers.insert(make_pair(entry.tid, (unsigned)ThreadNumbers.size()));
+    if (entry.type != RecordType::SYType)
+      continue;
+    HasSyncRecords = true;
+    if (entry.length == ThreadCreate)
+      LastCreate[entry.tid] = index;
+    else if (entry.length == ThreadCreated && LastCreate.count(entry.tid))
+      Creators[(pthread_t)entry.address] = LastCreate[entry.tid];
+  }
+
+  unsigned threads = ThreadNumbers.size();
+  ThreadStores.resize(threads);
+  ThreadClocks.resize(threads);
+
+  // Replay the synchronization on vector clocks. The entry of a thread in its
+  // own clock is the index of its last record.
+  std::vector<std::vector<long> > Clocks(threads,
+                                        std::vector<long>(threads, -1));
+  std::map<uintptr_t, std::vector<long> > ObjectClocks;
+  std::map<unsigned long, std::vector<long> > CreateClocks;
+  std::vector<bool> Started(threads, false);
+  for (unsigned long index = 0;
+       trace[index].type != RecordType::ENType;
+       ++index) {
+    const Entry &entry = trace[index];
+    unsigned t = ThreadNumbers[entry.tid];
+    std::vector<long> &clock = Clocks[t];
+
+    // The first record of a created thread follows what its creator did
+    // before creating it.
+    bool acquired = false;
+    if (!Started[t]) {
+      Started[t] = true;
+      std::map<pthread_t, unsigned long>::iterator C = Creators.find(entry.tid);
+      if (C != Creators.end() && CreateClocks.count(C->second)) {
+        joinClock(clock, CreateClocks[C->second]);
+        acquired = true;
+      }
+    }
+    clock[t] = index;
+
+    if (entry.type == RecordType::STType)
+      ThreadStores[t].push_back(index);
+    if (entry.type == RecordType::SYType)
+      switch (entry.length) {
+        case MutexUnlock:
+        case CondSignal:
+        case BarrierArrive: {
+          std::vector<long> &object = ObjectClocks[entry.address];
+          if (object.empty())
+            object = clock;
+          else
+            joinClock(object, clock);
+          break;
+        }
+        case ThreadCreate:
+          CreateClocks[index] = clock;
+          break;
+        case MutexLock:
+        case CondWake:
+        case BarrierLeave: {
+          std::map<uintptr_t, std::vector<long> >::iterator O =
+            ObjectClocks.find(entry.address);
+          if (O != ObjectClocks.end()) {
+            joinClock(clock, O->second);
+            acquired = true;
+          }
+          break;
+        }
+        case ThreadJoin: {
+          std::map<pthread_t, unsigned>::iterator J =
+            ThreadNumbers.find((pthread_t)entry.address);
+          if (J != ThreadNumbers.end()) {
+            joinClock(clock, Clocks[J->second]);
+            acquired = true;
+          }
+          break;
+        }
+      }
+
+    if (acquired) {
+      ClockSnapshot snapshot = { index, clock };
+      ThreadClocks[t].push_back(snapshot);
+    }
+  }
+
+  DEBUG(dbgs() << "Indexed " << threads << " threads"
+               << (HasSyncRecords ? " with" : " without")
+               << " synchronization records\n");
+}
+
+std::vector<long> TraceFile::getOrderedBefore(unsigned long index) const {
+  std::vector<long> bounds(ThreadNumbers.size(), index);
+  if (!HasSyncRecords || !UseSync)
+    return bounds;
+
+  // Take the clock after the last acquire of the thread up to the record.
+  unsigned t = ThreadNumbers.find(trace[index].tid)->second;
+  const std::vector<ClockSnapshot> &snapshots = ThreadClocks[t];
+  unsigned lo = 0, hi = snapshots.size();
+  while (lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    if (snapshots[mid].index <= index)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo)
+    bounds = snapshots[lo - 1].clock;
+  else
+    bounds.assign(bounds.size(), -1);
+  bounds[t] = index;
+  return bounds;
+}
+
+void TraceFile::buildAllocationIndex(void) {
+  // The live objects, mapping their start addresses to their end addresses and
+  // the indices of their allocations. Stack variables are never freed, but are
+  // replaced by the variables allocated over them.
+  typedef std::map<uintptr_t, std::pair<uintptr_t, unsigned long> > ObjectMap;
+  ObjectMap Objects;
+  for (unsigned long index = 0;
+       trace[index].type != RecordType::ENType;
+       ++index) {
+    const Entry &entry = trace[index];
+    switch (entry.type) {
+      case RecordType::ALType: {
+        if (!entry.length)
+          break;
+        uintptr_t end = entry.address + entry.length;
+        ObjectMap::iterator O = Objects.lower_bound(entry.address);
+        if (O != Objects.begin() && (--O)->second.first <= entry.address)
+          ++O;
+        while (O != Objects.end() && O->first < end)
+          Objects.erase(O++);
+        Objects[entry.address] = std::make_pair(end, index);
+        break;
+      }
+      case RecordType::FRType:
+        Objects.erase(entry.address);
+        break;
+      case RecordType::LDType: {
+        ObjectMap::iterator O = Objects.upper_bound(entry.address);
+        if (O == Objects.begin())
+          break;
+        --O;
+        // The load must be within the object.
+        if (entry.address + entry.length <= O->second.first)
+          LoadAllocations.push_back(std::make_pair(index, O->second.second));
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  DEBUG(dbgs() << LoadAllocations.size()
+               << " loads read from recorded allocations\n");
+}
+
+long TraceFile::getAllocation(unsigned long load_index) const {
+  std::vector<std::pair<unsigned long, unsigned long> >::const_iterator A =
+    std::lower_bound(LoadAllocations.begin(), LoadAllocations.end(),
+                     std::make_pair(load_index, 0UL));
+  if (A == LoadAllocations.end() || A->first != load_index)
+    return -1;
+  return A->second;
+}
+
 /// This method searches backwards in the trace file for an entry of the
 /// specified type and ID.
 ///
@@ -419,8 +647,9 @@ unsigned long TraceFile::findPreviousID(unsigned long start_index,
 }
 
 /// This method searches backwards in the trace file for an entry of the
-/// specified type and ID taking recursion into account.
-/// FIXME: Doesn't work for recursion through indirect function calls
+/// specified type and ID taking recursion into account. Recursion through
+/// indirect function calls is only tracked with the function table of the run
+/// which wrote the trace.
 ///
 /// \param fun - Function to which this search entry belongs.
 ///              Needed to check recursion.
@@ -865,38 +1094,80 @@ static inline bool overlaps(const Entry &first, const Entry &second) {
   return true;
 }
 
+/// This method adds the dynamic store instruction of a store record as a source
+/// of a dynamic value which reads from memory.
+///
+/// \param DV[in] - the dynamic value of the load instruction
+/// \param Sources[out] - the work list to add the store to
+/// \param store_index - the index of the store record in the trace file
+void TraceFile::addStoreSource(DynValue &DV,
+                               Worklist_t &Sources,
+                               unsigned long store_index) {
+  // Find the LLVM store instruction(s) that match this dynamic store
+  // instruction.
+  Instruction *SI = lsNumPass->getInstByID(trace[store_index].id);
+  assert(SI);
+
+  // Scan forward through the trace to get the basic block in which the
+  // store was executed.
+  unsigned storeBBID = bbNumPass->getID(SI->getParent());
+  unsigned long bbindex = findNextNestedID(store_index,
+                                           RecordType::BBType,
+                                           storeBBID,
+                                           trace[store_index].id,
+                                           trace[store_index].tid);
+  // Record the store instruction as a source.
+  // FIXME: This should handle *all* stores with the ID.  It is possible
+  // that this occurs through function cloning.
+  DynValue NDV = DynValue(SI, bbindex);
+  addToWorklist(NDV, Sources, DV);
+}
+
 /// This method, given a dynamic value that reads from memory, will find the
-/// dynamic value(s) that stores into the same memory.
+/// dynamic value(s) that stores into the same memory. Only the stores which
+/// happen before the load are searched, walking back through the stores of
+/// all threads at once, and the search stops at the allocation of the object
+/// read by the load.
 ///
 /// \param DV[in] - the dynamic value of the load instruction
 /// \param Sources[out] - the work list to add the related values
 /// \param store_index - the index in the trace file to start with
 /// \param load_entry - the load entry
+/// \param bounds - the last record of each thread happening before the load
+/// \param allocation - the allocation of the object read by the load, or -1
 void TraceFile::findAllStoresForLoad(DynValue &DV,
                                      Worklist_t &Sources,
                                      long store_index,
-                                     const Entry load_entry) {
-  while (store_index >= 0) {
-    if (trace[store_index].type == RecordType::STType &&
-        overlaps(trace[store_index], load_entry)) {
-      // Find the LLVM store instruction(s) that match this dynamic store
-      // instruction.
-      Instruction *SI = lsNumPass->getInstByID(trace[store_index].id);
-      assert(SI);
-
-      // Scan forward through the trace to get the basic block in which the
-      // store was executed.
-      unsigned storeBBID = bbNumPass->getID(SI->getParent());
-      unsigned long bbindex = findNextNestedID(store_index,
-                                               RecordType::BBType,
-                                               storeBBID,
-                                               trace[store_index].id,
-                                               trace[store_index].tid);
-      // Record the store instruction as a source.
-      // FIXME: This should handle *all* stores with the ID.  It is possible
-      // that this occurs through function cloning.
-      DynValue NDV = DynValue(SI, bbindex);
-      addToWorklist(NDV, Sources, DV);
+                                     const Entry load_entry,
+                                     const std::vector<long> &bounds,
+                                     long allocation) {
+  // The latest store of each thread which may be the source, ordered by its
+  // index in the trace.
+  typedef std::pair<long, unsigned> Cursor;
+  std::priority_queue<Cursor> Cursors;
+  std::vector<long> positions(ThreadStores.size());
+  for (unsigned t = 0; t < ThreadStores.size(); ++t) {
+    const std::vector<unsigned long> &stores = ThreadStores[t];
+    long bound = std::min(store_index, bounds[t]);
+    positions[t] = -1;
+    if (bound >= 0)
+      positions[t] = std::upper_bound(stores.begin(), stores.end(),
+                                      (unsigned long)bound) -
+                     stores.begin() - 1;
+    if (positions[t] >= 0)
+      Cursors.push(Cursor(stores[positions[t]], t));
+  }
+
+  bool found = false;
+  while (!Cursors.empty()) {
+    store_index = Cursors.top().first;
+    unsigned t = Cursors.top().second;
+    Cursors.pop();
+    // The memory held no value of the program before its allocation.
+    if (store_index < allocation)
+      break;
+    if (overlaps(trace[store_index], load_entry)) {
+      addStoreSource(DV, Sources, store_index);
 
       Entry &store_entry = trace[store_index];
       // Find stores corresponding to any non-overlapping part of load
@@ -905,7 +1176,8 @@ void TraceFile::findAllStoresForLoad(DynValue &DV,
         Entry new_entry;
         new_entry.address = load_entry.address;
         new_entry.length = store_entry.address - load_entry.address;
-        findAllStoresForLoad(DV, Sources, store_index - 1, new_entry);
+        findAllStoresForLoad(DV, Sources, store_index - 1, new_entry, bounds,
+                             allocation);
       }
 
       // Find stores corresponding to any non-overlapping part of load
@@ -916,11 +1188,14 @@ void TraceFile::findAllStoresForLoad(DynValue &DV,
         Entry new_entry;
         new_entry.address = store_end;
         new_entry.length = load_end - store_end;
-        findAllStoresForLoad(DV, Sources, store_index - 1, new_entry);
+        findAllStoresForLoad(DV, Sources, store_index - 1, new_entry, bounds,
+                             allocation);
       }
+      found = true;
       break;
     }
-    --store_index;
+    if (--positions[t] >= 0)
+      Cursors.push(Cursor(ThreadStores[t][positions[t]], t));
   }
 
   // It is possible that this load reads data that was stored by something
@@ -929,7 +1204,7 @@ void TraceFile::findAllStoresForLoad(DynValue &DV,
 
   // If we can't find the source of the load, then just ignore it.  The trail
   // ends here.
-  if (store_index == -1) {
+  if (!found) {
     // This load may be uninitialized or we don't support a special function
     // which may be storing to this load
     DEBUG(dbgs() << "We can't find the source of the load:");
@@ -1005,8 +1280,25 @@ void TraceFile::getSourcesForLoad(DynValue &DV,
       continue;
     }
 
+    // Take the stores the run-time linked the load to, if it did, instead of
+    // searching for them.
+    std::vector<long> linked;
+    if (findStoreLinks(block_index, linked)) {
+      bool sourced = false;
+      for (unsigned i = 0; i < linked.size(); ++i)
+        if (linked[i] >= 0) {
+          addStoreSource(DV, Sources, linked[i]);
+          sourced = true;
+        }
+      if (!sourced)
+        ++lostLoadsTraced;
+      continue;
+    }
+
     long store_index = block_index - 1;
-    findAllStoresForLoad(DV, Sources, store_index, trace[block_index]);
+    findAllStoresForLoad(DV, Sources, store_index, trace[block_index],
+                         getOrderedBefore(block_index),
+                         getAllocation(block_index));
 
     /*
     while ((store_index >= 0) &&
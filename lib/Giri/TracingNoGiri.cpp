@@ -21,12 +21,22 @@
 #include "Utility/Utils.h"
 #include "Utility/VectorExtras.h"
 
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/InstIterator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include <vector>
@@ -41,6 +51,44 @@ using namespace llvm;
 // this shared command line option was defined in the Utility so
 extern llvm::cl::opt<std::string> TraceFilename;
 
+static cl::opt<bool>
+DualClone("giri-dual-clone",
+          cl::desc("Keep an uninstrumented clone of every function, which is "
+                   "run while tracing is disabled"),
+          cl::init(false));
+
+static cl::opt<bool>
+TraceAllocations("giri-trace-allocations",
+                 cl::desc("Record heap and stack allocations, which bound the "
+                          "search for the stores read by a load"),
+                 cl::init(false));
+
+static cl::opt<bool>
+BatchBlocks("giri-batch-blocks",
+            cl::desc("Record the loads, stores and selects of a basic block "
+                     "which calls no function with a single call at its end"),
+            cl::init(false));
+
+static cl::opt<std::string>
+InlineRuntime("giri-inline-runtime",
+              cl::desc("Link the fast path of the run-time from the given "
+                       "bitcode module and inline it into the program"),
+              cl::value_desc("rtgiri-fastpath.bc"),
+              cl::init(""));
+
+static cl::opt<bool>
+CoverageOnly("giri-coverage-only",
+             cl::desc("Only record which basic blocks are executed, in an "
+                      "array written to the trace file on exit"),
+             cl::init(false));
+
+static cl::opt<bool>
+BranchTrace("giri-branch-trace",
+            cl::desc("Record the outcomes of branches, switches and selects "
+                     "instead of basic blocks, which the trace reader rebuilds "
+                     "from the CFG"),
+            cl::init(false));
+
 //===----------------------------------------------------------------------===//
 //                        Pass Statistics
 //===----------------------------------------------------------------------===//
@@ -54,6 +102,13 @@ STATISTIC(NumLoadStrings, "Number of load instructions processed");
 STATISTIC(NumStoreStrings, "Number of store instructions processed");
 STATISTIC(NumCalls, "Number of call instructions processed");
 STATISTIC(NumExtFuns, "Number of special external calls processed, e.g. memcpy");
+STATISTIC(NumClones, "Number of uninstrumented function clones");
+STATISTIC(NumSyncs, "Number of pthread synchronization calls processed");
+STATISTIC(NumAllocations, "Number of allocations and frees processed");
+STATISTIC(NumBatchedBBs, "Number of basic blocks recorded by a single call");
+STATISTIC(NumInlined, "Number of record calls inlined from the fast path");
+STATISTIC(NumSized, "Number of loads and stores recorded without a size");
+STATISTIC(NumBranches, "Number of branches and switches recording their outcome");
 
 //===----------------------------------------------------------------------===//
 //                        TracingNoGiri Implementations
@@ -77,6 +132,12 @@ static bool hasPHI(const BasicBlock & BB) {
   return false;
 }
 
+/// This function determines whether an instruction is recorded by the call at
+/// the end of its basic block if the block is batched.
+static bool isBatchedRecord(const Instruction *I) {
+  return isa<LoadInst>(I) || isa<StoreInst>(I) || isa<SelectInst>(I);
+}
+
 bool TracingNoGiri::doInitialization(Module & M) {
   // Get references to the different types that we'll need.
   Int8Type  = IntegerType::getInt8Ty(M.getContext());
@@ -84,6 +145,7 @@ bool TracingNoGiri::doInitialization(Module & M) {
   Int64Type = IntegerType::getInt64Ty(M.getContext());
   VoidPtrType = PointerType::getUnqual(Int8Type);
   VoidType = Type::getVoidTy(M.getContext());
+  BlockOpType = StructType::get(Int32Type, Int32Type, Int64Type, nullptr);
 
   // Get a reference to the run-time's initialization function
   Init = cast<Function>(M.getOrInsertFunction("recordInit",
@@ -126,6 +188,23 @@ bool TracingNoGiri::doInitialization(Module & M) {
                                                     Int64Type,
                                                     nullptr));
 
+  // Add the functions for loads and stores of the common sizes.
+  for (unsigned i = 0; i < NumSizeClasses; ++i) {
+    std::string Size = utostr(1U << i);
+    RecordSizedLoad[i] =
+      cast<Function>(M.getOrInsertFunction("recordLoad" + Size,
+                                           VoidType,
+                                           Int32Type,
+                                           VoidPtrType,
+                                           nullptr));
+    RecordSizedStore[i] =
+      cast<Function>(M.getOrInsertFunction("recordStore" + Size,
+                                           VoidType,
+                                           Int32Type,
+                                           VoidPtrType,
+                                           nullptr));
+  }
+
   RecordStrLoad = cast<Function>(M.getOrInsertFunction("recordStrLoad",
                                                        VoidType,
                                                        Int32Type,
@@ -181,10 +260,330 @@ bool TracingNoGiri::doInitialization(Module & M) {
                                                       Int32Type,
                                                       Int8Type,
                                                       nullptr));
+
+  RecordSync = cast<Function>(M.getOrInsertFunction("recordSync",
+                                                    VoidType,
+                                                    Int32Type,
+                                                    Int32Type,
+                                                    Int64Type,
+                                                    Int32Type,
+                                                    nullptr));
+
+  RecordAlloc = cast<Function>(M.getOrInsertFunction("recordAlloc",
+                                                     VoidType,
+                                                     Int32Type,
+                                                     VoidPtrType,
+                                                     Int64Type,
+                                                     nullptr));
+
+  RecordFree = cast<Function>(M.getOrInsertFunction("recordFree",
+                                                    VoidType,
+                                                    Int32Type,
+                                                    VoidPtrType,
+                                                    nullptr));
+
+  RecordRealloc = cast<Function>(M.getOrInsertFunction("recordRealloc",
+                                                       VoidType,
+                                                       Int32Type,
+                                                       VoidPtrType,
+                                                       VoidPtrType,
+                                                       Int64Type,
+                                                       nullptr));
+
+  RecordFunctions = cast<Function>(M.getOrInsertFunction(
+                                     "recordFunctions",
+                                     VoidType,
+                                     Int32Type,
+                                     PointerType::getUnqual(Int32Type),
+                                     PointerType::getUnqual(VoidPtrType),
+                                     nullptr));
+
+  // Add the function for recording a basic block with all its loads, stores
+  // and selects.
+  RecordBlock = cast<Function>(M.getOrInsertFunction(
+                                 "recordBlock",
+                                 VoidType,
+                                 Int32Type,
+                                 VoidPtrType,
+                                 Int32Type,
+                                 Int32Type,
+                                 PointerType::getUnqual(BlockOpType),
+                                 PointerType::getUnqual(Int64Type),
+                                 nullptr));
+
+  // Add the function registering the coverage array with the run-time.
+  RecordCoverage = cast<Function>(M.getOrInsertFunction("recordCoverage",
+                                                        VoidType,
+                                                        VoidPtrType,
+                                                        VoidPtrType,
+                                                        Int32Type,
+                                                        nullptr));
+
+  // Add the functions for recording the branch outcome stream.
+  RecordBranch = cast<Function>(M.getOrInsertFunction("recordBranch",
+                                                      VoidType,
+                                                      Int8Type,
+                                                      nullptr));
+
+  RecordSwitch = cast<Function>(M.getOrInsertFunction("recordSwitch",
+                                                      VoidType,
+                                                      Int64Type,
+                                                      nullptr));
+
+  RecordEnter = cast<Function>(M.getOrInsertFunction("recordEnter",
+                                                     VoidType,
+                                                     Int32Type,
+                                                     VoidPtrType,
+                                                     nullptr));
+
+  RecordClonedCall = cast<Function>(M.getOrInsertFunction("recordClonedCall",
+                                                          VoidType,
+                                                          Int32Type,
+                                                          VoidPtrType,
+                                                          nullptr));
+
+  RecordTracedEntry = cast<Function>(M.getOrInsertFunction("recordTracedEntry",
+                                                           VoidType,
+                                                           VoidPtrType,
+                                                           nullptr));
+
+  // An untraced clone records no branches, so the trace couldn't be rebuilt.
+  if (BranchTrace && DualClone)
+    report_fatal_error("-giri-branch-trace can't be used with "
+                       "-giri-dual-clone");
+
+  // Record loads, stores and selects through the fast path if requested.
+  if (!InlineRuntime.empty())
+    linkFastPath(M);
   createCtor(M);
   return true;
 }
 
+void TracingNoGiri::linkFastPath(Module &M) {
+  SMDiagnostic Err;
+  Module *FastPath = ParseIRFile(InlineRuntime, Err, M.getContext());
+  if (!FastPath)
+    report_fatal_error(Twine("Cannot read the fast path of the run-time ") +
+                       "from " + InlineRuntime + ": " + Err.getMessage());
+
+  // Remember the functions of the fast path, which are not instrumented.
+  std::vector<std::string> Names;
+  for (Module::iterator F = FastPath->begin(), E = FastPath->end(); F != E; ++F)
+    if (!F->isDeclaration())
+      Names.push_back(F->getName().str());
+
+  std::string ErrMsg;
+  if (Linker::LinkModules(&M, FastPath, Linker::DestroySource, &ErrMsg))
+    report_fatal_error("Cannot link the fast path of the run-time: " + ErrMsg);
+  delete FastPath;
+  for (unsigned i = 0; i < Names.size(); ++i)
+    if (Function *F = M.getFunction(Names[i]))
+      FastPathFunctions.insert(F);
+
+  // Call the fast path instead of the run-time. The functions are inlined at
+  // the end, so they are only needed by this module.
+  Function **Records[] = {
+    &RecordLoad, &RecordStore, &RecordSelect, &RecordLock, &RecordUnlock
+  };
+  const char *FastNames[] = {
+    "giriFastLoad", "giriFastStore", "giriFastSelect", "giriFastLock",
+    "giriFastUnlock"
+  };
+  for (unsigned i = 0; i < array_lengthof(Records); ++i) {
+    Function *F = M.getFunction(FastNames[i]);
+    if (!F || F->isDeclaration())
+      report_fatal_error(std::string(FastNames[i]) + " is missing from " +
+                         InlineRuntime);
+    F->setLinkage(GlobalValue::InternalLinkage);
+    F->addFnAttr(Attribute::AlwaysInline);
+    *Records[i] = F;
+  }
+}
+
+void TracingNoGiri::inlineFastPath() {
+  Function *Records[] = {
+    RecordLoad, RecordStore, RecordSelect, RecordLock, RecordUnlock
+  };
+  for (unsigned i = 0; i < array_lengthof(Records); ++i) {
+    std::vector<CallInst *> Calls;
+    for (Value::use_iterator U = Records[i]->use_begin(),
+         E = Records[i]->use_end(); U != E; ++U)
+      if (CallInst *CI = dyn_cast<CallInst>(*U))
+        if (!FastPathFunctions.count(CI->getParent()->getParent()))
+          Calls.push_back(CI);
+
+    for (unsigned j = 0; j < Calls.size(); ++j) {
+      InlineFunctionInfo IFI;
+      if (InlineFunction(Calls[j], IFI))
+        ++NumInlined; // Update statistics
+    }
+  }
+}
+
+bool TracingNoGiri::doFinalization(Module &M) {
+  if (CoverageOnly) {
+    registerCoverage(M);
+    return true;
+  }
+
+  bool Changed = createFunctionTable(M);
+  if (DualClone)
+    Changed |= createUntracedClones(M);
+
+  // Inline the fast path last, since the untraced clones drop the calls to
+  // the run-time.
+  if (!InlineRuntime.empty()) {
+    inlineFastPath();
+    Changed = true;
+  }
+  return Changed;
+}
+
+bool TracingNoGiri::createUntracedClones(Module &M) {
+  // The run-time defines the flag, which is only cleared while tracing is
+  // paused.
+  TracingEnabled = cast<GlobalVariable>(M.getOrInsertGlobal("giriTracingEnabled",
+                                                            Int32Type));
+
+  // Collect the functions first, since cloning adds to the function list.
+  // Every instrumented function pushes its call when its instrumented body is
+  // entered, since only that body pops it. Variadic functions can't forward
+  // their arguments to a clone, so they always run the instrumented body.
+  std::vector<Function *> Functions;
+  for (Module::iterator F = M.begin(), E = M.end(); F != E; ++F) {
+    if (F->isDeclaration() || F->getName() == "giriCtor" ||
+        FastPathFunctions.count(F))
+      continue;
+    instrumentTracedEntry(*F);
+    if (!F->isVarArg())
+      Functions.push_back(F);
+  }
+
+  for (unsigned i = 0; i < Functions.size(); ++i)
+    createUntracedClone(*Functions[i]);
+  return !Functions.empty();
+}
+
+void TracingNoGiri::instrumentTracedEntry(Function &F) {
+  Instruction *I = F.getEntryBlock().getFirstInsertionPt();
+  Value *FP = castTo(&F, VoidPtrType, "", I);
+  Instruction *E = CallInst::Create(RecordTracedEntry, FP, "", I);
+  instrumentLock(E);
+  instrumentUnlock(E);
+}
+
+bool TracingNoGiri::createFunctionTable(Module &M) {
+  Function *Ctor = M.getFunction("giriCtor");
+  if (TracedFunctions.empty() || !Ctor)
+    return false;
+
+  // Build constant arrays of the IDs and the addresses of the functions.
+  std::vector<Constant *> IDs, Addresses;
+  for (unsigned i = 0; i < TracedFunctions.size(); ++i) {
+    IDs.push_back(ConstantInt::get(Int32Type, TracedFunctions[i].first));
+    Addresses.push_back(ConstantExpr::getBitCast(TracedFunctions[i].second,
+                                                 VoidPtrType));
+  }
+  ArrayType *IDsType = ArrayType::get(Int32Type, IDs.size());
+  ArrayType *AddressesType = ArrayType::get(VoidPtrType, Addresses.size());
+  GlobalVariable *IDTable =
+    new GlobalVariable(M, IDsType, true, GlobalValue::InternalLinkage,
+                       ConstantArray::get(IDsType, IDs), "giri.function.ids");
+  GlobalVariable *AddressTable =
+    new GlobalVariable(M, AddressesType, true, GlobalValue::InternalLinkage,
+                       ConstantArray::get(AddressesType, Addresses),
+                       "giri.function.addresses");
+
+  // Pass the table to the run-time right after initializing it.
+  Value *Count = ConstantInt::get(Int32Type, IDs.size());
+  Value *IDsPtr =
+    ConstantExpr::getBitCast(IDTable, PointerType::getUnqual(Int32Type));
+  Value *AddressesPtr =
+    ConstantExpr::getBitCast(AddressTable, PointerType::getUnqual(VoidPtrType));
+  std::vector<Value *> args = make_vector(Count, IDsPtr, AddressesPtr, 0);
+  CallInst::Create(RecordFunctions, args, "",
+                   Ctor->getEntryBlock().getTerminator());
+  return true;
+}
+
+bool TracingNoGiri::isRuntimeCall(const Instruction *I) const {
+  const CallInst *CI = dyn_cast<CallInst>(I);
+  if (!CI)
+    return false;
+  const Function *F = CI->getCalledFunction();
+  for (unsigned i = 0; i < NumSizeClasses; ++i)
+    if (F == RecordSizedLoad[i] || F == RecordSizedStore[i])
+      return true;
+  return F == RecordBB || F == RecordStartBB || F == RecordLoad ||
+         F == RecordStore || F == RecordSelect || F == RecordStrLoad ||
+         F == RecordStrStore || F == RecordStrcatStore || F == RecordCall ||
+         F == RecordReturn || F == RecordExtCall || F == RecordExtCallRet ||
+         F == RecordLock || F == RecordUnlock || F == RecordSync ||
+         F == RecordAlloc || F == RecordFree || F == RecordRealloc ||
+         F == RecordFunctions || F == RecordBlock || F == RecordCoverage ||
+         F == RecordBranch || F == RecordSwitch || F == RecordEnter ||
+         F == RecordClonedCall || F == RecordTracedEntry;
+}
+
+Function *TracingNoGiri::getSizedRecord(Function *const *Records,
+                                        uint64_t Size) const {
+  // The inlined fast path gets the size as a constant anyway.
+  if (!InlineRuntime.empty() || !isPowerOf2_64(Size) ||
+      Size > (1U << (NumSizeClasses - 1)))
+    return nullptr;
+  return Records[Log2_64(Size)];
+}
+
+void TracingNoGiri::createUntracedClone(Function &F) {
+  // Clone the instrumented function and strip the calls to the run-time, as
+  // well as the casts computing their arguments. The clone has no ID, so it is
+  // invisible to the slicer.
+  ValueToValueMapTy VMap;
+  Function *Untraced = CloneFunction(&F, VMap, false);
+  Untraced->setName(F.getName() + ".giri.untraced");
+  Untraced->setLinkage(GlobalValue::InternalLinkage);
+  F.getParent()->getFunctionList().push_back(Untraced);
+
+  std::vector<Instruction *> Calls;
+  for (inst_iterator I = inst_begin(Untraced), E = inst_end(Untraced);
+       I != E; ++I)
+    if (isRuntimeCall(&*I))
+      Calls.push_back(&*I);
+  for (unsigned i = 0; i < Calls.size(); ++i) {
+    std::vector<Value *> Operands(Calls[i]->op_begin(), Calls[i]->op_end());
+    Calls[i]->eraseFromParent();
+    for (unsigned j = 0; j < Operands.size(); ++j)
+      RecursivelyDeleteTriviallyDeadInstructions(Operands[j]);
+  }
+
+  // Check the flag in a new entry block, which calls the clone if tracing is
+  // disabled and goes on with the instrumented body otherwise.
+  LLVMContext &Context = F.getContext();
+  BasicBlock *Body = &F.getEntryBlock();
+  BasicBlock *Dispatch = BasicBlock::Create(Context, "giri.dispatch", &F, Body);
+  BasicBlock *Fast = BasicBlock::Create(Context, "giri.untraced", &F, Body);
+  Value *Enabled = new LoadInst(TracingEnabled, "giri.enabled", true, Dispatch);
+  Value *Tracing = new ICmpInst(*Dispatch,
+                                ICmpInst::ICMP_NE,
+                                Enabled,
+                                ConstantInt::get(Int32Type, 0),
+                                "giri.tracing");
+  BranchInst::Create(Body, Fast, Tracing, Dispatch);
+
+  std::vector<Value *> Args;
+  for (Function::arg_iterator A = F.arg_begin(), E = F.arg_end(); A != E; ++A)
+    Args.push_back(A);
+  CallInst *Call = CallInst::Create(Untraced, Args, "", Fast);
+  Call->setCallingConv(F.getCallingConv());
+  Call->setTailCall();
+  if (F.getReturnType()->isVoidTy())
+    ReturnInst::Create(Context, Fast);
+  else
+    ReturnInst::Create(Context, Call, Fast);
+
+  ++NumClones; // Update statistics
+}
+
 void TracingNoGiri::createCtor(Module &M) {
   // Create the ctor function.
   Type *VoidTy = Type::getVoidTy(M.getContext());
@@ -198,11 +597,13 @@ void TracingNoGiri::createCtor(Module &M) {
   RuntimeCtor->setLinkage(GlobalValue::InternalLinkage);
 
   // Add a call in the new constructor function to the Giri initialization
-  // function.
+  // function. The coverage array is registered instead once its size is known.
   BasicBlock *BB = BasicBlock::Create(M.getContext(), "entry", RuntimeCtor);
-  Constant *Name = stringToGV(TraceFilename, &M);
-  Name = ConstantExpr::getZExtOrBitCast(Name, VoidPtrType);
-  CallInst::Create(Init, Name, "", BB);
+  if (!CoverageOnly) {
+    Constant *Name = stringToGV(TraceFilename, &M);
+    Name = ConstantExpr::getZExtOrBitCast(Name, VoidPtrType);
+    CallInst::Create(Init, Name, "", BB);
+  }
 
   // Add a return instruction at the end of the basic block.
   ReturnInst::Create(M.getContext(), BB);
@@ -210,27 +611,103 @@ void TracingNoGiri::createCtor(Module &M) {
   appendToGlobalCtors(M, RuntimeCtor, 65535);
 }
 
-void TracingNoGiri::instrumentLock(Instruction *I) {
-  std::string s;
-  raw_string_ostream rso(s);
-  I->print(rso);
-  Constant *Name = stringToGV(rso.str(),
-                              I->getParent()->getParent()->getParent());
+void TracingNoGiri::instrumentCoverage(BasicBlock &BB) {
+  // Ignore the Giri Constructor function where the it is not set up yet
+  if (BB.getParent()->getName() == "giriCtor")
+    return;
+
+  // The array has a byte for every basic block ID.
+  Module *M = BB.getParent()->getParent();
+  if (!Coverage) {
+    ArrayType *CoverageType = ArrayType::get(Int8Type,
+                                             bbNumPass->getMaxID() + 1);
+    Coverage = new GlobalVariable(*M, CoverageType, false,
+                                  GlobalValue::InternalLinkage,
+                                  ConstantAggregateZero::get(CoverageType),
+                                  "giri.coverage");
+  }
+
+  // Mark the basic block when it starts execution. Threads only ever store 1,
+  // so they need no lock.
+  unsigned id = bbNumPass->getID(&BB);
+  assert(id && "Basic block does not have an ID!\n");
+  std::vector<Value *> Indices =
+    make_vector<Value *>(ConstantInt::get(Int32Type, 0),
+                         ConstantInt::get(Int32Type, id), 0);
+  Constant *Mark = ConstantExpr::getInBoundsGetElementPtr(Coverage, Indices);
+  new StoreInst(ConstantInt::get(Int8Type, 1), Mark,
+                BB.getFirstInsertionPt());
+}
+
+void TracingNoGiri::registerCoverage(Module &M) {
+  // A module without basic blocks still writes an empty coverage file.
+  if (!Coverage) {
+    ArrayType *CoverageType = ArrayType::get(Int8Type, 0);
+    Coverage = new GlobalVariable(M, CoverageType, false,
+                                  GlobalValue::InternalLinkage,
+                                  ConstantAggregateZero::get(CoverageType),
+                                  "giri.coverage");
+  }
+  uint64_t Blocks =
+    cast<ArrayType>(Coverage->getType()->getElementType())->getNumElements();
+
+  Function *Ctor = M.getFunction("giriCtor");
+  Constant *Name = stringToGV(TraceFilename, &M);
   Name = ConstantExpr::getZExtOrBitCast(Name, VoidPtrType);
-  CallInst::Create(RecordLock, Name)->insertBefore(I);
+  Value *Array = ConstantExpr::getBitCast(Coverage, VoidPtrType);
+  std::vector<Value *> args =
+    make_vector<Value *>(Name, Array, ConstantInt::get(Int32Type, Blocks), 0);
+  CallInst::Create(RecordCoverage, args, "",
+                   Ctor->getEntryBlock().getTerminator());
 }
 
-void TracingNoGiri::instrumentUnlock(Instruction *I) {
+Constant *TracingNoGiri::getLockName(Instruction *I) {
+  // The fast path doesn't print the name, so it isn't stored either.
+  if (!InlineRuntime.empty())
+    return ConstantPointerNull::get(cast<PointerType>(VoidPtrType));
+
   std::string s;
   raw_string_ostream rso(s);
   I->print(rso);
   Constant *Name = stringToGV(rso.str(),
                               I->getParent()->getParent()->getParent());
-  Name = ConstantExpr::getZExtOrBitCast(Name, VoidPtrType);
-  CallInst::Create(RecordUnlock, Name)->insertAfter(I);
+  return ConstantExpr::getZExtOrBitCast(Name, VoidPtrType);
 }
 
-void TracingNoGiri::instrumentBasicBlock(BasicBlock &BB) {
+void TracingNoGiri::instrumentLock(Instruction *I) {
+  CallInst::Create(RecordLock, getLockName(I))->insertBefore(I);
+}
+
+void TracingNoGiri::instrumentUnlock(Instruction *I) {
+  CallInst::Create(RecordUnlock, getLockName(I))->insertAfter(I);
+}
+
+void TracingNoGiri::instrumentSync(CallInst &CI, SyncRecord Kind,
+                                   Value *Object, Value *Result,
+                                   Instruction *InsertPt) {
+  // The object is an address, except for the thread ID joined.
+  if (Object->getType()->isPointerTy()) {
+    if (Constant *C = dyn_cast<Constant>(Object))
+      Object = ConstantExpr::getPtrToInt(C, Int64Type);
+    else
+      Object = new PtrToIntInst(Object, Int64Type, "", InsertPt);
+  } else {
+    Object = CastInst::CreateIntegerCast(Object, Int64Type, false, "",
+                                         InsertPt);
+  }
+
+  Value *CallID = ConstantInt::get(Int32Type, lsNumPass->getID(&CI));
+  Value *KindValue = ConstantInt::get(Int32Type, Kind);
+  std::vector<Value *> args = make_vector<Value *>(CallID, KindValue, Object,
+                                                   Result, 0);
+  Instruction *RS = CallInst::Create(RecordSync, args, "", InsertPt);
+  instrumentLock(RS);
+  instrumentUnlock(RS);
+}
+
+void
+TracingNoGiri::instrumentBasicBlock(BasicBlock &BB,
+                                    const std::vector<Instruction *> &Batch) {
   // Ignore the Giri Constructor function where the it is not set up yet
   if (BB.getParent()->getName() == "giriCtor")
     return;
@@ -240,6 +717,10 @@ void TracingNoGiri::instrumentBasicBlock(BasicBlock &BB) {
   assert(id && "Basic block does not have an ID!\n");
   Value *BBID = ConstantInt::get(Int32Type, id);
 
+  // Functions are identified by their entry block in the function table.
+  if (&BB == &BB.getParent()->getEntryBlock())
+    TracedFunctions.push_back(std::make_pair(id, BB.getParent()));
+
   // Get a pointer to the function in which the basic block belongs.
   Value *FP = castTo(BB.getParent(), VoidPtrType, "", BB.getTerminator());
 
@@ -251,8 +732,14 @@ void TracingNoGiri::instrumentBasicBlock(BasicBlock &BB) {
 
   // Insert code at the end of the basic block to record that it was executed.
   std::vector<Value *> args = make_vector<Value *>(BBID, FP, LastBB, 0);
-  instrumentLock(BB.getTerminator());
-  Instruction *RBB = CallInst::Create(RecordBB, args, "", BB.getTerminator());
+  Instruction *RBB;
+  if (Batch.empty()) {
+    instrumentLock(BB.getTerminator());
+    RBB = CallInst::Create(RecordBB, args, "", BB.getTerminator());
+  } else {
+    RBB = createBlockRecord(Batch, args, BB.getTerminator());
+    instrumentLock(RBB);
+  }
   instrumentUnlock(RBB);
 
   // Insert code at the beginning of the basic block to record that it started
@@ -264,6 +751,121 @@ void TracingNoGiri::instrumentBasicBlock(BasicBlock &BB) {
   instrumentUnlock(S);
 }
 
+void TracingNoGiri::instrumentBranches(BasicBlock &BB) {
+  // Ignore the Giri Constructor function where the it is not set up yet
+  if (BB.getParent()->getName() == "giriCtor")
+    return;
+
+  // Record the entry of the function, unless it is entered through the call
+  // recorded last. Functions are identified by their entry block.
+  if (&BB == &BB.getParent()->getEntryBlock()) {
+    unsigned id = bbNumPass->getID(&BB);
+    assert(id && "Basic block does not have an ID!\n");
+    TracedFunctions.push_back(std::make_pair(id, BB.getParent()));
+
+    Instruction *F = BB.getFirstInsertionPt();
+    Value *FP = castTo(BB.getParent(), VoidPtrType, "", F);
+    std::vector<Value *> args =
+      make_vector<Value *>(ConstantInt::get(Int32Type, id), FP, 0);
+    Instruction *E = CallInst::Create(RecordEnter, args, "", F);
+    instrumentLock(E);
+    instrumentUnlock(E);
+  }
+
+  // Record the outcome of a conditional branch or switch before taking it.
+  TerminatorInst *T = BB.getTerminator();
+  Instruction *RO = nullptr;
+  if (BranchInst *BI = dyn_cast<BranchInst>(T)) {
+    if (BI->isConditional()) {
+      Value *Taken = castTo(BI->getCondition(), Int8Type, "", BI);
+      RO = CallInst::Create(RecordBranch, Taken, "", BI);
+    }
+  } else if (SwitchInst *SI = dyn_cast<SwitchInst>(T)) {
+    Value *Cond = CastInst::CreateIntegerCast(SI->getCondition(), Int64Type,
+                                              false, "", SI);
+    RO = CallInst::Create(RecordSwitch, Cond, "", SI);
+  }
+  if (RO) {
+    instrumentLock(RO);
+    instrumentUnlock(RO);
+    ++NumBranches; // Update statistics
+  }
+}
+
+bool TracingNoGiri::canBatchBlock(BasicBlock &BB) const {
+  for (BasicBlock::iterator I = BB.begin(), E = BB.end(); I != E; ++I)
+    if (CallInst *CI = dyn_cast<CallInst>(I)) {
+      Function *F = CI->getCalledFunction();
+      if (!F || F->getName().str().compare(0, 9, "llvm.dbg."))
+        return false;
+    }
+  return true;
+}
+
+Instruction *
+TracingNoGiri::createBlockRecord(const std::vector<Instruction *> &Batch,
+                                 std::vector<Value *> &BBArgs,
+                                 Instruction *InsertPt) {
+  Function *F = InsertPt->getParent()->getParent();
+  Module *M = F->getParent();
+
+  // Describe the records in a constant table.
+  std::vector<Constant *> Ops;
+  for (unsigned i = 0; i < Batch.size(); ++i) {
+    RecordType Type = RecordType::PDType;
+    uint64_t Size = 0;
+    if (LoadInst *LI = dyn_cast<LoadInst>(Batch[i])) {
+      Type = RecordType::LDType;
+      Size = TD->getTypeStoreSize(LI->getType());
+    } else if (StoreInst *SI = dyn_cast<StoreInst>(Batch[i])) {
+      Type = RecordType::STType;
+      Size = TD->getTypeStoreSize(SI->getOperand(0)->getType());
+    }
+    Constant *Fields[] = {
+      ConstantInt::get(Int32Type, static_cast<unsigned>(Type)),
+      ConstantInt::get(Int32Type, lsNumPass->getID(Batch[i])),
+      ConstantInt::get(Int64Type, Size)
+    };
+    Ops.push_back(ConstantStruct::get(BlockOpType, Fields));
+  }
+  ArrayType *TableType = ArrayType::get(BlockOpType, Ops.size());
+  GlobalVariable *Table =
+    new GlobalVariable(*M, TableType, true, GlobalValue::InternalLinkage,
+                       ConstantArray::get(TableType, Ops), "giri.block.ops");
+
+  // Store the addresses and flags into an array in the frame of the function.
+  // The operands of the instructions dominate the end of the block, so they
+  // are all stored there.
+  ArrayType *ValuesType = ArrayType::get(Int64Type, Batch.size());
+  AllocaInst *Values = new AllocaInst(ValuesType, "giri.block",
+                                      F->getEntryBlock().getFirstInsertionPt());
+  Value *Zero = ConstantInt::get(Int32Type, 0);
+  for (unsigned i = 0; i < Batch.size(); ++i) {
+    Value *V;
+    if (LoadInst *LI = dyn_cast<LoadInst>(Batch[i]))
+      V = new PtrToIntInst(LI->getPointerOperand(), Int64Type, "", InsertPt);
+    else if (StoreInst *SI = dyn_cast<StoreInst>(Batch[i]))
+      V = new PtrToIntInst(SI->getPointerOperand(), Int64Type, "", InsertPt);
+    else
+      V = new ZExtInst(cast<SelectInst>(Batch[i])->getCondition(), Int64Type,
+                       "", InsertPt);
+    std::vector<Value *> Indices =
+      make_vector<Value *>(Zero, ConstantInt::get(Int32Type, i), 0);
+    Value *Slot = GetElementPtrInst::Create(Values, Indices, "", InsertPt);
+    new StoreInst(V, Slot, InsertPt);
+  }
+
+  // Create the call to the run-time to record the block.
+  std::vector<Value *> Indices = make_vector<Value *>(Zero, Zero, 0);
+  std::vector<Value *> args(BBArgs);
+  args.push_back(ConstantInt::get(Int32Type, Batch.size()));
+  args.push_back(ConstantExpr::getInBoundsGetElementPtr(Table, Indices));
+  args.push_back(GetElementPtrInst::CreateInBounds(Values, Indices, "",
+                                                   InsertPt));
+  ++NumBatchedBBs; // Update statistics
+  return CallInst::Create(RecordBlock, args, "", InsertPt);
+}
+
 void TracingNoGiri::visitLoadInst(LoadInst &LI) {
   instrumentLock(&LI);
 
@@ -274,10 +876,18 @@ void TracingNoGiri::visitLoadInst(LoadInst &LI) {
   Pointer = castTo(Pointer, VoidPtrType, Pointer->getName(), &LI);
   // Get the size of the loaded data.
   uint64_t size = TD->getTypeStoreSize(LI.getType());
-  Value *LoadSize = ConstantInt::get(Int64Type, size);
-  // Create the call to the run-time to record the load instruction.
-  std::vector<Value *> args=make_vector<Value *>(LoadID, Pointer, LoadSize, 0);
-  CallInst::Create(RecordLoad, args, "", &LI);
+  // Create the call to the run-time to record the load instruction. Common
+  // sizes have their own function, which isn't passed the size.
+  if (Function *RecordSized = getSizedRecord(RecordSizedLoad, size)) {
+    std::vector<Value *> args = make_vector<Value *>(LoadID, Pointer, 0);
+    CallInst::Create(RecordSized, args, "", &LI);
+    ++NumSized; // Update statistics
+  } else {
+    Value *LoadSize = ConstantInt::get(Int64Type, size);
+    std::vector<Value *> args =
+      make_vector<Value *>(LoadID, Pointer, LoadSize, 0);
+    CallInst::Create(RecordLoad, args, "", &LI);
+  }
 
   instrumentUnlock(&LI);
   ++NumLoads; // Update statistics
@@ -291,9 +901,14 @@ void TracingNoGiri::visitSelectInst(SelectInst &SI) {
   Predicate = castTo(Predicate, Int8Type, Predicate->getName(), &SI);
   // Get the ID of the load instruction.
   Value *SelectID = ConstantInt::get(Int32Type, lsNumPass->getID(&SI));
-  // Create the call to the run-time to record the load instruction.
-  std::vector<Value *> args=make_vector<Value *>(SelectID, Predicate, 0);
-  CallInst::Create(RecordSelect, args, "", &SI);
+  // Create the call to the run-time to record the load instruction. With
+  // -giri-branch-trace, the predicate joins the branch outcome stream instead.
+  if (BranchTrace) {
+    CallInst::Create(RecordBranch, Predicate, "", &SI);
+  } else {
+    std::vector<Value *> args=make_vector<Value *>(SelectID, Predicate, 0);
+    CallInst::Create(RecordSelect, args, "", &SI);
+  }
 
   instrumentUnlock(&SI);
   ++NumSelects; // Update statistics
@@ -307,17 +922,55 @@ void TracingNoGiri::visitStoreInst(StoreInst &SI) {
   Pointer = castTo(Pointer, VoidPtrType, Pointer->getName(), &SI);
   // Get the size of the stored data.
   uint64_t size = TD->getTypeStoreSize(SI.getOperand(0)->getType());
-  Value *StoreSize = ConstantInt::get(Int64Type, size);
   // Get the ID of the store instruction.
   Value *StoreID = ConstantInt::get(Int32Type, lsNumPass->getID(&SI));
-  // Create the call to the run-time to record the store instruction.
-  std::vector<Value *> args=make_vector<Value *>(StoreID, Pointer, StoreSize, 0);
-  CallInst::Create(RecordStore, args, "", &SI);
+  // Create the call to the run-time to record the store instruction. Common
+  // sizes have their own function, which isn't passed the size.
+  if (Function *RecordSized = getSizedRecord(RecordSizedStore, size)) {
+    std::vector<Value *> args = make_vector<Value *>(StoreID, Pointer, 0);
+    CallInst::Create(RecordSized, args, "", &SI);
+    ++NumSized; // Update statistics
+  } else {
+    Value *StoreSize = ConstantInt::get(Int64Type, size);
+    std::vector<Value *> args =
+      make_vector<Value *>(StoreID, Pointer, StoreSize, 0);
+    CallInst::Create(RecordStore, args, "", &SI);
+  }
 
   instrumentUnlock(&SI);
   ++NumStores; // Update statistics
 }
 
+void TracingNoGiri::visitAllocaInst(AllocaInst &AI) {
+  if (!TraceAllocations)
+    return;
+
+  // Record the allocation after the alloca, which computes the address.
+  BasicBlock::iterator InsertPt = &AI;
+  ++InsertPt;
+
+  // Get the ID of the alloca instruction.
+  Value *AllocaID = ConstantInt::get(Int32Type, lsNumPass->getID(&AI));
+  // Cast the address to a void pointer.
+  Value *Pointer = castTo(&AI, VoidPtrType, AI.getName(), InsertPt);
+  // Get the number of bytes allocated, which may only be known at run-time.
+  uint64_t Size = TD->getTypeAllocSize(AI.getAllocatedType());
+  Value *AllocSize = ConstantInt::get(Int64Type, Size);
+  if (AI.isArrayAllocation()) {
+    Value *Count = CastInst::CreateIntegerCast(AI.getArraySize(), Int64Type,
+                                               false, "", InsertPt);
+    AllocSize = BinaryOperator::Create(BinaryOperator::Mul, Count, AllocSize,
+                                       "", InsertPt);
+  }
+
+  // Create the call to the run-time to record the allocation.
+  std::vector<Value *> args = make_vector(AllocaID, Pointer, AllocSize, 0);
+  Instruction *RA = CallInst::Create(RecordAlloc, args, "", InsertPt);
+  instrumentLock(RA);
+  instrumentUnlock(RA);
+  ++NumAllocations; // Update statistics
+}
+
 bool TracingNoGiri::visitSpecialCall(CallInst &CI) {
   Function *CalledFunc = CI.getCalledFunction();
 
@@ -466,6 +1119,14 @@ bool TracingNoGiri::visitSpecialCall(CallInst &CI) {
     // Moove cast, #byte computation and store to after call inst
     CI.moveBefore(cast<Instruction>(NumElts));
 
+    // Record the allocation before the store zeroing the object.
+    if (TraceAllocations) {
+      CallInst *recAlloc = CallInst::Create(RecordAlloc, args, "", recStore);
+      instrumentLock(recAlloc);
+      instrumentUnlock(recAlloc);
+      ++NumAllocations; // Update statistics
+    }
+
     instrumentUnlock(&CI);
     ++NumExtFuns; // Update statistics
     return true;
@@ -532,11 +1193,159 @@ bool TracingNoGiri::visitSpecialCall(CallInst &CI) {
   return false;
 }
 
+namespace {
+/// The synchronization performed by a pthread function. Each function releases
+/// and/or acquires an object passed as one of its arguments.
+struct SyncFunction {
+  const char *Name;
+  unsigned Release;    ///< Kind of the release before the call, or 0
+  unsigned ReleaseArg; ///< Argument holding the released object
+  unsigned Acquire;    ///< Kind of the acquire after the call, or 0
+  unsigned AcquireArg; ///< Argument holding the acquired object
+};
+}
+
+/// The pthread functions recorded as synchronization. A condition wait
+/// releases its mutex (the second argument) and reacquires it on return, even
+/// if the wait fails.
+static const SyncFunction SyncFunctions[] = {
+  { "pthread_mutex_lock",       0,             0, MutexLock,     0 },
+  { "pthread_mutex_trylock",    0,             0, MutexLock,     0 },
+  { "pthread_mutex_timedlock",  0,             0, MutexLock,     0 },
+  { "pthread_mutex_unlock",     MutexUnlock,   0, 0,             0 },
+  { "pthread_rwlock_rdlock",    0,             0, MutexLock,     0 },
+  { "pthread_rwlock_wrlock",    0,             0, MutexLock,     0 },
+  { "pthread_rwlock_tryrdlock", 0,             0, MutexLock,     0 },
+  { "pthread_rwlock_trywrlock", 0,             0, MutexLock,     0 },
+  { "pthread_rwlock_unlock",    MutexUnlock,   0, 0,             0 },
+  { "pthread_spin_lock",        0,             0, MutexLock,     0 },
+  { "pthread_spin_trylock",     0,             0, MutexLock,     0 },
+  { "pthread_spin_unlock",      MutexUnlock,   0, 0,             0 },
+  { "pthread_create",           ThreadCreate,  0, ThreadCreated, 0 },
+  { "pthread_join",             0,             0, ThreadJoin,    0 },
+  { "pthread_cond_signal",      CondSignal,    0, 0,             0 },
+  { "pthread_cond_broadcast",   CondSignal,    0, 0,             0 },
+  { "pthread_cond_wait",        MutexUnlock,   1, CondWake,      0 },
+  { "pthread_cond_timedwait",   MutexUnlock,   1, CondWake,      0 },
+  { "pthread_barrier_wait",     BarrierArrive, 0, BarrierLeave,  0 }
+};
+
+void TracingNoGiri::visitSyncCall(CallInst &CI, Instruction *Release,
+                                  Instruction *Acquire) {
+  Function *CalledFunc = CI.getCalledFunction();
+  const SyncFunction *Sync = 0;
+  for (unsigned i = 0; i < array_lengthof(SyncFunctions); ++i)
+    if (CalledFunc->getName() == SyncFunctions[i].Name)
+      Sync = &SyncFunctions[i];
+  if (!Sync)
+    return;
+
+  // Skip calls through a declaration with fewer arguments than the real one.
+  unsigned Args = CI.getNumArgOperands();
+  if (Sync->ReleaseArg >= Args || Sync->AcquireArg >= Args)
+    return;
+
+  Value *Succeeded = ConstantInt::get(Int32Type, 0);
+  if (Sync->Release)
+    instrumentSync(CI, SyncRecord(Sync->Release),
+                   CI.getArgOperand(Sync->ReleaseArg), Succeeded, Release);
+
+  // The acquire is recorded only if the call returns 0, which the run-time
+  // checks, so the result of the call is passed along.
+  BasicBlock::iterator InsertPt = Acquire;
+  ++InsertPt;
+  if (Sync->Acquire) {
+    Value *Result = Succeeded;
+    if (CI.getType()->isIntegerTy())
+      Result = CastInst::CreateIntegerCast(&CI, Int32Type, true, "", InsertPt);
+    instrumentSync(CI, SyncRecord(Sync->Acquire),
+                   CI.getArgOperand(Sync->AcquireArg), Result, InsertPt);
+  }
+  if (Sync->Release == MutexUnlock && Sync->Acquire == CondWake)
+    instrumentSync(CI, MutexLock, CI.getArgOperand(Sync->ReleaseArg),
+                   Succeeded, InsertPt);
+
+  ++NumSyncs; // Update statistics
+}
+
+void TracingNoGiri::visitAllocationCall(CallInst &CI, Instruction *Free,
+                                        Instruction *Alloc) {
+  if (!TraceAllocations)
+    return;
+
+  // Recognize malloc(), realloc() and free(), as well as the operators new
+  // and delete of the Itanium C++ ABI.
+  StringRef Name = CI.getCalledFunction()->getName();
+  bool IsAlloc = Name == "malloc" || Name == "valloc" ||
+                 Name == "_Znwm" || Name == "_Znam" ||
+                 Name == "_Znwj" || Name == "_Znaj";
+  bool IsRealloc = Name == "realloc";
+  bool IsFree = Name == "free" || Name == "_ZdlPv" || Name == "_ZdaPv";
+  if (!IsAlloc && !IsRealloc && !IsFree)
+    return;
+  if (CI.getNumArgOperands() < (IsRealloc ? 2u : 1u))
+    return;
+
+  // Get the ID of the call instruction.
+  Value *CallID = ConstantInt::get(Int32Type, lsNumPass->getID(&CI));
+
+  Instruction *Record;
+  if (IsFree) {
+    Value *Pointer = castTo(CI.getArgOperand(0), VoidPtrType, "", Free);
+    std::vector<Value *> args = make_vector(CallID, Pointer, 0);
+    Record = CallInst::Create(RecordFree, args, "", Free);
+  } else {
+    BasicBlock::iterator InsertPt = Alloc;
+    ++InsertPt;
+    Value *Pointer = castTo(&CI, VoidPtrType, CI.getName(), InsertPt);
+    Value *Size = CI.getArgOperand(IsRealloc ? 1 : 0);
+    Size = CastInst::CreateIntegerCast(Size, Int64Type, false, "", InsertPt);
+    if (IsRealloc) {
+      Value *Old = castTo(CI.getArgOperand(0), VoidPtrType, "", InsertPt);
+      std::vector<Value *> args = make_vector(CallID, Old, Pointer, Size, 0);
+      Record = CallInst::Create(RecordRealloc, args, "", InsertPt);
+    } else {
+      std::vector<Value *> args = make_vector(CallID, Pointer, Size, 0);
+      Record = CallInst::Create(RecordAlloc, args, "", InsertPt);
+    }
+  }
+  instrumentLock(Record);
+  instrumentUnlock(Record);
+  ++NumAllocations; // Update statistics
+}
+
+Instruction *TracingNoGiri::instrumentCallReturn(CallInst &CI,
+                                                 Function *Record) {
+  instrumentLock(&CI);
+  // Get the ID of the call instruction.
+  Value *CallID = ConstantInt::get(Int32Type, lsNumPass->getID(&CI));
+  // Get the called function value and cast it to a void pointer.
+  Value *FP = castTo(CI.getCalledValue(), VoidPtrType, "", &CI);
+  // Create the call to the run-time to record the call instruction.
+  std::vector<Value *> args = make_vector<Value *>(CallID, FP, 0);
+  Instruction *RC = CallInst::Create(Record, args, "", &CI);
+  instrumentUnlock(RC);
+
+  // Create the call to the run-time to record the return of call instruction.
+  CallInst *CallInst = CallInst::Create(RecordReturn, args, "", &CI);
+  CI.moveBefore(CallInst);
+  instrumentLock(CallInst);
+  instrumentUnlock(CallInst);
+  return CallInst;
+}
+
 void TracingNoGiri::visitCallInst(CallInst &CI) {
   // Attempt to get the called function.
   Function *CalledFunc = CI.getCalledFunction();
-  if (!CalledFunc)
+  if (!CalledFunc) {
+    // The trace reader can only follow an indirect call through its record.
+    if (BranchTrace &&
+        !isa<InlineAsm>(CI.getCalledValue()->stripPointerCasts())) {
+      instrumentCallReturn(CI, RecordExtCall);
+      ++NumCalls; // Update statistics
+    }
     return;
+  }
 
   // Do not instrument calls to tracing run-time functions or debug functions.
   if (isTracerFunction(CalledFunc))
@@ -557,28 +1366,28 @@ void TracingNoGiri::visitCallInst(CallInst &CI) {
   if (isa<InlineAsm>(CI.getCalledValue()->stripPointerCasts()))
     return;
 
-  instrumentLock(&CI);
-  // Get the ID of the store instruction.
-  Value *CallID = ConstantInt::get(Int32Type, lsNumPass->getID(&CI));
-  // Get the called function value and cast it to a void pointer.
-  Value *FP = castTo(CI.getCalledValue(), VoidPtrType, "", &CI);
-  // Create the call to the run-time to record the call instruction.
-  std::vector<Value *> args = make_vector<Value *>(CallID, FP, 0);
   // Do not add calls to function call stack for external functions
   // as return records won't be used/needed for them, so call a special record function
   // FIXME!!!! Do we still need it after adding separate return records????
-  Instruction *RC;
-  if (CalledFunc->isDeclaration())
-    RC = CallInst::Create(RecordExtCall, args, "", &CI);
-  else
-    RC = CallInst::Create(RecordCall, args, "", &CI);
-  instrumentUnlock(RC);
-
-  // Create the call to the run-time to record the return of call instruction.
-  CallInst *CallInst = CallInst::Create(RecordReturn, args, "", &CI);
-  CI.moveBefore(CallInst);
-  instrumentLock(CallInst);
-  instrumentUnlock(CallInst);
+  // No basic block pops the call stack with -giri-branch-trace either. With
+  // -giri-dual-clone, the callee pushes the call once it enters its
+  // instrumented body.
+  Function *Record = RecordCall;
+  if (CalledFunc->isDeclaration() || BranchTrace)
+    Record = RecordExtCall;
+  else if (DualClone)
+    Record = RecordClonedCall;
+  Instruction *Return = instrumentCallReturn(CI, Record);
+
+  // Record the synchronization of pthread calls and the objects allocated or
+  // freed by a call around the call and return records, after the unlock
+  // following the return record.
+  if (CalledFunc->isDeclaration()) {
+    BasicBlock::iterator Unlock = Return;
+    ++Unlock;
+    visitSyncCall(CI, &CI, Unlock);
+    visitAllocationCall(CI, &CI, Unlock);
+  }
 
   ++NumCalls; // Update statistics
 
@@ -623,21 +1432,47 @@ void TracingNoGiri::visitCallInst(CallInst &CI) {
 }
 
 bool TracingNoGiri::runOnBasicBlock(BasicBlock &BB) {
+  // The fast path of the run-time isn't part of the program.
+  if (FastPathFunctions.count(BB.getParent()))
+    return false;
+
   // Fetch the analysis results for numbering basic blocks.
   // Will be run once per module
   TD        = &getAnalysis<DataLayout>();
   bbNumPass = &getAnalysis<QueryBasicBlockNumbers>();
   lsNumPass = &getAnalysis<QueryLoadStoreNumbers>();
 
-  // Instrument the basic block so that it records its execution.
-  instrumentBasicBlock(BB);
+  // Only mark the execution of the basic block in the coverage-only mode.
+  if (CoverageOnly) {
+    instrumentCoverage(BB);
+    ++NumBBs;
+    return true;
+  }
+
+  // Collect the loads, stores and selects which are recorded at the end of the
+  // basic block.
+  std::vector<Instruction *> Batch;
+  if (BatchBlocks && !BranchTrace && canBatchBlock(BB))
+    for (BasicBlock::iterator I = BB.begin(); I != BB.end(); ++I)
+      if (isBatchedRecord(I))
+        Batch.push_back(I);
 
   // Scan through all instructions in the basic block and instrument them as
   // necessary.  Use a worklist to contain the instructions to avoid any
   // iterator invalidation issues when adding instructions to the basic block.
+  // The worklist is filled first, so that the array a batched block stores
+  // into isn't recorded as an allocation.
   std::vector<Instruction *> Worklist;
   for (BasicBlock::iterator I = BB.begin(); I != BB.end(); ++I)
-    Worklist.push_back(I);
+    if (Batch.empty() || !isBatchedRecord(I))
+      Worklist.push_back(I);
+
+  // Instrument the basic block so that it records its execution, or only the
+  // outcome of its branch with -giri-branch-trace.
+  if (BranchTrace)
+    instrumentBranches(BB);
+  else
+    instrumentBasicBlock(BB, Batch);
   visit(Worklist.begin(), Worklist.end());
 
   // Update the number of basic blocks with phis.
@@ -17,17 +17,23 @@
 
 #include "Utility/CountSrcLines.h"
 #include "Utility/SourceLineMapping.h"
+#include "Utility/TraceReader.h"
 
 #include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Function.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/raw_ostream.h"
 
-#include <fcntl.h>
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
-#include <unistd.h>
+#include <map>
+#include <thread>
+#include <vector>
 
 using namespace llvm;
 using namespace dg;
@@ -42,6 +48,7 @@ STATISTIC(NumSrcLinesMissing, "Number of insts missing debug info");
 STATISTIC(NumWithoutSrcLines, "Number of ignored insts without source lines");
 STATISTIC(NumStaticInst, "Number of static LLVM instructions executed");
 STATISTIC(NumBBsNoSrc, "Number of BBs whose source line debug info is missing");
+STATISTIC(MaxCallDepth, "Maximum depth of traced calls in trace");
 
 //===----------------------------------------------------------------------===//
 //                        Command Line Arguments.
@@ -50,6 +57,12 @@ cl::opt<string> TraceFilename("trace-file",
                               cl::desc("Trace filename"),
                               cl::init("bbrecord"));
 
+static cl::opt<unsigned>
+DecodeThreads("decode-threads",
+              cl::desc("Number of threads decoding the trace (0 for one per "
+                       "core)"),
+              cl::init(0));
+
 //===----------------------------------------------------------------------===//
 //                        CountSrcLines Pass Implementations
 //===----------------------------------------------------------------------===//
@@ -84,23 +97,132 @@ void CountSrcLines::countLines(const string &bbrecord_file) {
   NumBBsNoSrc = BBsNoSrc.size();
 }
 
+/// Read the basic blocks marked in a coverage file written by a program
+/// instrumented with -giri-coverage-only.
+/// \return false if the file isn't a coverage file.
+static bool readCoverage(const string &Filename, unordered_set<unsigned> &BBs) {
+  ifstream File(Filename.c_str(), ios::binary);
+  CoverageHeader Header;
+  if (!File.read(reinterpret_cast<char *>(&Header), sizeof(Header)) ||
+      memcmp(Header.magic, "GIRICOV1", sizeof(Header.magic)))
+    return false;
+
+  vector<char> Blocks(Header.blocks);
+  if (!Blocks.empty() && !File.read(&Blocks[0], Blocks.size()))
+    report_fatal_error("The coverage file " + Filename + " is truncated!");
+  for (unsigned id = 0; id < Blocks.size(); ++id)
+    if (Blocks[id])
+      BBs.insert(id);
+  return true;
+}
+
+/// Get the depth of the calls of a thread after one of its records.
+///
+/// The run-time keeps the direct calls to instrumented functions on its call
+/// stack until their callee's last basic block ends, which is what checkpoints
+/// save. Other calls are not stacked.
+static unsigned long nextCallDepth(unsigned long depth, const Entry &entry,
+                                   const QueryLoadStoreNumbers *lsNums) {
+  if (entry.type == RecordType::CLType) {
+    CallInst *CI = dyn_cast_or_null<CallInst>(lsNums->getInstByID(entry.id));
+    Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+    return Callee && !Callee->isDeclaration() ? depth + 1 : depth;
+  }
+
+  // The last basic block of a function holds the ID of its call, or ~0 if the
+  // call wasn't traced.
+  if (entry.type == RecordType::BBType && entry.length &&
+      entry.length != ~0U && depth)
+    return depth - 1;
+  return depth;
+}
+
+/// Get the depth of the calls of a thread at an index of the trace. The thread
+/// is replayed from its last checkpoint before the index, so at most one
+/// checkpoint interval of its records is decoded. A thread with no checkpoint
+/// before the index, e.g. one whose start was cut off a flight recorder dump,
+/// is taken to be in no call.
+static unsigned long getCallDepth(const TraceReader &Trace, pthread_t tid,
+                                  unsigned long index,
+                                  const QueryLoadStoreNumbers *lsNums) {
+  const ThreadContext *Context = Trace.findCheckpoint(tid, index);
+  if (!Context)
+    return 0;
+
+  const Entry *entries = Trace.getEntries();
+  unsigned long depth = Context->calls.size();
+  for (unsigned long i = Context->index; i < index; ++i)
+    if (entries[i].tid == tid)
+      depth = nextCallDepth(depth, entries[i], lsNums);
+  return depth;
+}
+
 unordered_set<unsigned> CountSrcLines::readBB(const string &bbrecord) {
-  int bb_fd = open(bbrecord.c_str(), O_RDONLY);
-  if (!bb_fd)
-     report_fatal_error("Error opening trace file: " + bbrecord + "!\n");
+  // A coverage file lists the executed basic blocks directly, but not how
+  // often they were executed.
+  unordered_set<unsigned> covered;
+  if (readCoverage(bbrecord, covered))
+    return covered;
+
+  // The reader merges per-thread segments, so every basic block record of
+  // every thread is seen before the END record.
+  TraceReader Trace(bbrecord);
+  const Entry *entries = Trace.getEntries();
+
+  // Decode ranges of the trace in parallel, split at checkpoints where
+  // possible, and merge the basic blocks found in each range. The call depth
+  // of a thread is picked up from its last checkpoint before the range when
+  // the range meets the thread. Without checkpoints, the depths are only known
+  // by decoding from the start.
+  unsigned threads = DecodeThreads ? DecodeThreads
+                                   : std::thread::hardware_concurrency();
+  if (Trace.getCheckpoints().empty())
+    threads = 1;
+  vector<unsigned long> Bounds = Trace.partition(threads ? threads : 1);
+  unsigned ranges = Bounds.size() - 1;
+  vector<unordered_set<unsigned>> RangeBBs(ranges);
+  vector<unsigned long> RangeCounts(ranges, 0);
+  vector<unsigned long> RangeDepths(ranges, 0);
+  auto decode = [&](unsigned range) {
+    map<pthread_t, unsigned long> Depths;
+    for (unsigned long index = Bounds[range]; index < Bounds[range + 1];
+         ++index) {
+      const Entry &entry = entries[index];
+      if (entry.type == RecordType::BBType) {
+        RangeBBs[range].insert(entry.id);
+        ++RangeCounts[range];
+      } else if (entry.type != RecordType::CLType)
+        continue;
+
+      auto It = Depths.find(entry.tid);
+      if (It == Depths.end())
+        It = Depths.insert(make_pair(entry.tid,
+                                     getCallDepth(Trace, entry.tid,
+                                                  Bounds[range], lsNumPass)))
+               .first;
+      It->second = nextCallDepth(It->second, entry, lsNumPass);
+      RangeDepths[range] = std::max(RangeDepths[range], It->second);
+    }
+  };
+
+  vector<std::thread> Decoders;
+  for (unsigned range = 1; range < ranges; ++range)
+    Decoders.push_back(std::thread(decode, range));
+  if (ranges)
+    decode(0);
+  for (unsigned i = 0; i < Decoders.size(); ++i)
+    Decoders[i].join();
+  DEBUG(dbgs() << "Decoded " << Trace.size() << " entries in " << ranges
+               << " ranges\n");
 
   unordered_set<unsigned> bb_set; // Keep track of basic bock ID
-  Entry entry;
-  while (read(bb_fd, &entry, sizeof(entry)) == sizeof(entry)) {
-    if (entry.type == RecordType::BBType) {
-      bb_set.insert(entry.id);
-      ++NumOfDynamicBBs;
-    }
-    if (entry.type == RecordType::ENType)
-      break;
+  unsigned long maxDepth = 0;
+  for (unsigned range = 0; range < ranges; ++range) {
+    bb_set.insert(RangeBBs[range].begin(), RangeBBs[range].end());
+    NumOfDynamicBBs += RangeCounts[range];
+    maxDepth = std::max(maxDepth, RangeDepths[range]);
   }
-
-  close(bb_fd);
+  MaxCallDepth = maxDepth;
 
   return bb_set;
 }
@@ -81,6 +81,13 @@ bool LoadStoreNumberPass::runOnModule(Module &M) {
   // to hold this data.
   count = 0;
   visit(&M);
+
+  // Number the allocas last, so that the IDs of the other instructions are the
+  // same whether or not allocations are traced.
+  for (unsigned i = 0; i < Allocas.size(); ++i)
+    MD->addOperand(assignID(Allocas[i], ++count));
+  Allocas.clear();
+
   DEBUG(dbgs() << "Number of monitored program points: " << count << "\n");
   if (count > MAX_PROGRAM_POINTS)
     errs() << "Number of monitored program points exceeds maximum value.\n";
@@ -0,0 +1,560 @@
+//===- TraceReader.cpp - Load a dynamic trace into memory -----------------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the loading of trace files, including merging the
+// per-thread segments and the chunks of a trace back into one globally ordered
+// trace.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "giriutil"
+
+#include "Utility/TraceReader.h"
+
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <set>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace dg;
+using namespace llvm;
+
+/// An empty slot, i.e. one which was never written by the run-time
+static inline bool isEmpty(const Entry &entry) {
+  return static_cast<unsigned>(entry.type) == 0;
+}
+
+const Entry *TraceReader::mapFile(const std::string &Filename,
+                                  unsigned long &fileEntries) {
+  // Open the trace file for read-only access.
+  int fd = open(Filename.c_str(), O_RDONLY);
+  if (fd == -1)
+    report_fatal_error("Cannot open trace file " + Filename + "!");
+
+  // Attempt to get the file size.
+  struct stat finfo;
+  if (fstat(fd, &finfo) != 0)
+    report_fatal_error("Cannot fstat() trace file " + Filename + "!");
+  fileEntries = finfo.st_size / sizeof(Entry);
+  if (fileEntries == 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  // Note that we map the whole file in the private memory space. If we don't
+  // have enough VM at this time, this will definitely fail.
+  Entry *file = (Entry *)mmap(0,
+                              fileEntries * sizeof(Entry),
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE,
+                              fd,
+                              0);
+  close(fd);
+  if (file == MAP_FAILED)
+    report_fatal_error("Trace mmap() failed!");
+  return file;
+}
+
+bool TraceReader::readManifest(const std::string &Filename,
+                               std::vector<std::string> &Chunks) {
+  std::ifstream Manifest(Filename.c_str());
+  std::string Line;
+  if (!std::getline(Manifest, Line) || Line != "GIRI-MANIFEST 1")
+    return false;
+
+  // Chunk names are relative to the directory of the manifest.
+  std::string Dir;
+  std::string::size_type slash = Filename.rfind('/');
+  if (slash != std::string::npos)
+    Dir = Filename.substr(0, slash + 1);
+
+  bool complete = false;
+  while (std::getline(Manifest, Line)) {
+    std::istringstream Fields(Line);
+    std::string Kind, Name;
+    Fields >> Kind;
+    if (Kind == "chunk" && Fields >> Name)
+      Chunks.push_back(Name[0] == '/' ? Name : Dir + Name);
+    else if (Kind == "end")
+      complete = true;
+  }
+
+  // The program died before it could finish the manifest, so pick up any
+  // further chunks it has created.
+  if (!complete) {
+    while (true) {
+      char Suffix[16];
+      snprintf(Suffix, sizeof(Suffix), ".%03u", unsigned(Chunks.size()));
+      std::string Name = Filename + Suffix;
+      if (access(Name.c_str(), R_OK) != 0)
+        break;
+      Chunks.push_back(Name);
+    }
+  }
+  return true;
+}
+
+TraceReader::TraceReader(const std::string &Filename) :
+  trace(nullptr), numEntries(0), mappedBytes(0) {
+  std::vector<std::string> Chunks;
+  if (readManifest(Filename, Chunks)) {
+    // Every chunk is a sequence of segments, which are merged together. The
+    // last chunk may not even have a segment header if the program was killed
+    // right after creating it.
+    FileList Files;
+    for (unsigned i = 0; i < Chunks.size(); ++i) {
+      unsigned long fileEntries;
+      const Entry *file = mapFile(Chunks[i], fileEntries);
+      if (file)
+        Files.push_back(std::make_pair(file, fileEntries));
+    }
+    if (Files.empty())
+      report_fatal_error("Trace " + Filename + " has no chunks!");
+
+    loadSegments(Files);
+    for (unsigned i = 0; i < Files.size(); ++i)
+      munmap(const_cast<Entry *>(Files[i].first),
+             Files[i].second * sizeof(Entry));
+    DEBUG(dbgs() << "Merged " << numEntries << " entries from "
+                 << Files.size() << " chunks of " << Filename << "\n");
+    return;
+  }
+
+  unsigned long fileEntries;
+  const Entry *file = mapFile(Filename, fileEntries);
+  if (!file)
+    report_fatal_error("Trace file " + Filename + " is empty!");
+
+  if (file[0].type != RecordType::SGType) {
+    // A flat trace can be used in place.
+    trace = const_cast<Entry *>(file);
+    mappedBytes = fileEntries * sizeof(Entry);
+    numEntries =
+      extractStoreLinks(extractCheckpoints(expandStrideHits(fileEntries)));
+    return;
+  }
+
+  loadSegments(FileList(1, std::make_pair(file, fileEntries)));
+  munmap(const_cast<Entry *>(file), fileEntries * sizeof(Entry));
+  DEBUG(dbgs() << "Merged " << numEntries << " entries from segments of "
+               << Filename << "\n");
+}
+
+TraceReader::~TraceReader() {
+  if (trace)
+    munmap(trace, mappedBytes);
+}
+
+Entry *TraceReader::allocate(unsigned long entries) {
+  void *mem = mmap(0,
+                   entries * sizeof(Entry),
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1,
+                   0);
+  if (mem == MAP_FAILED)
+    report_fatal_error("Cannot allocate memory for the trace!");
+  return (Entry *)mem;
+}
+
+void TraceReader::loadSegments(const FileList &Files) {
+  // Collect the committed segments and the number of valid records in each.
+  // Segments which were still open when the program died are dropped, and a
+  // segment cut short by the end of the file only contributes what was
+  // written. The segments of a file end at the first slot which isn't a
+  // header, e.g. the unused tail of the file after a crash.
+  SegmentList Segments;
+  for (unsigned f = 0; f < Files.size(); ++f) {
+    const Entry *file = Files[f].first;
+    unsigned long fileEntries = Files[f].second;
+    unsigned long offset = 0;
+    while (offset < fileEntries && file[offset].type == RecordType::SGType) {
+      const SegmentHeader *header =
+        reinterpret_cast<const SegmentHeader *>(&file[offset]);
+      if (header->capacity == 0)
+        break;
+      offset += header->capacity;
+      if (!(header->flags & CommittedSegment)) {
+        DEBUG(dbgs() << "Dropping uncommitted segment at entry "
+                     << offset - header->capacity << "\n");
+        continue;
+      }
+      unsigned long count = header->count;
+      if (count > header->capacity - 1)
+        count = header->capacity - 1;
+      unsigned long start = offset - header->capacity;
+      if (count > fileEntries - start - 1)
+        count = fileEntries - start - 1;
+      Segments.push_back(std::make_pair(header, count));
+    }
+  }
+  if (Segments.empty())
+    report_fatal_error("Trace has no committed segment!");
+
+  const unsigned OrderFlags = SequencedSegment | TimestampedSegment;
+  unsigned order = Segments.front().first->flags & OrderFlags;
+  if (order == OrderFlags)
+    report_fatal_error("Trace segment is both sequenced and timestamped!");
+  for (unsigned i = 0; i < Segments.size(); ++i)
+    if ((Segments[i].first->flags & OrderFlags) != order)
+      report_fatal_error("Trace mixes segments of different orders!");
+  if (order == TimestampedSegment) {
+    mergeTimestamped(Segments);
+    return;
+  }
+
+  bool sequenced = order == SequencedSegment;
+  unsigned long slots = 0;
+  for (unsigned i = 0; i < Segments.size(); ++i) {
+    const SegmentHeader *header = Segments[i].first;
+
+    // Sequenced records go to the slot given by their sequence number.
+    const Entry *records = reinterpret_cast<const Entry *>(header + 1);
+    if (sequenced) {
+      for (unsigned long j = 0; j < Segments[i].second; ++j)
+        if (records[j].tid >= slots)
+          slots = records[j].tid + 1;
+    } else {
+      slots += Segments[i].second;
+    }
+  }
+
+  // Reserve one more slot for an END record in case the trace lacks one.
+  trace = allocate(slots + 1);
+  mappedBytes = (slots + 1) * sizeof(Entry);
+
+  unsigned long next = 0;
+  for (unsigned i = 0; i < Segments.size(); ++i) {
+    const SegmentHeader *header = Segments[i].first;
+    const Entry *records = reinterpret_cast<const Entry *>(header + 1);
+    for (unsigned long j = 0; j < Segments[i].second; ++j) {
+      if (isEmpty(records[j]))
+        continue;
+      if (sequenced) {
+        trace[records[j].tid] = records[j];
+        trace[records[j].tid].tid = header->tid;
+      } else {
+        trace[next++] = records[j];
+      }
+    }
+  }
+
+  finishMerge(slots);
+}
+
+void TraceReader::mergeTimestamped(const SegmentList &Segments) {
+  // Gather the segments of every thread. A thread carves its segments out of
+  // the file in order, so they are in the order of its records.
+  std::map<pthread_t, std::vector<unsigned>> ThreadSegments;
+  unsigned long slots = 0;
+  for (unsigned i = 0; i < Segments.size(); ++i) {
+    ThreadSegments[Segments[i].first->tid].push_back(i);
+    slots += Segments[i].second;
+  }
+
+  // The next record of every thread, as the index of its segment in the
+  // thread's list and the index of the record in the segment
+  struct Stream {
+    pthread_t tid;
+    const std::vector<unsigned> *segments;
+    unsigned segment;
+    unsigned long record;
+  };
+  std::vector<Stream> Streams;
+  for (auto It = ThreadSegments.begin(); It != ThreadSegments.end(); ++It) {
+    Stream S = { It->first, &It->second, 0, 0 };
+    Streams.push_back(S);
+  }
+
+  // Get the next record of a stream, skipping empty slots, or nullptr if the
+  // stream is exhausted.
+  auto current = [&](Stream &S) -> const Entry * {
+    while (S.segment < S.segments->size()) {
+      const std::pair<const SegmentHeader *, unsigned long> &Segment =
+        Segments[(*S.segments)[S.segment]];
+      const Entry *records = reinterpret_cast<const Entry *>(Segment.first + 1);
+      while (S.record < Segment.second && isEmpty(records[S.record]))
+        ++S.record;
+      if (S.record < Segment.second)
+        return &records[S.record];
+      ++S.segment;
+      S.record = 0;
+    }
+    return nullptr;
+  };
+
+  // Merge the streams by timestamp with a heap of the next record of every
+  // stream. Records with the same timestamp are taken in the order of the
+  // streams, and the records of one stream always stay in order.
+  typedef std::pair<uintptr_t, unsigned> HeapItem;
+  std::priority_queue<HeapItem, std::vector<HeapItem>,
+                      std::greater<HeapItem>> Heap;
+  for (unsigned i = 0; i < Streams.size(); ++i)
+    if (const Entry *entry = current(Streams[i]))
+      Heap.push(HeapItem(entry->tid, i));
+
+  trace = allocate(slots + 1);
+  mappedBytes = (slots + 1) * sizeof(Entry);
+  unsigned long next = 0;
+  while (!Heap.empty()) {
+    Stream &S = Streams[Heap.top().second];
+    Heap.pop();
+    trace[next] = *current(S);
+    trace[next++].tid = S.tid;
+    ++S.record;
+    if (const Entry *entry = current(S))
+      Heap.push(HeapItem(entry->tid, &S - &Streams[0]));
+  }
+
+  DEBUG(dbgs() << "Merged " << Streams.size() << " timestamped streams\n");
+  finishMerge(next);
+}
+
+void TraceReader::finishMerge(unsigned long slots) {
+  // Squeeze out the slots of sequence numbers which were never written (e.g.
+  // when a thread died in between) and stop at the first END record.
+  unsigned long index = 0;
+  for (unsigned long slot = 0; slot < slots; ++slot) {
+    if (isEmpty(trace[slot]))
+      continue;
+    trace[index++] = trace[slot];
+    if (trace[index - 1].type == RecordType::ENType)
+      break;
+  }
+
+  index = extractStoreLinks(extractCheckpoints(expandStrideHits(index)));
+  if (index == 0 || trace[index - 1].type != RecordType::ENType)
+    trace[index++] = Entry(RecordType::ENType, 0);
+  numEntries = index;
+}
+
+unsigned long TraceReader::expandStrideHits(unsigned long count) {
+  unsigned long records = 0, hits = 0;
+  unsigned keys[StrideHitsPerRecord];
+  for (unsigned long i = 0; i < count; ++i)
+    if (trace[i].type == RecordType::SHType) {
+      ++records;
+      hits += StridePredictor::unpackHits(trace[i], keys);
+    }
+  if (!records)
+    return count;
+
+  // Replay the predictions of every thread. Keep room for an END record.
+  unsigned long entries = count - records + hits + 1;
+  Entry *expanded = allocate(entries);
+  std::map<pthread_t, std::unique_ptr<StridePredictor>> Predictors;
+  unsigned long index = 0, lost = 0;
+  for (unsigned long i = 0; i < count; ++i) {
+    const Entry &entry = trace[i];
+    unsigned key = StridePredictor::getKey(entry.type, entry.id);
+    if (entry.type != RecordType::SHType && !key) {
+      expanded[index++] = entry;
+      continue;
+    }
+
+    std::unique_ptr<StridePredictor> &Predictor = Predictors[entry.tid];
+    if (!Predictor)
+      Predictor.reset(new StridePredictor());
+    if (key) {
+      Predictor->update(key, entry.address, entry.length);
+      expanded[index++] = entry;
+      continue;
+    }
+
+    // A hit the thread has no prediction for follows records which were lost,
+    // e.g. with a segment a crash left uncommitted.
+    unsigned found = StridePredictor::unpackHits(entry, keys);
+    for (unsigned k = 0; k < found; ++k) {
+      uintptr_t address, length;
+      if (Predictor->take(keys[k], address, length))
+        expanded[index++] =
+          StridePredictor::getRecord(keys[k], entry.tid, address, length);
+      else
+        ++lost;
+    }
+  }
+
+  munmap(trace, mappedBytes);
+  trace = expanded;
+  mappedBytes = entries * sizeof(Entry);
+  DEBUG(dbgs() << "Expanded " << hits << " stride hits from " << records
+               << " records, compressing the trace by "
+               << format("%.2f", double(index) / (count ? count : 1))
+               << ", with " << lost << " hits lost\n");
+  return index;
+}
+
+unsigned long TraceReader::extractCheckpoints(unsigned long count) {
+  // The checkpoints whose frames are still to come, with the number of frames
+  // missing. The frames of a checkpoint cut off at the start of a flight
+  // recorder dump have no checkpoint and are dropped, and so are checkpoints
+  // left incomplete by a crash.
+  std::map<pthread_t, std::pair<ThreadContext, unsigned long>> Open;
+  unsigned long index = 0;
+  for (unsigned long i = 0; i < count; ++i) {
+    const Entry &entry = trace[i];
+    if (entry.type != RecordType::CKType) {
+      trace[index++] = entry;
+      continue;
+    }
+
+    if (entry.length == CheckpointBegin) {
+      ThreadContext &Context = Open[entry.tid].first;
+      Context.tid = entry.tid;
+      Context.index = index;
+      Context.calls.clear();
+      Open[entry.tid].second = entry.id;
+    } else {
+      auto It = Open.find(entry.tid);
+      if (It == Open.end())
+        continue;
+      ThreadContext::Frame Frame = { entry.id, entry.address };
+      It->second.first.calls.push_back(Frame);
+      --It->second.second;
+    }
+
+    auto It = Open.find(entry.tid);
+    if (It != Open.end() && It->second.second == 0) {
+      checkpoints.push_back(std::move(It->second.first));
+      Open.erase(It);
+    }
+  }
+
+  // Frames of different threads may interleave, so checkpoints may complete
+  // out of order.
+  std::stable_sort(checkpoints.begin(), checkpoints.end(),
+                   [](const ThreadContext &A, const ThreadContext &B) {
+                     return A.index < B.index;
+                   });
+  DEBUG(dbgs() << "Found " << checkpoints.size() << " checkpoints\n");
+  return index;
+}
+
+unsigned long TraceReader::extractStoreLinks(unsigned long count) {
+  // Resolving the links needs the stores of every thread, so don't bother
+  // without any.
+  unsigned long first = 0;
+  while (first < count && trace[first].type != RecordType::LWType)
+    ++first;
+  if (first == count)
+    return count;
+
+  // The indices of the stores of each thread by ordinal, and the last load of
+  // each thread, which the last writer records of the thread belong to.
+  std::map<pthread_t, std::vector<unsigned long>> Stores;
+  std::map<pthread_t, unsigned long> LastLoad;
+  std::set<unsigned long> Unresolved;
+  unsigned long index = 0;
+  for (unsigned long i = 0; i < count; ++i) {
+    const Entry &entry = trace[i];
+    if (entry.type != RecordType::LWType) {
+      if (entry.type == RecordType::STType)
+        Stores[entry.tid].push_back(index);
+      else if (entry.type == RecordType::LDType)
+        LastLoad[entry.tid] = index;
+      trace[index++] = entry;
+      continue;
+    }
+
+    auto Load = LastLoad.find(entry.tid);
+    if (Load == LastLoad.end())
+      continue;
+    long store = -1;
+    if (entry.address) {
+      // The store may have been lost with a segment a crash left uncommitted.
+      auto Writer = Stores.find(static_cast<pthread_t>(entry.length));
+      if (Writer == Stores.end() || entry.address > Writer->second.size()) {
+        Unresolved.insert(Load->second);
+        continue;
+      }
+      store = Writer->second[entry.address - 1];
+    }
+    links.push_back(std::make_pair(Load->second, store));
+  }
+
+  // The records of different threads may interleave, so the links are only
+  // ordered by load within a thread. A load with any unresolved link has none.
+  std::stable_sort(links.begin(), links.end(),
+                   [](const std::pair<unsigned long, long> &A,
+                      const std::pair<unsigned long, long> &B) {
+                     return A.first < B.first;
+                   });
+  links.erase(std::remove_if(links.begin(), links.end(),
+                             [&](const std::pair<unsigned long, long> &L) {
+                               return Unresolved.count(L.first) != 0;
+                             }),
+              links.end());
+  DEBUG(dbgs() << "Found " << links.size() << " store links\n");
+  return index;
+}
+
+bool TraceReader::findStoreLinks(unsigned long load,
+                                 std::vector<long> &stores) const {
+  stores.clear();
+  auto It = std::lower_bound(links.begin(), links.end(),
+                             std::make_pair(load, -1L),
+                             [](const std::pair<unsigned long, long> &A,
+                                const std::pair<unsigned long, long> &B) {
+                               return A.first < B.first;
+                             });
+  for (; It != links.end() && It->first == load; ++It)
+    stores.push_back(It->second);
+  return !stores.empty();
+}
+
+const ThreadContext *TraceReader::findCheckpoint(pthread_t tid,
+                                                 unsigned long index) const {
+  // Find the first checkpoint after index and search backwards from there.
+  auto It = std::upper_bound(checkpoints.begin(), checkpoints.end(), index,
+                             [](unsigned long Index, const ThreadContext &C) {
+                               return Index < C.index;
+                             });
+  while (It != checkpoints.begin()) {
+    --It;
+    if (It->tid == tid)
+      return &*It;
+  }
+  return nullptr;
+}
+
+std::vector<unsigned long> TraceReader::partition(unsigned parts) const {
+  unsigned long records = numEntries ? numEntries - 1 : 0;
+  std::vector<unsigned long> Bounds(1, 0);
+  unsigned next = 0;
+  for (unsigned part = 1; part < parts; ++part) {
+    unsigned long split = records * part / parts;
+    unsigned long limit = records * (part + 1) / parts;
+    // Move the split forward to a checkpoint before the next split.
+    while (next < checkpoints.size() && checkpoints[next].index < split)
+      ++next;
+    if (next < checkpoints.size() && checkpoints[next].index < limit)
+      split = checkpoints[next].index;
+    if (split > Bounds.back() && split < records)
+      Bounds.push_back(split);
+  }
+  Bounds.push_back(records);
+  return Bounds;
+}
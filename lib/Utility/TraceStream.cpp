@@ -0,0 +1,137 @@
+//===- TraceStream.cpp - Read a live trace from shared memory -------------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the consumer side of the shared memory trace stream.
+// See StreamHeader for the protocol.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "giriutil"
+
+#include "Utility/TraceStream.h"
+
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace dg;
+using namespace llvm;
+
+/// Sleep for the given number of microseconds.
+static void sleepMicros(long micros) {
+  struct timespec delay = { micros / 1000000, (micros % 1000000) * 1000 };
+  nanosleep(&delay, NULL);
+}
+
+TraceStream::TraceStream(const std::string &Name, unsigned Timeout) :
+  stream(nullptr), mappedBytes(0), tail(0), reading(false) {
+  // The program may not have started yet, so wait for the stream to appear
+  // and for its header to be filled in.
+  int fd = -1;
+  for (unsigned i = 0; i <= Timeout * 10; ++i) {
+    fd = shm_open(Name.c_str(), O_RDWR, 0);
+    struct stat finfo;
+    if (fd != -1 && fstat(fd, &finfo) == 0 &&
+        (size_t)finfo.st_size >= StreamDataOffset)
+      break;
+    if (fd != -1)
+      close(fd);
+    fd = -1;
+    sleepMicros(100000);
+  }
+  if (fd == -1)
+    report_fatal_error("Cannot open trace stream " + Name + "!");
+
+  struct stat finfo;
+  fstat(fd, &finfo);
+  mappedBytes = finfo.st_size;
+  stream = (StreamHeader *)mmap(0,
+                                mappedBytes,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED,
+                                fd,
+                                0);
+  close(fd);
+  if (stream == MAP_FAILED)
+    report_fatal_error("Trace stream mmap() failed!");
+
+  while (__atomic_load_n(&stream->magic[7], __ATOMIC_ACQUIRE) != 'M')
+    sleepMicros(1000);
+  if (memcmp(stream->magic, "GIRISTRM", 8) != 0 ||
+      StreamDataOffset + stream->slots * stream->slotBytes > mappedBytes)
+    report_fatal_error(Name + " is not a trace stream!");
+
+  // Only one consumer may attach, and the name isn't needed anymore.
+  __atomic_store_n(&stream->attached, 1, __ATOMIC_RELEASE);
+  shm_unlink(Name.c_str());
+  tail = __atomic_load_n(&stream->tail, __ATOMIC_ACQUIRE);
+  DEBUG(dbgs() << "Attached to trace stream " << Name << " with "
+               << stream->slots << " slots\n");
+}
+
+TraceStream::~TraceStream() {
+  // Release the last slot so that the program doesn't wait for us.
+  if (reading)
+    __atomic_store_n(&stream->tail, tail + 1, __ATOMIC_RELEASE);
+  munmap(stream, mappedBytes);
+}
+
+bool TraceStream::next(const Entry *&Records, unsigned long &Count) {
+  while (true) {
+    if (reading) {
+      __atomic_store_n(&stream->tail, ++tail, __ATOMIC_RELEASE);
+      reading = false;
+    }
+
+    // Wait for the program to publish a slot. Check whether it is done first,
+    // so that a slot published right before finishing isn't missed.
+    bool done = __atomic_load_n(&stream->done, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&stream->head, __ATOMIC_ACQUIRE) == tail) {
+      if (done)
+        return false;
+      sleepMicros(100);
+      continue;
+    }
+
+    reading = true;
+    uint64_t slot = tail % stream->slots;
+    const char *data = reinterpret_cast<const char *>(stream) +
+                       StreamDataOffset + slot * stream->slotBytes;
+    const SegmentHeader *header =
+      reinterpret_cast<const SegmentHeader *>(data);
+    unsigned long length = stream->lengths[slot] / sizeof(Entry);
+    if (length == 0 || header->type != RecordType::SGType ||
+        !(header->flags & CommittedSegment))
+      continue;
+
+    Records = reinterpret_cast<const Entry *>(header + 1);
+    Count = header->count;
+    if (Count > length - 1)
+      Count = length - 1;
+    return true;
+  }
+}
+
+unsigned long TraceStream::dropped() const {
+  return __atomic_load_n(&stream->dropped, __ATOMIC_RELAXED);
+}
+
+std::string TraceStream::defaultName(const std::string &TraceFilename) {
+  std::string::size_type slash = TraceFilename.rfind('/');
+  if (slash == std::string::npos)
+    return "/giri." + TraceFilename;
+  return "/giri." + TraceFilename.substr(slash + 1);
+}
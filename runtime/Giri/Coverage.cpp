@@ -0,0 +1,95 @@
+//===- Coverage.cpp - Write the basic block coverage of a run -------------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the run-time of programs instrumented with
+// -giri-coverage-only. Such a program marks the basic blocks it executes in an
+// array of its own, without calling the run-time, and the run-time writes the
+// array to the coverage file when the program exits or is killed by a signal.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Giri/Runtime.h"
+#include "TraceSink.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef DEBUG_GIRI_RUNTIME
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) do {} while (false)
+#endif
+
+using namespace giri;
+
+//===----------------------------------------------------------------------===//
+//                           Forward declearation
+//===----------------------------------------------------------------------===//
+extern "C" void recordCoverage(const char *name, const unsigned char *blocks,
+                               unsigned count);
+
+/// The name of the coverage file
+static char CoverageName[PATH_MAX];
+
+/// The array of the program marking the executed basic blocks
+static const unsigned char *CoveredBlocks = nullptr;
+static unsigned CoveredBlockCount = 0;
+
+/// Write the coverage file. This is async-signal-safe.
+static void writeCoverage() {
+  int fd = open(CoverageName, O_WRONLY | O_CREAT | O_TRUNC, 0640u);
+  if (fd == -1)
+    return;
+  CoverageHeader header;
+  memcpy(header.magic, "GIRICOV1", sizeof(header.magic));
+  header.blocks = CoveredBlockCount;
+  writeAll(fd, &header, sizeof(header), 0);
+  writeAll(fd, CoveredBlocks, CoveredBlockCount, sizeof(header));
+  close(fd);
+}
+
+/// Write the coverage up to a fatal signal, and raise the signal again with
+/// its default action.
+static void writeCoverageOnSignal(int signum) {
+  static volatile sig_atomic_t handling = 0;
+  if (!handling) {
+    handling = 1;
+    writeCoverage();
+  }
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+
+/// Register the array marking the executed basic blocks, which is written to
+/// the coverage file on exit. This is called by the global constructor of the
+/// instrumented program instead of recordInit().
+/// \param name - The name of the coverage file
+/// \param blocks - One byte for each basic block ID
+/// \param count - The number of basic block IDs
+void recordCoverage(const char *name, const unsigned char *blocks,
+                    unsigned count) {
+  DEBUG("[GIRI] Recording the coverage of %u basic blocks to %s\n", count,
+        name);
+  strncpy(CoverageName, name, sizeof(CoverageName) - 1);
+  CoveredBlocks = blocks;
+  CoveredBlockCount = count;
+
+  atexit(writeCoverage);
+  signal(SIGINT, writeCoverageOnSignal);
+  signal(SIGQUIT, writeCoverageOnSignal);
+  signal(SIGSEGV, writeCoverageOnSignal);
+  signal(SIGABRT, writeCoverageOnSignal);
+  signal(SIGTERM, writeCoverageOnSignal);
+  signal(SIGILL, writeCoverageOnSignal);
+}
@@ -0,0 +1,104 @@
+//===- FastPath.h - The inlineable fast path of the run-time ----*- C++ -*-===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the state the tracing run-time shares with its fast path.
+// The fast path is built as a bitcode module, which the tracing pass links into
+// the program and inlines with -giri-inline-runtime, so that recording a load,
+// store or select in the per-thread buffer mode is a bump of a thread-local
+// cursor and a store of the entry instead of a call into the run-time.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef GIRI_RUNTIME_FASTPATH_H
+#define GIRI_RUNTIME_FASTPATH_H
+
+#include "Giri/Runtime.h"
+#include "TraceClock.h"
+
+#include <atomic>
+
+namespace giri {
+
+/// What the records are stamped with in the per-thread buffer mode
+/// (GIRI_ORDER). A clock doesn't make threads contend for a cache line on
+/// every record like the sequence number, but records of different threads
+/// made within the same tick are merged in an arbitrary order.
+enum RecordOrder {
+  SequenceOrder, ///< The global sequence number
+  TSCOrder,      ///< The time stamp counter, if synchronized across cores
+  ClockOrder     ///< CLOCK_MONOTONIC_RAW
+};
+
+/// \class The part of the segment of a thread which the fast path may append
+/// to without calling the run-time.
+///
+/// The run-time arms the window of a thread while the current basic block of
+/// the thread is traced, up to the end of the segment or the next checkpoint,
+/// whichever comes first. The run-time takes over the records appended through
+/// the window whenever it is called by the thread, and disarms the window
+/// until it returns. A disarmed window has no room.
+struct FastWindow {
+  Entry *cursor; ///< Next free slot
+  Entry *limit;  ///< End of the room, equal to cursor if there is none
+  unsigned epoch; ///< The tracing epoch the window was armed in
+};
+
+/// Incremented whenever tracing is paused or resumed, so tracing is paused
+/// while it is odd. Every basic block remembers the epoch it started in, and
+/// only blocks which started in the current epoch while tracing is enabled are
+/// traced. Hence no block in the trace misses records across a pause.
+extern std::atomic<unsigned> TracingEpoch;
+
+/// Global sequence number stamped on every record in the per-thread buffer
+/// mode. It totally orders the records of all threads, so the trace reader
+/// can merge the per-thread segments back into one trace.
+extern std::atomic<uintptr_t> NextSequence;
+
+extern RecordOrder Ordering;
+
+/// The window of the calling thread, or nullptr if the fast path is off. The
+/// program and the run-time are linked into one executable, so the window is
+/// addressed without calling the TLS resolver.
+extern __thread FastWindow *CurrentWindow
+  __attribute__((tls_model("initial-exec")));
+
+/// Get the stamp of the next record in the per-thread buffer mode.
+static inline uintptr_t nextStamp() {
+  if (Ordering == TSCOrder)
+    return readTSC();
+  if (Ordering == ClockOrder)
+    return readRawClock();
+  return NextSequence.fetch_add(1, std::memory_order_relaxed);
+}
+
+/// Append a record to the segment of the calling thread through its window.
+/// The cursor is only advanced after the entry is complete, so a signal
+/// handler committing the segment never sees a partial entry.
+/// \return false if the window has no room or tracing was paused or resumed
+/// since it was armed, in which case the run-time must record the entry.
+static inline bool appendFast(RecordType type, unsigned id, uintptr_t address,
+                              uintptr_t length) {
+  FastWindow *W = CurrentWindow;
+  if (!W || W->cursor == W->limit ||
+      W->epoch != TracingEpoch.load(std::memory_order_relaxed))
+    return false;
+  Entry *entry = W->cursor;
+  entry->type = type;
+  entry->id = id;
+  entry->tid = nextStamp();
+  entry->address = address;
+  entry->length = length;
+  std::atomic_signal_fence(std::memory_order_release);
+  W->cursor = entry + 1;
+  return true;
+}
+
+} // END namespace giri
+
+#endif
@@ -0,0 +1,806 @@
+//===- RecordReplay.cpp - Record and replay nondeterministic inputs -------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the run-time of the -giri-intercept pass, which
+// redirects the calls of a program to nondeterministic library functions to
+// the giri_rr_ wrappers defined here.
+//
+// With GIRI_RR=record, the wrappers call the library and log the results to
+// GIRI_RR_LOG (giri.rr by default), together with the order in which the
+// threads pass through the intercepted calls and the points where signals are
+// delivered. Nothing else is traced, so a program built with -giri-intercept
+// alone runs almost at native speed.
+//
+// With GIRI_RR=replay, the wrappers return the logged results instead of
+// calling the library, and each thread waits until its next intercepted call
+// is the next one in the log. A program built with both -trace-giri and
+// -giri-intercept thus writes the full trace of the recorded run. Without
+// GIRI_RR, the wrappers just call the library.
+//
+// The replay is deterministic for programs which synchronize only through the
+// intercepted pthread functions. A signal is delivered in replay right before
+// the next intercepted call its thread makes after the recorded delivery.
+//
+// fscanf() and scanf() log the values they assign, whose sizes are taken from
+// the conversions of the format. Conversions allocating their string (%m) and
+// numbered arguments (%n$) are not supported.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef DEBUG_GIRI_RUNTIME
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) do {} while (false)
+#endif
+
+#define ERROR(...) fprintf(stderr, __VA_ARGS__)
+
+typedef void (*SignalHandler)(int);
+typedef void *(*ThreadStart)(void *);
+
+//===----------------------------------------------------------------------===//
+//                           Forward declearation
+//===----------------------------------------------------------------------===//
+extern "C" ssize_t giri_rr_read(int fd, void *buf, size_t count);
+extern "C" size_t giri_rr_fread(void *ptr, size_t size, size_t n, FILE *stream);
+extern "C" char *giri_rr_fgets(char *s, int size, FILE *stream);
+extern "C" int giri_rr_fgetc(FILE *stream);
+extern "C" int giri_rr_getc(FILE *stream);
+extern "C" int giri_rr_getchar(void);
+extern "C" int giri_rr_fscanf(FILE *stream, const char *format, ...);
+extern "C" int giri_rr_scanf(const char *format, ...);
+extern "C" int giri_rr___isoc99_fscanf(FILE *stream, const char *format, ...);
+extern "C" int giri_rr___isoc99_scanf(const char *format, ...);
+extern "C" time_t giri_rr_time(time_t *t);
+extern "C" int giri_rr_gettimeofday(struct timeval *tv, void *tz);
+extern "C" int giri_rr_clock_gettime(clockid_t clk, struct timespec *ts);
+extern "C" int giri_rr_rand(void);
+extern "C" long giri_rr_random(void);
+extern "C" SignalHandler giri_rr_signal(int signum, SignalHandler handler);
+extern "C" int giri_rr_pthread_create(pthread_t *thread,
+                                      const pthread_attr_t *attr,
+                                      ThreadStart start,
+                                      void *arg);
+extern "C" int giri_rr_pthread_join(pthread_t thread, void **retval);
+extern "C" int giri_rr_pthread_mutex_lock(pthread_mutex_t *mutex);
+extern "C" int giri_rr_pthread_mutex_trylock(pthread_mutex_t *mutex);
+extern "C" int giri_rr_pthread_mutex_unlock(pthread_mutex_t *mutex);
+extern "C" int giri_rr_pthread_cond_wait(pthread_cond_t *cond,
+                                         pthread_mutex_t *mutex);
+extern "C" int giri_rr_pthread_cond_timedwait(pthread_cond_t *cond,
+                                              pthread_mutex_t *mutex,
+                                              const struct timespec *abstime);
+extern "C" int giri_rr_pthread_cond_signal(pthread_cond_t *cond);
+extern "C" int giri_rr_pthread_cond_broadcast(pthread_cond_t *cond);
+extern "C" int giri_rr_pthread_barrier_wait(pthread_barrier_t *barrier);
+
+//===----------------------------------------------------------------------===//
+//                             Replay Log
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// The kinds of events in the replay log
+enum EventKind : uint32_t {
+  ReadEvent = 1,  // The bytes read by read(), fread() or fgets()
+  CharEvent,      // The character returned by fgetc() and friends
+  TimeEvent,      // The result of time(), gettimeofday() or clock_gettime()
+  RandomEvent,    // The result of rand() or random()
+  SignalEvent,    // The delivery of a signal
+  CreateEvent,    // The creation of a thread
+  JoinEvent,      // The end of waiting for a thread
+  LockEvent,      // The acquisition (or failed trylock) of a mutex
+  UnlockEvent,    // The release of a mutex
+  ScanEvent,      // The values assigned by fscanf() or scanf()
+  NotifyEvent,    // The signal or broadcast of a condition variable
+  ArriveEvent,    // The arrival at a barrier
+  LeaveEvent      // The end of waiting at a barrier
+};
+
+/// The header of one event in the replay log, which is followed by length
+/// bytes of data returned through pointer arguments.
+struct Event {
+  uint32_t kind; ///< The EventKind
+  uint32_t thread; ///< The index of the thread in creation order
+  int64_t result; ///< The return value of the call
+  uint32_t error; ///< The errno after the call
+  uint32_t padding;
+  uint64_t length; ///< The number of bytes of data following the header
+};
+
+/// Identifies a replay log
+static const char LogMagic[8] = { 'G', 'I', 'R', 'I', 'R', 'R', '1', 0 };
+
+enum ReplayMode { PassThrough, Recording, Replaying };
+
+} // END anonymous namespace
+
+static ReplayMode Mode = PassThrough;
+static pthread_once_t InitOnce = PTHREAD_ONCE_INIT;
+
+/// The log being written while recording
+static FILE *Log = nullptr;
+/// Serializes the events written to the log
+static pthread_mutex_t LogMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// The mapped log being replayed
+static const char *Replay = nullptr;
+static size_t ReplayBytes = 0;
+/// Offset of the next event to replay
+static size_t Cursor = 0;
+/// Guards the cursor, which is signalled whenever it advances
+static pthread_mutex_t ReplayMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ReplayAdvanced = PTHREAD_COND_INITIALIZER;
+
+/// The index of the next thread, which is deterministic since threads are
+/// created in the logged order
+static uint32_t NextThread = 0;
+static thread_local int32_t ThreadIndex = -1;
+
+/// Signals delivered to the thread while recording, which are logged with its
+/// next event
+static const unsigned MaxPendingSignals = 16;
+static thread_local volatile sig_atomic_t PendingSignals[MaxPendingSignals];
+static thread_local volatile sig_atomic_t NumPendingSignals = 0;
+
+/// The handlers the program has installed with signal()
+static volatile SignalHandler Handlers[NSIG];
+
+static void finishRecording() {
+  pthread_mutex_lock(&LogMutex);
+  fclose(Log);
+  Log = nullptr;
+  pthread_mutex_unlock(&LogMutex);
+}
+
+/// Select the mode and open the log.
+static void initReplay() {
+  const char *mode = getenv("GIRI_RR");
+  const char *name = getenv("GIRI_RR_LOG");
+  if (!name)
+    name = "giri.rr";
+  if (!mode)
+    return;
+
+  if (!strcmp(mode, "record")) {
+    Log = fopen(name, "wb");
+    if (!Log) {
+      ERROR("[GIRI] Cannot create replay log %s: %s\n", name, strerror(errno));
+      return;
+    }
+    setvbuf(Log, nullptr, _IOFBF, 1 << 16);
+    fwrite(LogMagic, sizeof(LogMagic), 1, Log);
+    Mode = Recording;
+    atexit(finishRecording);
+  } else if (!strcmp(mode, "replay")) {
+    int fd = open(name, O_RDONLY);
+    struct stat finfo;
+    if (fd == -1 || fstat(fd, &finfo) != 0) {
+      ERROR("[GIRI] Cannot open replay log %s: %s\n", name, strerror(errno));
+      abort();
+    }
+    ReplayBytes = finfo.st_size;
+    Replay = (const char *)mmap(0, ReplayBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (Replay == MAP_FAILED || ReplayBytes < sizeof(LogMagic) ||
+        memcmp(Replay, LogMagic, sizeof(LogMagic))) {
+      ERROR("[GIRI] %s is not a replay log\n", name);
+      abort();
+    }
+    Cursor = sizeof(LogMagic);
+    Mode = Replaying;
+  } else {
+    ERROR("[GIRI] Unknown GIRI_RR %s, neither recording nor replaying\n", mode);
+  }
+  DEBUG("[GIRI] Replay log %s, mode %d\n", name, Mode);
+}
+
+static inline ReplayMode replayMode() {
+  pthread_once(&InitOnce, initReplay);
+  return Mode;
+}
+
+/// Get the index of the calling thread. Threads which weren't created through
+/// an intercepted call get one on their first event.
+static uint32_t threadIndex() {
+  if (ThreadIndex == -1)
+    ThreadIndex = __atomic_fetch_add(&NextThread, 1, __ATOMIC_RELAXED);
+  return ThreadIndex;
+}
+
+/// Write one event to the log. LogMutex must be held.
+static void writeEvent(uint32_t kind, int64_t result, int error,
+                       const void *data, size_t length) {
+  if (!Log)
+    return;
+  Event E = { kind, threadIndex(), result, uint32_t(error), 0, length };
+  fwrite(&E, sizeof(E), 1, Log);
+  if (length)
+    fwrite(data, length, 1, Log);
+}
+
+/// Log an event of the calling thread, after the signals delivered to it since
+/// its last event.
+static void logEvent(uint32_t kind, int64_t result, int error,
+                     const void *data = nullptr, size_t length = 0) {
+  pthread_mutex_lock(&LogMutex);
+  while (NumPendingSignals) {
+    int signum = PendingSignals[0];
+    for (int i = 1; i < NumPendingSignals; ++i)
+      PendingSignals[i - 1] = PendingSignals[i];
+    --NumPendingSignals;
+    writeEvent(SignalEvent, signum, 0, nullptr, 0);
+  }
+  writeEvent(kind, result, error, data, length);
+  pthread_mutex_unlock(&LogMutex);
+}
+
+/// Wait until the next event in the log belongs to the calling thread, and
+/// deliver the signals logged for it before. The event is returned without
+/// consuming it, so other threads keep waiting until finishTurn(). If the log
+/// is exhausted, e.g. as the recorded run was killed, the program goes on
+/// without replaying and nullptr is returned.
+static const Event *waitTurn(uint32_t kind) {
+  uint32_t thread = threadIndex();
+  pthread_mutex_lock(&ReplayMutex);
+  while (true) {
+    if (Cursor + sizeof(Event) > ReplayBytes) {
+      if (Mode == Replaying)
+        ERROR("[GIRI] The replay log is exhausted, running live\n");
+      Mode = PassThrough;
+      pthread_cond_broadcast(&ReplayAdvanced);
+      pthread_mutex_unlock(&ReplayMutex);
+      return nullptr;
+    }
+
+    const Event *E = reinterpret_cast<const Event *>(Replay + Cursor);
+    if (E->thread != thread) {
+      pthread_cond_wait(&ReplayAdvanced, &ReplayMutex);
+      continue;
+    }
+
+    if (E->kind == SignalEvent) {
+      int signum = E->result;
+      Cursor += sizeof(Event);
+      pthread_cond_broadcast(&ReplayAdvanced);
+      pthread_mutex_unlock(&ReplayMutex);
+      SignalHandler handler = Handlers[signum];
+      if (handler && handler != SIG_IGN && handler != SIG_DFL)
+        handler(signum);
+      pthread_mutex_lock(&ReplayMutex);
+      continue;
+    }
+
+    if (E->kind != kind) {
+      ERROR("[GIRI] Replay diverged: thread %u expected event %u, got %u\n",
+            thread, E->kind, kind);
+      abort();
+    }
+    pthread_mutex_unlock(&ReplayMutex);
+    errno = E->error;
+    return E;
+  }
+}
+
+/// Consume the event returned by waitTurn() and let the next thread go on.
+static void finishTurn(const Event *E) {
+  pthread_mutex_lock(&ReplayMutex);
+  Cursor += sizeof(Event) + E->length;
+  pthread_cond_broadcast(&ReplayAdvanced);
+  pthread_mutex_unlock(&ReplayMutex);
+}
+
+/// Get the data following an event.
+static inline const void *eventData(const Event *E) {
+  return E + 1;
+}
+
+//===----------------------------------------------------------------------===//
+//                              Input Wrappers
+//===----------------------------------------------------------------------===//
+
+ssize_t giri_rr_read(int fd, void *buf, size_t count) {
+  if (replayMode() == Replaying)
+    if (const Event *E = waitTurn(ReadEvent)) {
+      memcpy(buf, eventData(E), E->length);
+      ssize_t result = E->result;
+      finishTurn(E);
+      return result;
+    }
+
+  ssize_t result = read(fd, buf, count);
+  if (Mode == Recording)
+    logEvent(ReadEvent, result, errno, buf, result > 0 ? result : 0);
+  return result;
+}
+
+size_t giri_rr_fread(void *ptr, size_t size, size_t n, FILE *stream) {
+  if (replayMode() == Replaying)
+    if (const Event *E = waitTurn(ReadEvent)) {
+      memcpy(ptr, eventData(E), E->length);
+      size_t result = E->result;
+      finishTurn(E);
+      return result;
+    }
+
+  size_t result = fread(ptr, size, n, stream);
+  if (Mode == Recording)
+    logEvent(ReadEvent, result, errno, ptr, result * size);
+  return result;
+}
+
+char *giri_rr_fgets(char *s, int size, FILE *stream) {
+  if (replayMode() == Replaying)
+    if (const Event *E = waitTurn(ReadEvent)) {
+      memcpy(s, eventData(E), E->length);
+      char *result = E->result ? s : nullptr;
+      finishTurn(E);
+      return result;
+    }
+
+  char *result = fgets(s, size, stream);
+  if (Mode == Recording)
+    logEvent(ReadEvent, result != nullptr, errno, s,
+             result ? strlen(s) + 1 : 0);
+  return result;
+}
+
+/// Replay or record the result of a function returning a plain value.
+template <typename T, typename Call>
+static inline T valueEvent(uint32_t kind, Call call) {
+  if (replayMode() == Replaying)
+    if (const Event *E = waitTurn(kind)) {
+      T result = static_cast<T>(E->result);
+      finishTurn(E);
+      return result;
+    }
+
+  T result = call();
+  if (Mode == Recording)
+    logEvent(kind, result, errno);
+  return result;
+}
+
+int giri_rr_fgetc(FILE *stream) {
+  return valueEvent<int>(CharEvent, [=] { return fgetc(stream); });
+}
+
+int giri_rr_getc(FILE *stream) {
+  return valueEvent<int>(CharEvent, [=] { return getc(stream); });
+}
+
+int giri_rr_getchar(void) {
+  return valueEvent<int>(CharEvent, [] { return getchar(); });
+}
+
+int giri_rr_rand(void) {
+  return valueEvent<int>(RandomEvent, [] { return rand(); });
+}
+
+long giri_rr_random(void) {
+  return valueEvent<long>(RandomEvent, [] { return random(); });
+}
+
+time_t giri_rr_time(time_t *t) {
+  time_t result = valueEvent<time_t>(TimeEvent, [] { return time(nullptr); });
+  if (t)
+    *t = result;
+  return result;
+}
+
+/// Replay or record the result of a function filling a structure.
+template <typename T, typename Call>
+static inline int structEvent(T *out, Call call) {
+  if (replayMode() == Replaying)
+    if (const Event *E = waitTurn(TimeEvent)) {
+      if (out && E->length == sizeof(T))
+        memcpy(out, eventData(E), sizeof(T));
+      int result = E->result;
+      finishTurn(E);
+      return result;
+    }
+
+  int result = call();
+  if (Mode == Recording)
+    logEvent(TimeEvent, result, errno, out, out ? sizeof(T) : 0);
+  return result;
+}
+
+int giri_rr_gettimeofday(struct timeval *tv, void *tz) {
+  return structEvent(tv, [=] {
+    return gettimeofday(tv, static_cast<struct timezone *>(tz));
+  });
+}
+
+int giri_rr_clock_gettime(clockid_t clk, struct timespec *ts) {
+  return structEvent(ts, [=] { return clock_gettime(clk, ts); });
+}
+
+/// Call visit(pointer, size, wide) for each of the first count values which a
+/// scanf() call with the given format and arguments assigned, in order. The
+/// size of a string is 0 since it depends on the characters read, and wide is
+/// set for a string of wide characters.
+template <typename Visit>
+static void forEachScanned(const char *format, va_list args, int count,
+                           Visit visit) {
+  va_list ap;
+  va_copy(ap, args);
+  for (const char *f = format; *f && count > 0; ++f) {
+    if (*f != '%' || *++f == '%')
+      continue;
+    bool assigned = *f != '*';
+    if (!assigned)
+      ++f;
+    unsigned width = 0;
+    while (isdigit(*f))
+      width = width * 10 + (*f++ - '0');
+
+    // The length modifier, with hh as H and ll as q
+    char length = 0;
+    if (strchr("hlLqjzt", *f)) {
+      length = *f++;
+      if ((length == 'h' || length == 'l') && *f == length) {
+        length = length == 'h' ? 'H' : 'q';
+        ++f;
+      }
+    }
+
+    size_t size = 0;
+    bool wide = length == 'l';
+    switch (*f) {
+      case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'n':
+        switch (length) {
+          case 'H': size = sizeof(char); break;
+          case 'h': size = sizeof(short); break;
+          case 'l': size = sizeof(long); break;
+          case 'q': case 'L': size = sizeof(long long); break;
+          case 'j': size = sizeof(intmax_t); break;
+          case 'z': size = sizeof(size_t); break;
+          case 't': size = sizeof(ptrdiff_t); break;
+          default: size = sizeof(int); break;
+        }
+        break;
+      case 'a': case 'A': case 'e': case 'E': case 'f': case 'F': case 'g':
+      case 'G':
+        size = length == 'l' ? sizeof(double)
+             : length == 'L' ? sizeof(long double) : sizeof(float);
+        break;
+      case 'p':
+        size = sizeof(void *);
+        break;
+      case 'c':
+        size = (width ? width : 1) * (wide ? sizeof(wchar_t) : sizeof(char));
+        break;
+      case '[':
+        // Skip the scanset, in which a leading ] is a member.
+        if (*++f == '^')
+          ++f;
+        if (*f == ']')
+          ++f;
+        while (*f && *f != ']')
+          ++f;
+        break;
+      case 's':
+        break;
+      default:
+        va_end(ap);
+        return;
+    }
+    if (!*f)
+      break;
+    if (!assigned)
+      continue;
+    visit(va_arg(ap, void *), size, wide);
+    if (*f != 'n')
+      --count;
+  }
+  va_end(ap);
+}
+
+/// Replay or record a call to vfscanf(), logging the bytes of every value it
+/// assigned preceded by their number.
+static int scanEvent(FILE *stream, const char *format, va_list args) {
+  if (replayMode() == Replaying)
+    if (const Event *E = waitTurn(ScanEvent)) {
+      const char *data = static_cast<const char *>(eventData(E));
+      forEachScanned(format, args, E->result, [&](void *p, size_t, bool) {
+        uint64_t size;
+        memcpy(&size, data, sizeof(size));
+        memcpy(p, data + sizeof(size), size);
+        data += sizeof(size) + size;
+      });
+      int result = E->result;
+      finishTurn(E);
+      return result;
+    }
+
+  va_list live;
+  va_copy(live, args);
+  int result = vfscanf(stream, format, live);
+  int error = errno;
+  va_end(live);
+  if (Mode == Recording) {
+    std::string data;
+    forEachScanned(format, args, result, [&](void *p, size_t size, bool wide) {
+      if (!size)
+        size = wide ? (wcslen(static_cast<wchar_t *>(p)) + 1) * sizeof(wchar_t)
+                    : strlen(static_cast<char *>(p)) + 1;
+      uint64_t bytes = size;
+      data.append(reinterpret_cast<const char *>(&bytes), sizeof(bytes));
+      data.append(static_cast<const char *>(p), size);
+    });
+    logEvent(ScanEvent, result, error, data.data(), data.size());
+  }
+  errno = error;
+  return result;
+}
+
+int giri_rr_fscanf(FILE *stream, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = scanEvent(stream, format, args);
+  va_end(args);
+  return result;
+}
+
+int giri_rr_scanf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = scanEvent(stdin, format, args);
+  va_end(args);
+  return result;
+}
+
+// The C library declares fscanf() and scanf() under these names in C99 mode.
+int giri_rr___isoc99_fscanf(FILE *stream, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = scanEvent(stream, format, args);
+  va_end(args);
+  return result;
+}
+
+int giri_rr___isoc99_scanf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = scanEvent(stdin, format, args);
+  va_end(args);
+  return result;
+}
+
+//===----------------------------------------------------------------------===//
+//                             Signal Delivery
+//===----------------------------------------------------------------------===//
+
+/// Note a delivered signal for the next event of the thread, and run the
+/// handler of the program.
+static void recordSignal(int signum) {
+  if (NumPendingSignals < static_cast<int>(MaxPendingSignals))
+    PendingSignals[NumPendingSignals++] = signum;
+  SignalHandler handler = Handlers[signum];
+  if (handler && handler != SIG_IGN && handler != SIG_DFL)
+    handler(signum);
+}
+
+/// Ignore signals while replaying, as the logged ones are delivered instead.
+static void dropSignal(int) {}
+
+SignalHandler giri_rr_signal(int signum, SignalHandler handler) {
+  ReplayMode mode = replayMode();
+  if (mode == PassThrough || signum <= 0 || signum >= NSIG ||
+      handler == SIG_IGN || handler == SIG_DFL) {
+    if (signum > 0 && signum < NSIG)
+      Handlers[signum] = handler;
+    return signal(signum, handler);
+  }
+
+  SignalHandler previous = Handlers[signum];
+  Handlers[signum] = handler;
+  if (signal(signum, mode == Recording ? recordSignal : dropSignal) == SIG_ERR)
+    return SIG_ERR;
+  return previous;
+}
+
+//===----------------------------------------------------------------------===//
+//                            Thread Scheduling
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// The start routine of a created thread with the index it gets
+struct ThreadStartInfo {
+  ThreadStart start;
+  void *arg;
+  uint32_t index;
+};
+
+} // END anonymous namespace
+
+static void *startThread(void *info) {
+  ThreadStartInfo Info = *static_cast<ThreadStartInfo *>(info);
+  free(info);
+  ThreadIndex = Info.index;
+  return Info.start(Info.arg);
+}
+
+int giri_rr_pthread_create(pthread_t *thread,
+                           const pthread_attr_t *attr,
+                           ThreadStart start,
+                           void *arg) {
+  ReplayMode mode = replayMode();
+  const Event *E = mode == Replaying ? waitTurn(CreateEvent) : nullptr;
+  if (mode == PassThrough || (mode == Replaying && !E))
+    return pthread_create(thread, attr, start, arg);
+
+  // The thread index is taken in the logged order.
+  ThreadStartInfo *Info =
+    static_cast<ThreadStartInfo *>(malloc(sizeof(ThreadStartInfo)));
+  Info->start = start;
+  Info->arg = arg;
+  threadIndex();
+  if (mode == Recording)
+    pthread_mutex_lock(&LogMutex);
+  uint32_t index = __atomic_fetch_add(&NextThread, 1, __ATOMIC_RELAXED);
+  Info->index = index;
+  int result = pthread_create(thread, attr, startThread, Info);
+  if (result)
+    free(Info);
+  if (mode == Recording) {
+    writeEvent(CreateEvent, index, result, nullptr, 0);
+    pthread_mutex_unlock(&LogMutex);
+  } else {
+    finishTurn(E);
+  }
+  return result;
+}
+
+/// Replay or record a synchronization operation which is performed in both
+/// modes. Unless logFirst is set, the operation is logged once it has
+/// completed, so a mutex is logged by the thread which acquired it.
+template <typename Call>
+static inline int syncEvent(uint32_t kind, bool logFirst, Call call) {
+  ReplayMode mode = replayMode();
+  if (mode == Replaying)
+    if (const Event *E = waitTurn(kind)) {
+      int result = call();
+      finishTurn(E);
+      return result;
+    }
+
+  if (mode == Recording && logFirst)
+    logEvent(kind, 0, 0);
+  int result = call();
+  if (mode == Recording && !logFirst)
+    logEvent(kind, result, 0);
+  return result;
+}
+
+int giri_rr_pthread_join(pthread_t thread, void **retval) {
+  return syncEvent(JoinEvent, false,
+                   [=] { return pthread_join(thread, retval); });
+}
+
+int giri_rr_pthread_mutex_lock(pthread_mutex_t *mutex) {
+  return syncEvent(LockEvent, false,
+                   [=] { return pthread_mutex_lock(mutex); });
+}
+
+int giri_rr_pthread_mutex_trylock(pthread_mutex_t *mutex) {
+  // A trylock which failed in the recorded run must fail again, so the mutex
+  // is only taken while replaying if it was taken while recording.
+  if (replayMode() == Replaying)
+    if (const Event *E = waitTurn(LockEvent)) {
+      int result = E->result ? int(E->result) : pthread_mutex_lock(mutex);
+      finishTurn(E);
+      return result;
+    }
+  return syncEvent(LockEvent, false,
+                   [=] { return pthread_mutex_trylock(mutex); });
+}
+
+int giri_rr_pthread_mutex_unlock(pthread_mutex_t *mutex) {
+  // The release is logged before the next thread can acquire the mutex.
+  return syncEvent(UnlockEvent, true,
+                   [=] { return pthread_mutex_unlock(mutex); });
+}
+
+/// Replay or record waiting for a condition variable, which is logged as the
+/// release of the mutex and its acquisition on waking up. The condition
+/// variable isn't waited for while replaying, as the thread simply takes the
+/// mutex back in the logged order, and returns the logged result.
+template <typename Call>
+static inline int waitEvent(pthread_mutex_t *mutex, Call call) {
+  ReplayMode mode = replayMode();
+  if (mode == Replaying)
+    if (const Event *E = waitTurn(UnlockEvent)) {
+      pthread_mutex_unlock(mutex);
+      finishTurn(E);
+      // Wait live if the log ends while the mutex is released.
+      E = waitTurn(LockEvent);
+      pthread_mutex_lock(mutex);
+      if (!E)
+        return call();
+      int result = E->result;
+      finishTurn(E);
+      return result;
+    }
+
+  if (mode == Recording)
+    logEvent(UnlockEvent, 0, 0);
+  int result = call();
+  if (mode == Recording)
+    logEvent(LockEvent, result, 0);
+  return result;
+}
+
+int giri_rr_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+  return waitEvent(mutex, [=] { return pthread_cond_wait(cond, mutex); });
+}
+
+int giri_rr_pthread_cond_timedwait(pthread_cond_t *cond,
+                                   pthread_mutex_t *mutex,
+                                   const struct timespec *abstime) {
+  return waitEvent(mutex, [=] {
+    return pthread_cond_timedwait(cond, mutex, abstime);
+  });
+}
+
+int giri_rr_pthread_cond_signal(pthread_cond_t *cond) {
+  // The signal is logged before the waiter it wakes can take the mutex.
+  return syncEvent(NotifyEvent, true,
+                   [=] { return pthread_cond_signal(cond); });
+}
+
+int giri_rr_pthread_cond_broadcast(pthread_cond_t *cond) {
+  return syncEvent(NotifyEvent, true,
+                   [=] { return pthread_cond_broadcast(cond); });
+}
+
+int giri_rr_pthread_barrier_wait(pthread_barrier_t *barrier) {
+  // The arrivals of all threads are logged before the first of them leaves, so
+  // the threads replay them in order and then meet at the barrier. Each one
+  // leaves with its logged result, which picks the same serial thread.
+  ReplayMode mode = replayMode();
+  if (mode == Replaying)
+    if (const Event *E = waitTurn(ArriveEvent)) {
+      finishTurn(E);
+      int result = pthread_barrier_wait(barrier);
+      if ((E = waitTurn(LeaveEvent))) {
+        result = E->result;
+        finishTurn(E);
+      }
+      return result;
+    }
+
+  if (mode == Recording)
+    logEvent(ArriveEvent, 0, 0);
+  int result = pthread_barrier_wait(barrier);
+  if (mode == Recording)
+    logEvent(LeaveEvent, result, 0);
+  return result;
+}
@@ -0,0 +1,110 @@
+//===- ShadowMemory.cpp - The last store of every memory granule ----------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the shadow memory mapping granules of the address space
+// to the stores which last wrote them.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ShadowMemory.h"
+
+#include <sys/mman.h>
+
+using namespace giri;
+
+/// Number of address bits shadowed. Higher addresses are never shadowed.
+static const unsigned AddressBits = 48;
+
+/// Number of address bits covered by one second-level table
+static const unsigned RegionBits = 28;
+
+static const uintptr_t RegionCount = 1UL << (AddressBits - RegionBits);
+static const uintptr_t RegionMask = (1UL << RegionBits) - 1;
+
+/// Map zeroed memory without reserving swap space for it.
+static void *mapZeroed(size_t bytes) {
+  void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? nullptr : p;
+}
+
+bool ShadowMemory::init(unsigned granularity, const char *&reason) {
+  if (!granularity || granularity > 4096 ||
+      (granularity & (granularity - 1))) {
+    reason = "the granularity must be a power of two up to 4096";
+    return false;
+  }
+  shift = __builtin_ctz(granularity);
+
+  void *table = mapZeroed(RegionCount * sizeof(*regions));
+  if (!table) {
+    reason = "the shadow memory can't be mapped";
+    return false;
+  }
+  regions = static_cast<std::atomic<Granule *> *>(table);
+  return true;
+}
+
+ShadowMemory::Granule *ShadowMemory::granule(uintptr_t address, bool create) {
+  uintptr_t region = address >> RegionBits;
+  if (region >= RegionCount)
+    return nullptr;
+
+  Granule *table = regions[region].load(std::memory_order_acquire);
+  if (!table && create) {
+    // Threads storing into a new region race to map its table. The losers
+    // unmap theirs.
+    size_t bytes = (1UL << (RegionBits - shift)) * sizeof(Granule);
+    Granule *fresh = static_cast<Granule *>(mapZeroed(bytes));
+    if (!fresh)
+      return nullptr;
+    if (regions[region].compare_exchange_strong(table, fresh,
+                                                std::memory_order_acq_rel))
+      table = fresh;
+    else
+      munmap(fresh, bytes);
+  }
+  return table ? &table[(address & RegionMask) >> shift] : nullptr;
+}
+
+void ShadowMemory::store(uintptr_t address, uintptr_t length,
+                         uint64_t writer) {
+  if (!length)
+    return;
+  uintptr_t end = address + length;
+  uintptr_t size = 1UL << shift;
+  for (uintptr_t start = address & ~(size - 1); start < end; start += size) {
+    bool whole = address <= start && start + size <= end;
+    uint64_t value = whole ? writer : Mixed;
+    // A granule never written is already cleared.
+    if (Granule *G = granule(start, value != 0))
+      G->store(value, std::memory_order_relaxed);
+  }
+}
+
+int ShadowMemory::load(uintptr_t address, uintptr_t length, uint64_t *writers,
+                       unsigned max) {
+  if (address >> AddressBits)
+    return -1;
+  uintptr_t end = address + length;
+  uintptr_t size = 1UL << shift;
+  unsigned count = 0;
+  for (uintptr_t start = address & ~(size - 1); start < end; start += size) {
+    Granule *G = granule(start, false);
+    uint64_t value = G ? G->load(std::memory_order_relaxed) : 0;
+    if (value == Mixed)
+      return -1;
+    if (count && writers[count - 1] == value)
+      continue;
+    if (count == max)
+      return -1;
+    writers[count++] = value;
+  }
+  return count;
+}
@@ -0,0 +1,76 @@
+//===- ShadowMemory.h - The last store of every memory granule --*- C++ -*-===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the shadow memory with which the run-time links every load
+// to the stores it reads from while tracing, so that the slicer doesn't have to
+// search the trace for them.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef GIRI_RUNTIME_SHADOWMEMORY_H
+#define GIRI_RUNTIME_SHADOWMEMORY_H
+
+#include <atomic>
+#include <stdint.h>
+
+namespace giri {
+
+/// \class A map from the granules of the address space to the last store
+/// which wrote them.
+///
+/// A writer is a nonzero 63-bit value identifying a store record. A granule
+/// never written holds 0. A granule which was only partly written by its last
+/// store holds Mixed, since the writer of its other bytes isn't known.
+///
+/// The map is a two-level table. A second-level table covers a region of the
+/// address space, and is mapped without reserving swap space the first time a
+/// store writes into the region, so only the pages of the table which shadow
+/// written memory take up memory.
+class ShadowMemory {
+public:
+  /// The value of a granule whose bytes may have different writers
+  static const uint64_t Mixed = 1ULL << 63;
+
+  ShadowMemory() : shift(0), regions(nullptr) {}
+
+  /// Map the first-level table.
+  ///
+  /// \param granularity - The size of a granule, a power of two up to 4096.
+  /// \param[out] reason - Why the shadow memory can't be used, if it can't.
+  /// \return true if the shadow memory is ready.
+  bool init(unsigned granularity, const char *&reason);
+
+  /// Set the writer of the memory written by a store. Granules which are only
+  /// partly written become Mixed.
+  void store(uintptr_t address, uintptr_t length, uint64_t writer);
+
+  /// Find the writers of the memory read by a load. Consecutive granules with
+  /// the same writer yield one writer. A granule never written yields 0.
+  ///
+  /// \param[out] writers - The writers, in the order of the memory.
+  /// \param max - The number of writers which fit into writers.
+  /// \return the number of writers, or -1 if the load reads a Mixed granule or
+  /// has more writers than fit.
+  int load(uintptr_t address, uintptr_t length, uint64_t *writers,
+           unsigned max);
+
+private:
+  typedef std::atomic<uint64_t> Granule;
+
+  /// Get the granule of an address. Only a store maps a missing region.
+  /// \return the granule, or nullptr if the region isn't mapped.
+  Granule *granule(uintptr_t address, bool create);
+
+  unsigned shift; ///< log2 of the granularity
+  std::atomic<Granule *> *regions; ///< The first-level table
+};
+
+} // END namespace giri
+
+#endif
@@ -0,0 +1,77 @@
+//===- TraceClock.cpp - Clocks ordering the records of threads ------------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the validation of the time stamp counter as a clock
+// which is consistent across cores.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "TraceClock.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef GIRI_HAVE_TSC
+#include <cpuid.h>
+#endif
+
+using namespace giri;
+
+/// Number of rounds the counter is read on every core
+static const unsigned ValidationRounds = 4;
+
+bool giri::tscIsSynchronized(const char *&reason) {
+#ifndef GIRI_HAVE_TSC
+  reason = "the processor has no time stamp counter";
+  return false;
+#else
+  // An invariant counter ticks at a constant rate in all power states.
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007 ||
+      !__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+    reason = "the time stamp counter isn't invariant";
+    return false;
+  }
+
+  // Hop across the cores the thread may run on. A counter read on a core
+  // after one read on another core must not be smaller.
+  cpu_set_t allowed;
+  pthread_t self = pthread_self();
+  if (pthread_getaffinity_np(self, sizeof(allowed), &allowed)) {
+    reason = "the cores of the process are unknown";
+    return false;
+  }
+
+  bool synchronized = true;
+  uint64_t last = 0;
+  for (unsigned round = 0; round < ValidationRounds && synchronized; ++round)
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE && synchronized; ++cpu) {
+      if (!CPU_ISSET(cpu, &allowed))
+        continue;
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu, &one);
+      if (pthread_setaffinity_np(self, sizeof(one), &one))
+        continue;
+      uint64_t now = readTSC();
+      if (now < last) {
+        reason = "the time stamp counter goes backwards across cores";
+        synchronized = false;
+      }
+      last = now;
+    }
+
+  pthread_setaffinity_np(self, sizeof(allowed), &allowed);
+  return synchronized;
+#endif
+}
@@ -0,0 +1,57 @@
+//===- TraceClock.h - Clocks ordering the records of threads ----*- C++ -*-===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the clocks the per-thread buffer mode may stamp records
+// with instead of a global sequence number, so that threads don't contend for
+// a shared counter on every record.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef GIRI_RUNTIME_TRACECLOCK_H
+#define GIRI_RUNTIME_TRACECLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define GIRI_HAVE_TSC 1
+#endif
+
+namespace giri {
+
+/// Read CLOCK_MONOTONIC_RAW in nanoseconds.
+static inline uint64_t readRawClock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/// Read the time stamp counter of the processor. Without a time stamp counter
+/// this reads CLOCK_MONOTONIC_RAW instead.
+static inline uint64_t readTSC() {
+#ifdef GIRI_HAVE_TSC
+  return __rdtsc();
+#else
+  return readRawClock();
+#endif
+}
+
+/// Check that the time stamp counter can order the records of threads running
+/// on different cores. The processor must report an invariant counter, and
+/// reading it on each core the process may run on, one after the other, must
+/// never go backwards.
+///
+/// \param[out] reason - Why the counter can't be used, if it can't.
+/// \return true if the counter is synchronized across cores.
+bool tscIsSynchronized(const char *&reason);
+
+} // END namespace giri
+
+#endif
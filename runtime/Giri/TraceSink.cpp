@@ -0,0 +1,849 @@
+//===- TraceSink.cpp - Backends writing the trace to a file ---------------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the backends which write the windows of the entry
+// cache to the trace file, and the flusher thread for mapped windows.
+//
+//===----------------------------------------------------------------------===//
+
+#include "TraceSink.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define GIRI_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef DEBUG_GIRI_RUNTIME
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define DEBUG(...) do {} while (false)
+#endif
+
+#define ERROR(...) fprintf(stderr, __VA_ARGS__)
+
+using namespace giri;
+
+uint64_t giri::monotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+bool giri::writeAll(int fd, const void *buf, size_t len, off_t offset) {
+  const char *p = static_cast<const char *>(buf);
+  while (len) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+//                        Background Trace Flusher
+//===----------------------------------------------------------------------===//
+
+void TraceFlusher::start() {
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&notEmpty, NULL);
+  pthread_cond_init(&notFull, NULL);
+  if (pthread_create(&thread, NULL, run, this)) {
+    ERROR("[GIRI] Cannot start the flusher thread, flushing inline\n");
+    return;
+  }
+  running = true;
+}
+
+void TraceFlusher::flush(void *addr, size_t length, bool sync) {
+  Request R = { addr, length, sync };
+  if (!running) {
+    writeBack(R);
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
+  while (pending == QueueSize)
+    pthread_cond_wait(&notFull, &mutex);
+  queue[(head + pending++) % QueueSize] = R;
+  pthread_cond_signal(&notEmpty);
+  pthread_mutex_unlock(&mutex);
+}
+
+void TraceFlusher::stop() {
+  if (!running)
+    return;
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_signal(&notEmpty);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, NULL);
+  running = false;
+}
+
+void TraceFlusher::writeBack(const Request &R) {
+  uint64_t start = monotonicNanos();
+  if (R.sync)
+    msync(R.addr, R.length, MS_SYNC);
+  munmap(R.addr, R.length);
+  addWriteBack(monotonicNanos() - start);
+}
+
+void *TraceFlusher::run(void *arg) {
+  TraceFlusher *F = static_cast<TraceFlusher *>(arg);
+  pthread_mutex_lock(&F->mutex);
+  while (true) {
+    while (!F->pending && !F->stopping)
+      pthread_cond_wait(&F->notEmpty, &F->mutex);
+    if (!F->pending)
+      break;
+
+    // Write the window back without holding the lock, so the program can
+    // queue the next window meanwhile.
+    Request R = F->queue[F->head];
+    pthread_mutex_unlock(&F->mutex);
+    uint64_t start = monotonicNanos();
+    F->writeBack(R);
+    F->backgroundNanos += monotonicNanos() - start;
+    pthread_mutex_lock(&F->mutex);
+
+    F->head = (F->head + 1) % QueueSize;
+    --F->pending;
+    pthread_cond_signal(&F->notFull);
+  }
+  pthread_mutex_unlock(&F->mutex);
+  return NULL;
+}
+
+void TraceFlusher::report() {
+  unsigned long n = switches.load();
+  if (!n)
+    return;
+  ERROR("[GIRI] %lu trace window switches stalled the program for %.3f ms, "
+        "%.3f ms of write-back ran in the background\n",
+        n, stallNanos.load() / 1e6, backgroundNanos / 1e6);
+}
+
+bool giri::PrefaultWindows = false;
+bool giri::HugePageWindows = false;
+
+bool giri::reserveWindow(int fd, off_t offset, size_t bytes) {
+  if (fallocate(fd, 0, offset, bytes) == 0)
+    return true;
+  if (errno != EOPNOTSUPP && errno != ENOSYS)
+    return false;
+
+  // The file system can't allocate blocks ahead, so only extend the file.
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    return false;
+  return st.st_size >= static_cast<off_t>(offset + bytes) ||
+         ftruncate(fd, offset + bytes) == 0;
+}
+
+void giri::prepareWindow(void *window, size_t bytes) {
+  // Ask for huge pages before the first page is touched.
+  if (HugePageWindows && madvise(window, bytes, MADV_HUGEPAGE) == -1) {
+    ERROR("[GIRI] Cannot use huge pages for the trace: %s\n", strerror(errno));
+    HugePageWindows = false;
+  }
+  if (!PrefaultWindows)
+    return;
+
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(window, bytes, MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+  // Older kernels can't populate writable pages, so touch every page. The
+  // window holds no entries yet.
+  static const long PageSize = sysconf(_SC_PAGE_SIZE);
+  char *p = static_cast<char *>(window);
+  for (size_t i = 0; i < bytes; i += PageSize)
+    *static_cast<volatile char *>(p + i) = 0;
+}
+
+//===----------------------------------------------------------------------===//
+//                            Mapped Trace File
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// \class Maps each window of the trace file into memory and lets the kernel
+/// write it back, either on msync() or when it evicts the pages.
+class MmapSink : public TraceSink {
+public:
+  explicit MmapSink(TraceFlusher &Flusher) : Flusher(Flusher), mapped(0) {}
+
+  virtual size_t windowBytes(size_t budget) const { return budget; }
+  virtual Entry *getWindow(int fd, off_t offset, size_t bytes);
+  virtual void putWindow(int fd, Entry *window, size_t length, off_t offset,
+                         bool last);
+
+  /// The entries are in the shared mapping already.
+  virtual void writeOnSignal(int, Entry *, size_t, off_t) {}
+
+private:
+  TraceFlusher &Flusher; ///< Writes back and unmaps full windows
+  size_t mapped; ///< Size of the mapped windows
+};
+
+} // END anonymous namespace
+
+Entry *MmapSink::getWindow(int fd, off_t offset, size_t bytes) {
+#ifndef __CYGWIN__
+  if (!reserveWindow(fd, offset, bytes)) {
+    ERROR("[GIRI] Error extending trace file: %s\n", strerror(errno));
+    abort();
+  }
+#endif
+
+  // Map in the next section of the file.
+#ifdef __CYGWIN__
+  Entry *window = (Entry *)mmap(0,
+                                bytes,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_AUTOGROW,
+                                fd,
+                                offset);
+#else
+  Entry *window = (Entry *)mmap(0,
+                                bytes,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED,
+                                fd,
+                                offset);
+#endif
+  if (window == MAP_FAILED) {
+    ERROR("[GIRI] Error mapping entry cache: %s\n", strerror(errno));
+    abort();
+  }
+  prepareWindow(window, bytes);
+  mapped = bytes;
+  return window;
+}
+
+void MmapSink::putWindow(int, Entry *window, size_t length, off_t,
+                         bool last) {
+  // Unmap the data. This should force it to be written to disk. Full windows
+  // may be written back by the flusher thread meanwhile.
+  if (last) {
+    uint64_t start = monotonicNanos();
+    msync(window, length, MS_SYNC);
+    munmap(window, mapped);
+    Flusher.addWriteBack(monotonicNanos() - start);
+  } else {
+    Flusher.flush(window, mapped, true);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+//                            Written Trace File
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// \class Common parts of the sinks which fill anonymous windows in memory and
+/// write them to the trace file.
+class WriteSink : public TraceSink {
+public:
+  /// Alignment of the length of writes with O_DIRECT
+  static const size_t DirectAlignment = 4096;
+
+  /// \param windows - The number of windows of the sink, which share the
+  /// memory budget of the entry cache.
+  WriteSink(bool direct, bool preallocate, unsigned windows) :
+    direct(direct), preallocate(preallocate), preparedFD(-1),
+    windows(windows) {}
+
+  /// The windows are copied rather than mapped, so they take up the budget
+  /// in anonymous memory.
+  virtual size_t windowBytes(size_t budget) const { return budget / windows; }
+
+  virtual void writeOnSignal(int fd, Entry *window, size_t length,
+                             off_t offset) {
+    writeAll(fd, window, padded(window, length), offset);
+  }
+
+protected:
+  /// Map an anonymous window, which is suitably aligned for O_DIRECT.
+  static Entry *allocateWindow(size_t bytes);
+
+  /// Get the trace file ready for writing a window at offset: switch it to
+  /// O_DIRECT and reserve the disk space of the window if requested.
+  void prepare(int fd, off_t offset, size_t bytes);
+
+  /// Get the number of bytes to write for length bytes of entries. O_DIRECT
+  /// needs whole blocks, so the last window is padded with empty slots which
+  /// the entry cache cuts off again when it truncates the file.
+  size_t padded(Entry *window, size_t length) const;
+
+  bool direct; ///< Whether the trace file is written with O_DIRECT
+  bool preallocate; ///< Whether the space of each window is fallocate()d
+  int preparedFD; ///< The trace file which was switched to O_DIRECT
+  unsigned windows; ///< Number of windows allocated
+};
+
+} // END anonymous namespace
+
+Entry *WriteSink::allocateWindow(size_t bytes) {
+  Entry *window = (Entry *)mmap(0,
+                                bytes,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS,
+                                -1,
+                                0);
+  if (window == MAP_FAILED) {
+    ERROR("[GIRI] Error allocating trace window: %s\n", strerror(errno));
+    abort();
+  }
+  prepareWindow(window, bytes);
+  return window;
+}
+
+void WriteSink::prepare(int fd, off_t offset, size_t bytes) {
+  if (direct && fd != preparedFD) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1) {
+      ERROR("[GIRI] Cannot use O_DIRECT for the trace: %s\n", strerror(errno));
+      direct = false;
+    }
+    preparedFD = fd;
+  }
+
+  // Keep the file size, so that readers still see where the trace ends.
+  if (preallocate &&
+      fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, bytes) == -1) {
+    ERROR("[GIRI] Cannot fallocate() the trace: %s\n", strerror(errno));
+    preallocate = false;
+  }
+}
+
+size_t WriteSink::padded(Entry *window, size_t length) const {
+  if (!direct || length % DirectAlignment == 0)
+    return length;
+  size_t full = (length / DirectAlignment + 1) * DirectAlignment;
+  memset(reinterpret_cast<char *>(window) + length, 0, full - length);
+  return full;
+}
+
+namespace {
+
+/// \class Writes each window synchronously with pwrite().
+class PwriteSink : public WriteSink {
+public:
+  PwriteSink(bool direct, bool preallocate) :
+    WriteSink(direct, preallocate, 1), window(nullptr) {}
+
+  virtual Entry *getWindow(int fd, off_t offset, size_t bytes);
+  virtual void putWindow(int fd, Entry *window, size_t length, off_t offset,
+                         bool last);
+
+private:
+  Entry *window; ///< The only window, reused after each write
+};
+
+} // END anonymous namespace
+
+Entry *PwriteSink::getWindow(int fd, off_t offset, size_t bytes) {
+  if (!window)
+    window = allocateWindow(bytes);
+  prepare(fd, offset, bytes);
+  return window;
+}
+
+void PwriteSink::putWindow(int fd, Entry *window, size_t length, off_t offset,
+                           bool) {
+  if (!writeAll(fd, window, padded(window, length), offset))
+    ERROR("[GIRI] Error writing the trace: %s\n", strerror(errno));
+}
+
+#ifdef GIRI_HAVE_IO_URING
+namespace {
+
+/// \class Writes the windows with io_uring, so that up to Depth windows are
+/// written while the program fills the next one.
+///
+/// The ring is driven with the raw system calls rather than liburing, so the
+/// run-time has no further dependencies.
+class UringSink : public WriteSink {
+public:
+  /// Number of windows, i.e. the maximum number of writes in flight plus one
+  static const unsigned Depth = 4;
+
+  UringSink(bool direct, bool preallocate) :
+    WriteSink(direct, preallocate, Depth), ring(-1), inflight(0) {}
+
+  /// Set up the ring. This fails if the kernel doesn't support io_uring.
+  bool init();
+
+  virtual Entry *getWindow(int fd, off_t offset, size_t bytes);
+  virtual void putWindow(int fd, Entry *window, size_t length, off_t offset,
+                         bool last);
+  virtual void drain();
+
+private:
+  /// Wait for at least min writes to complete and release their windows.
+  void reap(unsigned min);
+
+  /// A window and the write it is part of
+  struct Slot {
+    Entry *window;
+    bool busy; ///< Whether the window is being filled or written
+    int fd;
+    off_t offset;
+    struct iovec iov; ///< The bytes to write
+  };
+
+  int ring; ///< The file descriptor of the ring
+  unsigned inflight; ///< Number of writes which haven't completed yet
+  Slot slots[Depth];
+
+  // The submission queue
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  struct io_uring_sqe *sqes;
+
+  // The completion queue
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  struct io_uring_cqe *cqes;
+};
+
+} // END anonymous namespace
+
+bool UringSink::init() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring = syscall(__NR_io_uring_setup, Depth, &params);
+  if (ring == -1)
+    return false;
+
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize = params.cq_off.cqes +
+                  params.cq_entries * sizeof(struct io_uring_cqe);
+  char *sq = (char *)mmap(0, sqSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+  char *cq = (char *)mmap(0, cqSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+  sqes = (struct io_uring_sqe *)mmap(0,
+                                     params.sq_entries * sizeof(*sqes),
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE,
+                                     ring,
+                                     IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(ring);
+    return false;
+  }
+
+  sqTail = (unsigned *)(sq + params.sq_off.tail);
+  sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+  sqArray = (unsigned *)(sq + params.sq_off.array);
+  cqHead = (unsigned *)(cq + params.cq_off.head);
+  cqTail = (unsigned *)(cq + params.cq_off.tail);
+  cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  for (unsigned i = 0; i < Depth; ++i) {
+    slots[i].window = nullptr;
+    slots[i].busy = false;
+  }
+  return true;
+}
+
+Entry *UringSink::getWindow(int fd, off_t offset, size_t bytes) {
+  while (true) {
+    for (unsigned i = 0; i < Depth; ++i) {
+      Slot &S = slots[i];
+      if (S.busy)
+        continue;
+      if (!S.window)
+        S.window = allocateWindow(bytes);
+      S.busy = true;
+      prepare(fd, offset, bytes);
+      return S.window;
+    }
+    reap(1);
+  }
+}
+
+void UringSink::putWindow(int fd, Entry *window, size_t length, off_t offset,
+                          bool last) {
+  unsigned i = 0;
+  while (slots[i].window != window)
+    ++i;
+  Slot &S = slots[i];
+  S.fd = fd;
+  S.offset = offset;
+  S.iov.iov_base = window;
+  S.iov.iov_len = padded(window, length);
+
+  unsigned tail = *sqTail;
+  unsigned index = tail & *sqMask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uintptr_t>(&S.iov);
+  sqe->len = 1;
+  sqe->off = offset;
+  sqe->user_data = i;
+  sqArray[index] = index;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  if (syscall(__NR_io_uring_enter, ring, 1, 0, 0, NULL, 0) != 1) {
+    // Write it ourselves if the kernel didn't take it.
+    ERROR("[GIRI] io_uring submission failed: %s\n", strerror(errno));
+    __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+    if (!writeAll(fd, window, S.iov.iov_len, offset))
+      ERROR("[GIRI] Error writing the trace: %s\n", strerror(errno));
+    S.busy = false;
+  } else {
+    ++inflight;
+  }
+
+  if (last)
+    drain();
+}
+
+void UringSink::reap(unsigned min) {
+  if (min > inflight)
+    min = inflight;
+  if (min)
+    syscall(__NR_io_uring_enter, ring, 0, min, IORING_ENTER_GETEVENTS, NULL, 0);
+
+  unsigned head = *cqHead;
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const struct io_uring_cqe &cqe = cqes[head & *cqMask];
+    Slot &S = slots[cqe.user_data];
+    // Finish short or failed writes synchronously.
+    size_t done = cqe.res > 0 ? cqe.res : 0;
+    if (done < S.iov.iov_len &&
+        !writeAll(S.fd, (char *)S.iov.iov_base + done, S.iov.iov_len - done,
+                  S.offset + done))
+      ERROR("[GIRI] Error writing the trace: %s\n", strerror(errno));
+    S.busy = false;
+    --inflight;
+  }
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+void UringSink::drain() {
+  while (inflight)
+    reap(inflight);
+}
+#endif
+
+//===----------------------------------------------------------------------===//
+//                           Pipe or FIFO Stream
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// \class Writes the windows in order to a pipe or FIFO, e.g. one read by an
+/// analysis running concurrently. The stream has the same layout as a trace
+/// file whose last window is cut after its entries.
+class PipeSink : public TraceSink {
+public:
+  PipeSink() : window(nullptr) {}
+
+  /// Windows are kept small, so that the reader gets the trace soon.
+  virtual size_t windowBytes(size_t) const { return 16UL << 20; }
+
+  virtual Entry *getWindow(int fd, off_t offset, size_t bytes);
+  virtual void putWindow(int fd, Entry *window, size_t length, off_t offset,
+                         bool last);
+
+  virtual void writeOnSignal(int fd, Entry *window, size_t length, off_t) {
+    writeStream(fd, window, length);
+  }
+
+  virtual bool seekable() const { return false; }
+
+private:
+  /// Write the buffer to the stream. This is async-signal-safe.
+  static bool writeStream(int fd, const void *buf, size_t len);
+
+  Entry *window; ///< The only window, reused after each write
+};
+
+} // END anonymous namespace
+
+Entry *PipeSink::getWindow(int, off_t, size_t bytes) {
+  if (!window) {
+    window = (Entry *)mmap(0,
+                           bytes,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1,
+                           0);
+    if (window == MAP_FAILED) {
+      ERROR("[GIRI] Error allocating trace window: %s\n", strerror(errno));
+      abort();
+    }
+    prepareWindow(window, bytes);
+  }
+  return window;
+}
+
+void PipeSink::putWindow(int fd, Entry *window, size_t length, off_t, bool) {
+  if (!writeStream(fd, window, length))
+    ERROR("[GIRI] Error writing the trace stream: %s\n", strerror(errno));
+}
+
+bool PipeSink::writeStream(int fd, const void *buf, size_t len) {
+  const char *p = static_cast<const char *>(buf);
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+//                         Shared Memory Stream
+//===----------------------------------------------------------------------===//
+
+namespace {
+
+/// \class Publishes the windows into a ring in shared memory, which a
+/// consumer reads while the program runs. See StreamHeader for the protocol.
+///
+/// The entry cache fills the slots of the ring in place, so records are never
+/// copied. If the ring is full, the run-time waits for the consumer. With the
+/// "drop" option, or while no consumer has attached yet, it fills a scratch
+/// window instead, which is then dropped and counted.
+///
+/// The stream is named by GIRI_SHM_NAME, or "/giri." followed by the base name
+/// of the trace file.
+class ShmSink : public TraceSink {
+public:
+  /// Number of slots of the ring, unless given by GIRI_SHM_SLOTS
+  static const unsigned DefaultSlots = 8;
+
+  explicit ShmSink(bool drop) :
+    stream(nullptr), scratch(nullptr), drop(drop), dropping(false) {}
+
+  /// Create the shared memory object of the stream.
+  bool init(const char *traceName);
+
+  /// Windows are as small as a segment to keep the latency low.
+  virtual size_t windowBytes(size_t) const { return 4UL << 20; }
+
+  virtual Entry *getWindow(int fd, off_t offset, size_t bytes);
+  virtual void putWindow(int fd, Entry *window, size_t length, off_t offset,
+                         bool last);
+  virtual void writeOnSignal(int fd, Entry *window, size_t length,
+                             off_t offset);
+  virtual bool seekable() const { return false; }
+
+private:
+  /// Publish the slot at head, which holds length bytes of entries.
+  void publish(size_t length);
+
+  StreamHeader *stream; ///< The mapped stream
+  Entry *scratch; ///< The window filled while dropping
+  char name[256]; ///< Name of the shared memory object
+  bool drop; ///< Whether to drop windows rather than wait for the consumer
+  bool dropping; ///< Whether the current window is being dropped
+};
+
+} // END anonymous namespace
+
+bool ShmSink::init(const char *traceName) {
+  const char *env = getenv("GIRI_SHM_NAME");
+  if (env) {
+    snprintf(name, sizeof(name), "%s", env);
+  } else {
+    const char *base = strrchr(traceName, '/');
+    snprintf(name, sizeof(name), "/giri.%s", base ? base + 1 : traceName);
+  }
+
+  unsigned long slots = DefaultSlots;
+  if ((env = getenv("GIRI_SHM_SLOTS")))
+    slots = strtoul(env, NULL, 10);
+  if (slots < 2 || slots > MaxStreamSlots) {
+    ERROR("[GIRI] GIRI_SHM_SLOTS must be between 2 and %u\n", MaxStreamSlots);
+    slots = DefaultSlots;
+  }
+
+  size_t slotBytes = windowBytes(0);
+  size_t bytes = StreamDataOffset + slots * slotBytes;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1)
+    return false;
+  if (ftruncate(fd, bytes) == -1) {
+    close(fd);
+    shm_unlink(name);
+    return false;
+  }
+  stream = (StreamHeader *)mmap(0,
+                                bytes,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED,
+                                fd,
+                                0);
+  close(fd);
+  if (stream == MAP_FAILED) {
+    shm_unlink(name);
+    return false;
+  }
+
+  stream->slots = slots;
+  stream->slotBytes = slotBytes;
+  memcpy(stream->magic, "GIRISTR", 7);
+  __atomic_store_n(&stream->magic[7], 'M', __ATOMIC_RELEASE);
+  DEBUG("[GIRI] Publishing the trace in shared memory %s\n", name);
+  return true;
+}
+
+Entry *ShmSink::getWindow(int, off_t, size_t bytes) {
+  uint64_t head = stream->head;
+  dropping = false;
+  while (head - __atomic_load_n(&stream->tail, __ATOMIC_ACQUIRE) ==
+         stream->slots) {
+    if (drop || !__atomic_load_n(&stream->attached, __ATOMIC_ACQUIRE)) {
+      if (!scratch)
+        scratch = (Entry *)mmap(0,
+                                bytes,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS,
+                                -1,
+                                0);
+      if (scratch != MAP_FAILED) {
+        dropping = true;
+        return scratch;
+      }
+    }
+    // Wait for the consumer to release a slot.
+    struct timespec delay = { 0, 50000 };
+    nanosleep(&delay, NULL);
+  }
+
+  char *data = reinterpret_cast<char *>(stream) + StreamDataOffset;
+  return reinterpret_cast<Entry *>(data + (head % stream->slots) * bytes);
+}
+
+void ShmSink::publish(size_t length) {
+  uint64_t head = stream->head;
+  stream->lengths[head % stream->slots] = length;
+  __atomic_store_n(&stream->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void ShmSink::putWindow(int, Entry *, size_t length, off_t, bool last) {
+  if (dropping)
+    __atomic_fetch_add(&stream->dropped, 1, __ATOMIC_RELAXED);
+  else
+    publish(length);
+
+  if (last) {
+    __atomic_store_n(&stream->done, 1, __ATOMIC_RELEASE);
+    // Nobody will read a stream which hasn't been attached to by now.
+    if (!__atomic_load_n(&stream->attached, __ATOMIC_ACQUIRE))
+      shm_unlink(name);
+    if (uint64_t dropped = stream->dropped)
+      ERROR("[GIRI] Dropped %lu trace windows the consumer couldn't take\n",
+            (unsigned long)dropped);
+  }
+}
+
+void ShmSink::writeOnSignal(int, Entry *, size_t length, off_t) {
+  if (!dropping)
+    publish(length);
+  __atomic_store_n(&stream->done, 1, __ATOMIC_RELEASE);
+}
+
+//===----------------------------------------------------------------------===//
+//                             Sink Selection
+//===----------------------------------------------------------------------===//
+
+TraceSink *TraceSink::create(const char *spec, const char *traceName,
+                             TraceFlusher &Flusher) {
+  if (!spec || !*spec)
+    return new MmapSink(Flusher);
+
+  // Split the backend name from its options.
+  char buf[64];
+  strncpy(buf, spec, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  char *save;
+  const char *name = strtok_r(buf, ",", &save);
+  bool direct = false, preallocate = false, drop = false;
+  for (char *opt = strtok_r(NULL, ",", &save); opt;
+       opt = strtok_r(NULL, ",", &save)) {
+    if (!strcmp(opt, "direct"))
+      direct = true;
+    else if (!strcmp(opt, "fallocate"))
+      preallocate = true;
+    else if (!strcmp(opt, "drop"))
+      drop = true;
+    else
+      ERROR("[GIRI] Ignoring unknown GIRI_SINK option %s\n", opt);
+  }
+
+  if (name && !strcmp(name, "mmap"))
+    return new MmapSink(Flusher);
+  if (name && !strcmp(name, "pwrite"))
+    return new PwriteSink(direct, preallocate);
+  if (name && !strcmp(name, "pipe"))
+    return new PipeSink();
+  if (name && !strcmp(name, "shm")) {
+    ShmSink *sink = new ShmSink(drop);
+    if (sink->init(traceName))
+      return sink;
+    delete sink;
+    ERROR("[GIRI] Cannot create the trace stream (%s), using mmap\n",
+          strerror(errno));
+    return new MmapSink(Flusher);
+  }
+  if (name && !strcmp(name, "uring")) {
+#ifdef GIRI_HAVE_IO_URING
+    UringSink *sink = new UringSink(direct, preallocate);
+    if (sink->init())
+      return sink;
+    delete sink;
+    ERROR("[GIRI] Cannot set up io_uring (%s), using pwrite\n",
+          strerror(errno));
+#else
+    ERROR("[GIRI] Built without io_uring, using pwrite\n");
+#endif
+    return new PwriteSink(direct, preallocate);
+  }
+
+  ERROR("[GIRI] Unknown GIRI_SINK %s, using mmap\n", spec);
+  return new MmapSink(Flusher);
+}
@@ -0,0 +1,188 @@
+//===- TraceSink.h - Backends writing the trace to a file -------*- C++ -*-===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares the interface between the tracing run-time and the
+// backends which write the windows of the entry cache to the trace file, as
+// well as the flusher thread which writes back mapped windows.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef GIRI_RUNTIME_TRACESINK_H
+#define GIRI_RUNTIME_TRACESINK_H
+
+#include "Giri/Runtime.h"
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace giri {
+
+/// Get the current time of the monotonic clock in nanoseconds.
+uint64_t monotonicNanos();
+
+/// Write the whole buffer to the file at the given offset. This only uses
+/// async-signal-safe functions.
+bool writeAll(int fd, const void *buf, size_t len, off_t offset);
+
+/// Whether every page of a new trace window is faulted in when it is mapped
+/// (GIRI_PREFAULT), so that appending records doesn't take page faults.
+extern bool PrefaultWindows;
+
+/// Whether new trace windows are backed with transparent huge pages
+/// (GIRI_HUGE_PAGES). Only anonymous windows and traces on a tmpfs get them.
+extern bool HugePageWindows;
+
+/// Extend the trace file over the bytes of a window at offset. The disk
+/// blocks are allocated up front where the file system supports it, so that
+/// the page faults of a mapped window don't have to.
+bool reserveWindow(int fd, off_t offset, size_t bytes);
+
+/// Apply GIRI_HUGE_PAGES and GIRI_PREFAULT to a window which was just mapped.
+void prepareWindow(void *window, size_t bytes);
+
+/// \class Writes back and unmaps full trace windows.
+///
+/// Without a background thread (the default) every window is synced and
+/// unmapped by the thread which filled it. With GIRI_ASYNC_FLUSH=1 the window
+/// is queued for a flusher thread instead, so that the program can go on
+/// appending to the next window while the previous one is written to disk.
+/// The program only waits when QueueSize windows are already pending.
+///
+/// The time the program spends switching windows (the stall time) and the
+/// time the flusher thread spends writing back are accumulated, so that
+/// finish() can report how much of the I/O was hidden from the program. The
+/// time spent in msync() and munmap() is accumulated wherever it is spent.
+class TraceFlusher {
+public:
+  /// Number of windows which may be waiting for the flusher. Together with the
+  /// window being filled, at least this many plus one windows are mapped.
+  static const unsigned QueueSize = 2;
+
+  TraceFlusher() : head(0), pending(0), running(false), stopping(false),
+                   switches(0), stallNanos(0), writeBackNanos(0),
+                   backgroundNanos(0) {}
+
+  /// Start the flusher thread.
+  void start();
+
+  /// Sync (if requested) and unmap one window, either right away or on the
+  /// flusher thread.
+  void flush(void *addr, size_t length, bool sync);
+
+  /// Account for one switch to a new window which stalled a thread for the
+  /// given time.
+  void addStall(uint64_t nanos) {
+    switches.fetch_add(1, std::memory_order_relaxed);
+    stallNanos.fetch_add(nanos, std::memory_order_relaxed);
+  }
+
+  /// Account for writing back a window outside of the flusher.
+  void addWriteBack(uint64_t nanos) {
+    writeBackNanos.fetch_add(nanos, std::memory_order_relaxed);
+  }
+
+  unsigned long getSwitches() const { return switches.load(); }
+  uint64_t getStallNanos() const { return stallNanos.load(); }
+  uint64_t getWriteBackNanos() const { return writeBackNanos.load(); }
+  uint64_t getBackgroundNanos() const { return backgroundNanos; }
+
+  /// Write back all pending windows and stop the flusher thread.
+  void stop();
+
+  /// Print the flushing statistics if the program has switched windows.
+  void report();
+
+private:
+  struct Request {
+    void *addr;
+    size_t length;
+    bool sync;
+  };
+
+  /// Sync and unmap one window.
+  void writeBack(const Request &R);
+
+  /// The main loop of the flusher thread.
+  static void *run(void *arg);
+
+private:
+  Request queue[QueueSize]; ///< Circular queue of pending windows
+  unsigned head; ///< Index of the oldest pending window
+  unsigned pending; ///< Number of pending windows
+  bool running; ///< Whether the flusher thread has been started
+  bool stopping; ///< Whether the flusher thread should exit when idle
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t notEmpty; ///< Signalled when a window is queued
+  pthread_cond_t notFull; ///< Signalled when a window has been written back
+
+  std::atomic<unsigned long> switches; ///< Number of window switches
+  std::atomic<uint64_t> stallNanos; ///< Time the program spent on switches
+  std::atomic<uint64_t> writeBackNanos; ///< Time spent in msync and munmap
+  uint64_t backgroundNanos; ///< Time the flusher thread spent writing back
+};
+
+/// \class The backend the entry cache writes the trace file with.
+///
+/// The entry cache fills one window of entries at a time. The sink hands out
+/// the window for a part of the trace file and writes it once it is full. A
+/// window is used by the entry cache only between getWindow() and the next
+/// putWindow().
+///
+/// The sink is selected with GIRI_SINK, a backend name optionally followed by
+/// comma separated options:
+///   mmap                      - map the trace file itself (the default)
+///   pwrite[,direct][,fallocate] - write anonymous windows with pwrite()
+///   uring[,direct][,fallocate]  - queue several windows with io_uring
+///   pipe                      - write windows in order to a pipe or FIFO
+///   shm[,drop]                - publish windows in a shared memory ring
+/// "direct" opens the trace file for O_DIRECT, and "fallocate" reserves the
+/// disk space of a window before it is filled. The shm sink waits for the
+/// consumer when the ring is full, unless "drop" is given.
+class TraceSink {
+public:
+  virtual ~TraceSink() {}
+
+  /// Get the size of the windows in bytes, given the memory budget of the
+  /// entry cache (GIRI_WINDOW_MB).
+  virtual size_t windowBytes(size_t budget) const = 0;
+
+  /// Get a window for the bytes of the trace file fd at offset.
+  virtual Entry *getWindow(int fd, off_t offset, size_t bytes) = 0;
+
+  /// Write a window obtained from getWindow(). Only the first length bytes
+  /// hold entries, which is less than the window for the last one.
+  virtual void putWindow(int fd, Entry *window, size_t length, off_t offset,
+                         bool last) = 0;
+
+  /// Wait until every window put so far has been written. This is called
+  /// before the trace file is closed.
+  virtual void drain() {}
+
+  /// Write the first length bytes of the window being filled from a signal
+  /// handler. Only async-signal-safe functions may be used.
+  virtual void writeOnSignal(int fd, Entry *window, size_t length,
+                             off_t offset) = 0;
+
+  /// Whether the trace file is seekable, i.e. it can be truncated and split
+  /// into chunks.
+  virtual bool seekable() const { return true; }
+
+  /// Create the sink described by spec, the value of GIRI_SINK, for the trace
+  /// file traceName. Mapped windows are written back by the given flusher.
+  /// This falls back to the mmap sink if spec is null or invalid.
+  static TraceSink *create(const char *spec, const char *traceName,
+                           TraceFlusher &Flusher);
+};
+
+} // END namespace giri
+
+#endif
@@ -14,6 +14,11 @@
 //===----------------------------------------------------------------------===//
 
 #include "Giri/Runtime.h"
+#include "Giri/TracingControl.h"
+#include "FastPath.h"
+#include "ShadowMemory.h"
+#include "TraceClock.h"
+#include "TraceSink.h"
 
 #include <cassert>
 #include <cstdio>
@@ -21,16 +26,18 @@
 #include <cstring>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <stack>
-#include <unordered_map>
+#include <atomic>
+#include <new>
 
 #ifdef DEBUG_GIRI_RUNTIME
 #define DEBUG(...) fprintf(stderr, __VA_ARGS__)
@@ -40,6 +47,8 @@
 
 #define ERROR(...) fprintf(stderr, __VA_ARGS__)
 
+using namespace giri;
+
 //===----------------------------------------------------------------------===//
 //                           Forward declearation
 //===----------------------------------------------------------------------===//
@@ -48,9 +57,20 @@ extern "C" void recordLock(const char *inst_name);
 extern "C" void recordUnlock(const char *inst_name);
 extern "C" void recordStartBB(unsigned id, unsigned char *fp);
 extern "C" void recordBB(unsigned id, unsigned char *fp, unsigned lastBB);
+extern "C" void recordBlock(unsigned id, unsigned char *fp, unsigned lastBB,
+                            unsigned count, const BlockOp *ops,
+                            const uintptr_t *values);
 extern "C" void recordLoad(unsigned id, unsigned char *p, uintptr_t);
 extern "C" void recordStrLoad(unsigned id, char *p);
 extern "C" void recordStore(unsigned id, unsigned char *p, uintptr_t);
+#define GIRI_DECLARE_SIZED_RECORDS(N)                                          \
+  extern "C" void recordLoad##N(unsigned id, unsigned char *p);                \
+  extern "C" void recordStore##N(unsigned id, unsigned char *p);
+GIRI_DECLARE_SIZED_RECORDS(1)
+GIRI_DECLARE_SIZED_RECORDS(2)
+GIRI_DECLARE_SIZED_RECORDS(4)
+GIRI_DECLARE_SIZED_RECORDS(8)
+GIRI_DECLARE_SIZED_RECORDS(16)
 extern "C" void recordStrStore(unsigned id, char *p);
 extern "C" void recordStrcatStore(unsigned id, char *p, char *s);
 extern "C" void recordCall(unsigned id, unsigned char *p);
@@ -58,6 +78,20 @@ extern "C" void recordExtCall(unsigned id, unsigned char *p);
 extern "C" void recordReturn(unsigned id, unsigned char *p);
 extern "C" void recordExtCallRet(unsigned callID, unsigned char *fp);
 extern "C" void recordSelect(unsigned id, unsigned char flag);
+extern "C" void recordBranch(unsigned char taken);
+extern "C" void recordSwitch(uint64_t value);
+extern "C" void recordEnter(unsigned id, unsigned char *fp);
+extern "C" void recordClonedCall(unsigned id, unsigned char *fp);
+extern "C" void recordTracedEntry(unsigned char *fp);
+extern "C" void recordSync(unsigned id, unsigned kind, uintptr_t object,
+                           int result);
+extern "C" void recordAlloc(unsigned id, unsigned char *p, uintptr_t length);
+extern "C" void recordFunctions(unsigned count, const unsigned *ids,
+                                unsigned char *const *addresses);
+extern "C" void recordFree(unsigned id, unsigned char *p);
+extern "C" void recordRealloc(unsigned id, unsigned char *old, unsigned char *p,
+                              uintptr_t length);
+extern "C" volatile int giriTracingEnabled;
 
 //===----------------------------------------------------------------------===//
 //                       Basic Block and Function Stack
@@ -66,25 +100,642 @@ extern "C" void recordSelect(unsigned id, unsigned char flag);
 // File for recording tracing information
 static int record = 0;
 
-// A stack containing basic blocks currently being executed
+std::atomic<unsigned> giri::TracingEpoch(0);
+
+/// Cleared while tracing is paused. Functions instrumented with
+/// -giri-dual-clone check it on entry and run their uninstrumented clone
+/// while it is clear.
+volatile int giriTracingEnabled = 1;
+
+/// Whether tracing is paused. This is the only check made by the record
+/// functions while paused.
+static inline bool tracingPaused() {
+  return TracingEpoch.load(std::memory_order_relaxed) & 1;
+}
+
+// A basic block currently being executed
 struct BBRecord {
   unsigned id;
+  unsigned epoch; ///< The tracing epoch the basic block started in
   unsigned char *address;
 
   BBRecord(unsigned id, unsigned char *address) :
-    id(id), address(address) {}
+    id(id), epoch(TracingEpoch.load(std::memory_order_relaxed)),
+    address(address) {}
+
+  /// Whether the execution of this basic block is being traced
+  bool traced() const {
+    return epoch == TracingEpoch.load(std::memory_order_relaxed) &&
+           !(epoch & 1);
+  }
 };
-static std::unordered_map<pthread_t, std::stack<BBRecord>> BBStack;
 
-// A stack containing basic blocks currently being executed
+// A function call currently being executed
 struct FunRecord {
   unsigned id;
+  bool traced; ///< Whether the call record has been traced
   unsigned char *fnAddress;
 
-  FunRecord(unsigned id, unsigned char *fnAddress) :
-    id(id), fnAddress(fnAddress) {}
+  FunRecord(unsigned id, bool traced, unsigned char *fnAddress) :
+    id(id), traced(traced), fnAddress(fnAddress) {}
 };
-static std::unordered_map<pthread_t, std::stack<FunRecord>> FNStack;
+
+/// \class A shadow stack of one thread backed by a plain array.
+///
+/// Pushing and popping is an index update on the hottest path of the run-time.
+/// The array starts with a fixed capacity and is only reallocated when a deep
+/// recursion overflows it. T must be trivially copyable.
+template <typename T>
+class ShadowStack {
+public:
+  static const unsigned InitialCapacity = 256;
+
+  ShadowStack() : depth(0), peak(0), capacity(InitialCapacity) {
+    data = static_cast<T *>(malloc(capacity * sizeof(T)));
+    if (!data) {
+      ERROR("[GIRI] Cannot allocate the shadow stack!\n");
+      abort();
+    }
+  }
+
+  bool empty() const { return depth == 0; }
+  unsigned size() const { return depth; }
+  unsigned maxSize() const { return peak; }
+  T &top() { return data[depth - 1]; }
+  const T &top() const { return data[depth - 1]; }
+  const T &operator[](unsigned i) const { return data[i]; }
+
+  void push(const T &value) {
+    if (depth == capacity)
+      grow();
+    new (&data[depth++]) T(value);
+    if (depth > peak)
+      peak = depth;
+  }
+
+  void pop() {
+    assert(depth && "Popping an empty shadow stack!\n");
+    --depth;
+  }
+
+private:
+  /// Double the capacity of the stack on overflow.
+  void grow() {
+    T *bigger = static_cast<T *>(realloc(data, 2 * capacity * sizeof(T)));
+    if (!bigger) {
+      ERROR("[GIRI] Cannot grow the shadow stack beyond %u!\n", capacity);
+      abort();
+    }
+    data = bigger;
+    capacity *= 2;
+  }
+
+  T *data; ///< The elements of the stack, the top one at depth - 1
+  unsigned depth; ///< Number of elements on the stack
+  unsigned peak; ///< Largest depth the stack has reached
+  unsigned capacity; ///< Number of elements the array can hold
+};
+
+/// The flusher of all trace windows
+static TraceFlusher Flusher;
+
+//===----------------------------------------------------------------------===//
+//                               Telemetry
+//===----------------------------------------------------------------------===//
+
+/// Number of per-thread record counters, one for each letter a record type
+/// may be identified by
+static const unsigned RecordTypeCounters = 26;
+
+/// Get the index of the counter of a record type.
+static inline unsigned counterIndex(RecordType type) {
+  return (static_cast<unsigned>(type) - 'A') % RecordTypeCounters;
+}
+
+/// Number of bytes handed to the trace file, the stream or a dump
+static std::atomic<uint64_t> BytesWritten(0);
+
+//===----------------------------------------------------------------------===//
+//                             Trace Chunks
+//===----------------------------------------------------------------------===//
+
+/// \class Formats text into a fixed buffer which is written to a file when
+/// full. It doesn't call the C library, so that the manifest of a chunked
+/// trace can be written from a signal handler.
+class TextWriter {
+public:
+  explicit TextWriter(int fd) : fd(fd), len(0), offset(0) {}
+
+  TextWriter &operator<<(const char *s) {
+    while (*s)
+      put(*s++);
+    return *this;
+  }
+
+  TextWriter &operator<<(unsigned long n) {
+    char digits[20];
+    unsigned i = 0;
+    do {
+      digits[i++] = '0' + n % 10;
+      n /= 10;
+    } while (n);
+    while (i)
+      put(digits[--i]);
+    return *this;
+  }
+
+  /// Write out the rest of the text and cut the file after it.
+  void close() {
+    flush();
+    ftruncate(fd, offset);
+  }
+
+private:
+  void put(char c) {
+    if (len == sizeof(buf))
+      flush();
+    buf[len++] = c;
+  }
+
+  void flush() {
+    writeAll(fd, buf, len, offset);
+    offset += len;
+    len = 0;
+  }
+
+  int fd; ///< The file being written
+  size_t len; ///< Number of characters in the buffer
+  off_t offset; ///< Offset of the buffer in the file
+  char buf[1024];
+};
+
+/// Size of one trace chunk in bytes (GIRI_CHUNK_MB). If it is not zero, the
+/// trace is written to the chunk files NAME.000, NAME.001, ... and the trace
+/// file NAME becomes a manifest listing the chunks.
+static unsigned long ChunkBytes = 0;
+
+/// Maximum number of chunks. The last chunk grows without bound once it has
+/// been reached.
+static const unsigned MaxChunks = 1000;
+
+/// The name of the trace, i.e. the manifest in the chunked mode
+static char TraceName[PATH_MAX];
+
+/// The ID of this run of the program, which tells the function table written
+/// next to the trace by this run from the one of an earlier run
+static uintptr_t RunID = 0;
+
+/// Get the end record of the trace, which holds the ID of the run as its
+/// address.
+static inline Entry endEntry() {
+  return Entry(RecordType::ENType, 0, 0,
+               reinterpret_cast<unsigned char *>(RunID));
+}
+
+/// The manifest of a chunked trace, or -1
+static int ManifestFD = -1;
+
+/// The chunk the trace is currently written to. Always 0 without chunks.
+static unsigned CurrentChunk = 0;
+
+/// Size in bytes of each finished chunk
+static off_t ChunkSizes[MaxChunks];
+
+/// Number of committed records in each chunk
+static std::atomic<uintptr_t> ChunkRecords[MaxChunks];
+
+static void writeManifest(bool final);
+
+/// Get the name of a chunk of the trace, which is the trace name followed by
+/// the chunk number with at least three digits. This is async-signal-safe.
+static void chunkName(char *buf, const char *trace, unsigned chunk) {
+  size_t len = strlen(trace);
+  memcpy(buf, trace, len);
+  buf[len++] = '.';
+  char digits[12];
+  unsigned n = 0;
+  do {
+    digits[n++] = '0' + chunk % 10;
+    chunk /= 10;
+  } while (chunk || n < 3);
+  while (n)
+    buf[len++] = digits[--n];
+  buf[len] = '\0';
+}
+
+/// Create the file of a chunk of the trace.
+static int openChunk(unsigned chunk) {
+  char name[PATH_MAX + 16];
+  chunkName(name, TraceName, chunk);
+  int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0640u);
+  if (fd == -1) {
+    ERROR("[GIRI] Cannot open trace chunk %s: %s\n", name, strerror(errno));
+    abort();
+  }
+  DEBUG("[GIRI] Opened trace chunk: %s\n", name);
+  return fd;
+}
+
+/// Cut the current chunk at the given size and continue writing the trace to
+/// the next chunk. Mappings of the current chunk stay valid.
+/// \return false if the maximum number of chunks has been reached.
+static bool nextChunk(off_t size) {
+  if (CurrentChunk + 1 == MaxChunks) {
+    static bool warned = false;
+    if (!warned)
+      ERROR("[GIRI] Reached %u trace chunks, no longer rotating\n", MaxChunks);
+    warned = true;
+    return false;
+  }
+
+  ftruncate(record, size);
+  close(record);
+  ChunkSizes[CurrentChunk] = size;
+  record = openChunk(++CurrentChunk);
+  writeManifest(false);
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+//                          Per-thread State
+//===----------------------------------------------------------------------===//
+
+/// How the trace is buffered on its way to the trace file (GIRI_BUFFER_MODE).
+enum BufferMode {
+  SharedCache,      ///< All threads append to the shared entry cache
+  PerThreadBuffers, ///< Each thread appends to its own segments without locks
+  FlightRecorder    ///< Only the latest records are kept in a ring in memory
+};
+static BufferMode Buffering = SharedCache;
+
+/// Size of one trace segment in bytes. It must be a multiple of the page size
+/// since every per-thread segment is mapped separately.
+static const unsigned long TraceSegmentBytes = 4UL << 20;
+
+/// Commit a segment of the given chunk with the given number of records. The
+/// count is stored before the commit flag, and both are plain stores to the
+/// mapped file, so this may be called from a signal handler.
+static void commitSegment(Entry *segment, uintptr_t count, unsigned chunk) {
+  SegmentHeader *header = reinterpret_cast<SegmentHeader *>(segment);
+  header->count = count;
+  std::atomic_signal_fence(std::memory_order_release);
+  header->flags |= CommittedSegment;
+  ChunkRecords[chunk].fetch_add(count, std::memory_order_relaxed);
+}
+
+std::atomic<uintptr_t> giri::NextSequence(0);
+RecordOrder giri::Ordering = SequenceOrder;
+__thread FastWindow *giri::CurrentWindow = nullptr;
+
+/// Whether the fast path of the run-time may append to the segments of the
+/// threads. It can't link loads to stores or predict their addresses, so it is
+/// only used in the per-thread buffer mode without GIRI_LAST_WRITER and
+/// GIRI_STRIDE_PREDICTION.
+static bool FastPath = false;
+
+/// Whether loads and stores are stride predicted (GIRI_STRIDE_PREDICTION)
+static bool PredictStrides = false;
+
+/// Number of records of each thread between two checkpoints, or 0 if no
+/// checkpoints are written
+static unsigned long CheckpointInterval = 1 << 20;
+
+/// The end of the trace file in the per-thread buffer mode. New segments are
+/// carved from here while holding the SegmentMutex.
+static off_t SegmentFileEnd = 0;
+static pthread_mutex_t SegmentMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// \class The state of the tracing run-time for one thread.
+///
+/// Instances are registered in a global list and never freed, so that the
+/// exit handler can still terminate the basic blocks and finish the segments
+/// of every thread, including threads that have exited.
+struct ThreadState {
+  /// The number of the thread, which identifies it in the trace. Unlike its
+  /// pthread_t, it isn't reused by a later thread.
+  pthread_t tid;
+  pthread_t self; ///< The pthread_t of the thread
+
+  /// The thread event at which the thread executed instrumented code first, or
+  /// 0 if it hasn't yet
+  unsigned long started;
+
+  /// The thread event at which the thread recorded its last ThreadCreate
+  unsigned long creating;
+  ShadowStack<BBRecord> bbStack; ///< Basic blocks currently being executed
+  ShadowStack<FunRecord> fnStack; ///< Function calls currently being executed
+
+  /// The segment of the trace file this thread currently appends to. Only used
+  /// in the per-thread buffer mode.
+  Entry *segment;
+  unsigned index; ///< Next free slot of the segment
+  unsigned capacity; ///< Number of slots in the segment
+  unsigned chunk; ///< The trace chunk the segment belongs to
+  FastWindow window; ///< The part of the segment the fast path appends to
+
+  uint64_t records[RecordTypeCounters]; ///< Records added per type
+  uint64_t lockWaitNanos; ///< Time spent waiting for the entry cache lock
+  uint64_t sinceCheckpoint; ///< Records added since the last checkpoint
+
+  uint64_t stores; ///< Store records added
+
+  /// Branch outcomes not written yet, and their number
+  uint64_t branchBits[2];
+  unsigned branchCount;
+
+  /// The function the call recorded last is expected to enter
+  unsigned char *expectedEntry;
+
+  /// The call recorded last with -giri-dual-clone, which is pushed once its
+  /// function enters its instrumented body, and the tracing epoch it was
+  /// recorded in. The function is null once the call has been pushed.
+  unsigned pendingCall;
+  bool pendingTraced;
+  unsigned char *pendingEntry;
+  unsigned pendingEpoch;
+
+  /// The stride predictor of the loads and stores, created on first use
+  StridePredictor *predictor;
+
+  /// The keys of the predicted loads and stores not written yet
+  unsigned strideKeys[StrideHitsPerRecord];
+  unsigned strideCount;
+  uint64_t strideHits; ///< Loads and stores predicted
+
+  ThreadState *next; ///< Next registered thread
+
+  /// Whether the records of this thread are traced, i.e. whether its current
+  /// basic block is traced
+  bool tracing() const {
+    return bbStack.empty() ? !tracingPaused() : bbStack.top().traced();
+  }
+
+  /// Take over the records appended through the window since it was armed, and
+  /// disarm it. This is async-signal-safe.
+  void syncWindow() {
+    if (!window.limit)
+      return;
+    unsigned added = window.cursor - (segment + index);
+    for (unsigned i = 0; i < added; ++i)
+      ++records[counterIndex(segment[index + i].type)];
+    index += added;
+    sinceCheckpoint += added;
+    window.cursor = window.limit = nullptr;
+  }
+
+  /// Arm the window if the current basic block is traced and the segment has
+  /// room before the next checkpoint is due.
+  void armWindow();
+
+  /// Take the predicted loads and stores not written yet as a stride hit
+  /// record.
+  /// \return false if there are none.
+  bool takeStrideHits(Entry &entry) {
+    if (!strideCount)
+      return false;
+    entry = StridePredictor::packHits(tid, strideKeys, strideCount);
+    strideCount = 0;
+    return true;
+  }
+
+  /// Take the branch outcomes not written yet as a branch outcome record.
+  /// \return false if there are none.
+  bool takeBranches(Entry &entry) {
+    if (!branchCount)
+      return false;
+    entry = Entry(RecordType::BRType, branchCount, tid,
+                  reinterpret_cast<unsigned char *>(branchBits[0]),
+                  branchBits[1]);
+    branchBits[0] = branchBits[1] = 0;
+    branchCount = 0;
+    return true;
+  }
+
+  /// Add one entry to this thread's segment without taking any lock.
+  inline void append(Entry entry) {
+    if (index == capacity)
+      newSegment();
+    entry.tid = nextStamp();
+    segment[index++] = entry;
+  }
+
+  /// Commit the segment and unmap it.
+  void closeSegment();
+
+  /// Terminate the active basic blocks as far as the segment has room, and
+  /// commit the segment in place. This is async-signal-safe.
+  void closeOnSignal(bool last);
+
+private:
+  /// Close the current segment (if any) and map a fresh one.
+  void newSegment();
+};
+
+/// Most threads whose stores may be linked to. A writer in shadow memory holds
+/// the number of the thread above the ordinal of the store.
+static const unsigned MaxLinkedThreads = 1U << 15;
+static const unsigned OrdinalBits = 48;
+
+/// All threads which have executed instrumented code or whose creation has
+/// been recorded, newest first, the number of the next one, starting at 1, and
+/// the number of thread starts and ThreadCreate records so far. They are
+/// guarded by ThreadListMutex.
+static ThreadState *ThreadList = nullptr;
+static unsigned NextThreadNumber = 1;
+static unsigned long ThreadEvents = 0;
+static pthread_mutex_t ThreadListMutex = PTHREAD_MUTEX_INITIALIZER;
+static thread_local ThreadState *CurrentThread = nullptr;
+
+/// The key whose destructor writes what a thread holds back when it exits
+static pthread_key_t ExitKey;
+
+/// Add the state of a thread to the thread list and number it. The caller
+/// holds ThreadListMutex.
+static ThreadState *addThread(pthread_t self) {
+  ThreadState *TS = new ThreadState();
+  TS->tid = NextThreadNumber++;
+  TS->self = self;
+  TS->started = TS->creating = 0;
+  TS->segment = nullptr;
+  TS->index = TS->capacity = 0;
+  TS->window.cursor = TS->window.limit = nullptr;
+  TS->window.epoch = 0;
+  memset(TS->records, 0, sizeof(TS->records));
+  TS->lockWaitNanos = 0;
+  TS->sinceCheckpoint = 0;
+  TS->stores = 0;
+  TS->branchBits[0] = TS->branchBits[1] = 0;
+  TS->branchCount = 0;
+  TS->expectedEntry = nullptr;
+  TS->pendingEntry = nullptr;
+  TS->predictor = nullptr;
+  TS->strideCount = 0;
+  TS->strideHits = 0;
+  TS->next = ThreadList;
+  ThreadList = TS;
+  return TS;
+}
+
+/// Find the newest thread with the given pthread_t. The caller holds
+/// ThreadListMutex.
+static ThreadState *findThread(pthread_t self) {
+  for (ThreadState *TS = ThreadList; TS; TS = TS->next)
+    if (TS->self == self)
+      return TS;
+  return nullptr;
+}
+
+/// Register the calling thread with the run-time. A thread whose creation has
+/// been recorded before it started has been numbered by its creator.
+static ThreadState *registerThread() {
+  pthread_t self = pthread_self();
+  pthread_mutex_lock(&ThreadListMutex);
+  ThreadState *TS = findThread(self);
+  if (!TS || TS->started)
+    TS = addThread(self);
+  TS->started = ++ThreadEvents;
+  pthread_mutex_unlock(&ThreadListMutex);
+  // The first record of the thread is preceded by a checkpoint, so a reader
+  // finds one before any record of the thread.
+  TS->sinceCheckpoint = CheckpointInterval;
+  pthread_setspecific(ExitKey, TS);
+  if (FastPath)
+    CurrentWindow = &TS->window;
+  return TS;
+}
+
+/// Get the run-time state of the calling thread, taking over the records the
+/// fast path has appended for it.
+static inline ThreadState *threadState() {
+  if (!CurrentThread)
+    CurrentThread = registerThread();
+  CurrentThread->syncWindow();
+  return CurrentThread;
+}
+
+/// Write the manifest of a chunked trace. It lists every chunk with its file
+/// name relative to the manifest, its size in bytes and its number of records,
+/// followed by the threads which have recorded entries. Only the manifest
+/// written when the trace is complete ends with an end line; readers look for
+/// chunks beyond the listed ones otherwise. This is async-signal-safe.
+static void writeManifest(bool final) {
+  if (ManifestFD == -1)
+    return;
+
+  const char *base = strrchr(TraceName, '/');
+  base = base ? base + 1 : TraceName;
+  char name[PATH_MAX + 16];
+
+  TextWriter W(ManifestFD);
+  W << "GIRI-MANIFEST 1\n";
+  for (unsigned i = 0; i <= CurrentChunk; ++i) {
+    off_t size = ChunkSizes[i];
+    struct stat finfo;
+    if (i == CurrentChunk)
+      size = fstat(record, &finfo) == 0 ? finfo.st_size : 0;
+    chunkName(name, base, i);
+    W << "chunk " << name << " " << static_cast<unsigned long>(size) << " "
+      << static_cast<unsigned long>(ChunkRecords[i].load()) << "\n";
+  }
+  for (ThreadState *TS = ThreadList; TS; TS = TS->next)
+    if (TS->started)
+      W << "thread " << static_cast<unsigned long>(TS->tid) << "\n";
+  if (final)
+    W << "end\n";
+  W.close();
+}
+
+/// Write the telemetry of the run-time to NAME.stats.json next to the trace
+/// NAME. It holds the number of records per type, the bytes written, the
+/// window switches (remaps) with the time they stalled the program, the time
+/// spent in msync and munmap, the wait for the entry cache lock, and the peak
+/// stack depths of every thread. Times are in nanoseconds. If the program was
+/// killed by a signal, it is given as "signal". This is async-signal-safe.
+static void writeTelemetry(int signum) {
+  static const char Suffix[] = ".stats.json";
+  char name[PATH_MAX + sizeof(Suffix)];
+  size_t len = strlen(TraceName);
+  memcpy(name, TraceName, len);
+  memcpy(name + len, Suffix, sizeof(Suffix));
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0640u);
+  if (fd == -1)
+    return;
+
+  static const char *const Modes[] = { "shared", "per-thread", "ring" };
+  uint64_t records[RecordTypeCounters] = { 0 };
+  uint64_t lockWaitNanos = 0;
+  uint64_t strideHits = 0;
+  for (ThreadState *TS = ThreadList; TS; TS = TS->next) {
+    for (unsigned i = 0; i < RecordTypeCounters; ++i)
+      records[i] += TS->records[i];
+    lockWaitNanos += TS->lockWaitNanos;
+    strideHits += TS->strideHits;
+  }
+
+  TextWriter W(fd);
+  static const char *const Orders[] = { "sequence", "tsc", "clock" };
+  W << "{\n  \"mode\": \"" << Modes[Buffering] << "\",\n"
+    << "  \"order\": \"" << Orders[Ordering] << "\",\n"
+    << "  \"signal\": " << static_cast<unsigned long>(signum) << ",\n"
+    << "  \"records\": {";
+  const char *separator = "";
+  for (unsigned i = 0; i < RecordTypeCounters; ++i) {
+    if (!records[i])
+      continue;
+    char type[2] = { static_cast<char>('A' + i), 0 };
+    W << separator << "\"" << type << "\": "
+      << static_cast<unsigned long>(records[i]);
+    separator = ", ";
+  }
+  W << "},\n"
+    << "  \"bytes_written\": "
+    << static_cast<unsigned long>(BytesWritten.load()) << ",\n"
+    << "  \"remaps\": " << Flusher.getSwitches() << ",\n"
+    << "  \"remap_stall_ns\": "
+    << static_cast<unsigned long>(Flusher.getStallNanos()) << ",\n"
+    << "  \"writeback_ns\": "
+    << static_cast<unsigned long>(Flusher.getWriteBackNanos()) << ",\n"
+    << "  \"background_writeback_ns\": "
+    << static_cast<unsigned long>(Flusher.getBackgroundNanos()) << ",\n"
+    << "  \"lock_wait_ns\": " << static_cast<unsigned long>(lockWaitNanos)
+    << ",\n";
+  if (PredictStrides) {
+    // The compression ratio is the number of records the trace would have
+    // without prediction over the number written, in hundredths.
+    uint64_t written = 0;
+    for (unsigned i = 0; i < RecordTypeCounters; ++i)
+      written += records[i];
+    uint64_t unpredicted =
+      written - records[counterIndex(RecordType::SHType)] + strideHits;
+    unsigned long ratio = written ? unpredicted * 100 / written : 100;
+    W << "  \"stride_hits\": " << static_cast<unsigned long>(strideHits)
+      << ",\n"
+      << "  \"compression_ratio\": " << ratio / 100 << "."
+      << (ratio % 100 < 10 ? "0" : "") << ratio % 100 << ",\n";
+  }
+  W << "  \"threads\": [";
+  separator = "\n";
+  for (ThreadState *TS = ThreadList; TS; TS = TS->next) {
+    if (!TS->started)
+      continue;
+    unsigned long total = 0;
+    for (unsigned i = 0; i < RecordTypeCounters; ++i)
+      total += TS->records[i];
+    W << separator
+      << "    {\"tid\": " << static_cast<unsigned long>(TS->tid)
+      << ", \"records\": " << total
+      << ", \"max_bb_depth\": "
+      << static_cast<unsigned long>(TS->bbStack.maxSize())
+      << ", \"max_fn_depth\": "
+      << static_cast<unsigned long>(TS->fnStack.maxSize())
+      << ", \"lock_wait_ns\": "
+      << static_cast<unsigned long>(TS->lockWaitNanos) << "}";
+    separator = ",\n";
+  }
+  W << "\n  ]\n}\n";
+  W.close();
+  close(fd);
+}
 
 //===----------------------------------------------------------------------===//
 //                        Trace Entry Cache
@@ -92,8 +743,9 @@ static std::unordered_map<pthread_t, std::stack<FunRecord>> FNStack;
 
 class EntryCache {
 public:
-  /// Open the file descriptor and mmap the EntryCacheBytes bytes to the cache
-  void init(int FD);
+  /// Open the file descriptor and get the first window from the sink which
+  /// writes the trace. The windows take up to budget bytes.
+  void init(int FD, TraceSink *Sink, unsigned long budget);
 
   /// Add one entry to the cache
   void addToEntryCache(const Entry &entry);
@@ -101,27 +753,33 @@ public:
   /// Close the cache file
   void closeCacheFile();
 
+  /// Terminate the trace as far as the current segment has room, and commit
+  /// the segment in place. This is async-signal-safe.
+  void closeOnSignal();
+
 private:
-  /// Map the trace file to cache
+  /// Get the window of the trace file at fileOffset from the sink
   void mapCache(void);
 
+  /// Write the header of a new segment at the current index.
+  void openSegment();
+
 private:
   /// The current index into the entry cache. This points to the next element
   /// in which to write the next entry (cache holds a part of the trace file).
   unsigned index;
   Entry *cache; ///< A cache of entries that need to be written to disk
+  unsigned segmentStart; ///< Index of the header of the open segment
+  unsigned segmentEnd; ///< Index just past the slots of the open segment
   off_t fileOffset; ///< The offset of the file which is cached into memory.
   int fd; ///< File which is being cached in memory.
+  TraceSink *sink; ///< The backend writing the windows to the file
 
   unsigned long EntryCacheBytes; ///< Size of the entry cache in bytes
   unsigned long EntryCacheSize; ///< Size of the entry cache
-  static const float LOAD_FACTOR; ///< load factor of the system memory
 };
 
-const float EntryCache::LOAD_FACTOR = 0.1;
-
-void EntryCache::init(int FD) {
-  long pages = sysconf(_SC_PHYS_PAGES);
+void EntryCache::init(int FD, TraceSink *Sink, unsigned long budget) {
   long page_size = sysconf(_SC_PAGE_SIZE);
 
   // assert that the size of an entry evenly divides the cache entry
@@ -131,7 +789,14 @@ void EntryCache::init(int FD) {
     abort();
   }
 
-  EntryCacheBytes = static_cast<long>(pages * LOAD_FACTOR ) * page_size;
+  // The cache holds a whole number of segments.
+  sink = Sink;
+  EntryCacheBytes = sink->windowBytes(budget);
+  EntryCacheBytes -= EntryCacheBytes % TraceSegmentBytes;
+  if (EntryCacheBytes == 0)
+    EntryCacheBytes = TraceSegmentBytes;
+  if (ChunkBytes && EntryCacheBytes > ChunkBytes)
+    EntryCacheBytes = ChunkBytes;
   EntryCacheSize = EntryCacheBytes / sizeof(Entry);
 
   // Save the file descriptor of the file that we'll use.
@@ -146,49 +811,52 @@ void EntryCache::init(int FD) {
 }
 
 void EntryCache::mapCache() {
-#ifndef __CYGWIN__
-  char buf[1] = {0};
-  off_t currentPosition = lseek(fd, EntryCacheBytes + 1, SEEK_CUR);
-  write(fd, buf, 1);
-  lseek(fd, currentPosition, SEEK_SET);
-#endif
-
-  // Map in the next section of the file.
-#ifdef __CYGWIN__
-  cache = (Entry *)mmap(0,
-                        EntryCacheBytes,
-                        PROT_READ | PROT_WRITE,
-                        MAP_SHARED | MAP_AUTOGROW,
-                        fd,
-                        fileOffset);
-#else
-  cache = (Entry *)mmap(0,
-                        EntryCacheBytes,
-                        PROT_READ | PROT_WRITE,
-                        MAP_SHARED,
-                        fd,
-                        fileOffset);
-#endif
-  if (cache == MAP_FAILED) {
-    ERROR("[GIRI] Error mapping entry cache: %s\n", strerror(errno));
-    abort();
-  }
+  cache = sink->getWindow(fd, fileOffset, EntryCacheBytes);
 
   // Reset the entry cache.
   index = 0;
+  openSegment();
+}
+
+void EntryCache::openSegment() {
+  SegmentHeader *header = reinterpret_cast<SegmentHeader *>(&cache[index]);
+  header->type = RecordType::SGType;
+  header->flags = 0;
+  header->tid = 0;
+  header->capacity = TraceSegmentBytes / sizeof(Entry);
+  header->count = 0;
+  segmentStart = index++;
+  segmentEnd = segmentStart + header->capacity;
 }
 
 void EntryCache::addToEntryCache(const Entry &entry) {
+  if (index == segmentEnd) {
+    commitSegment(&cache[segmentStart], index - segmentStart - 1, CurrentChunk);
+    if (index != EntryCacheSize)
+      openSegment();
+  }
+
   // Flush the cache if necessary.
   if (index == EntryCacheSize) {
     DEBUG("[GIRI] Writing the cache to file and remapping...\n");
-    // Unmap the data. This should force it to be written to disk.
-    msync(cache, EntryCacheBytes, MS_SYNC);
-    munmap(cache, EntryCacheBytes);
-    // Advance the file offset to the next portion of the file.
+    uint64_t start = monotonicNanos();
+    // Write the window to disk. Depending on the sink, this happens while we
+    // go on with the next window.
+    sink->putWindow(fd, cache, EntryCacheBytes, fileOffset, false);
+    BytesWritten.fetch_add(EntryCacheBytes, std::memory_order_relaxed);
+    // Advance the file offset to the next portion of the file, which is the
+    // start of the next chunk if the next window doesn't fit into this one.
     fileOffset += EntryCacheBytes;
+    if (ChunkBytes && fileOffset + EntryCacheBytes > ChunkBytes) {
+      sink->drain();
+      if (nextChunk(fileOffset)) {
+        fd = record;
+        fileOffset = 0;
+      }
+    }
     // Remap the cache
     mapCache();
+    Flusher.addStall(monotonicNanos() - start);
   }
 
   // Add the entry to the entry cache and increment the index
@@ -207,26 +875,239 @@ void EntryCache::closeCacheFile() {
   // Create basic block termination entries for each basic block on the stack.
   // These were the basic blocks that were active when the program terminated.
   // **** Should we print the return records for active functions as well?????????
-  for (auto I = BBStack.begin(); I != BBStack.end(); ++I) {
-    while (!I->second.empty()) {
+  pthread_mutex_lock(&ThreadListMutex);
+  for (ThreadState *TS = ThreadList; TS; TS = TS->next) {
+    Entry hits(RecordType::SHType, 0);
+    if (TS->takeStrideHits(hits))
+      addToEntryCache(hits);
+    Entry branches(RecordType::BRType, 0);
+    if (TS->takeBranches(branches))
+      addToEntryCache(branches);
+    while (!TS->bbStack.empty()) {
       // Create a basic block entry for it.
-      unsigned bbid = I->second.top().id;
-      unsigned char *fp = I->second.top().address;
-      addToEntryCache(Entry(RecordType::BBType, bbid, I->first, fp));
-      I->second.pop();
+      unsigned bbid = TS->bbStack.top().id;
+      unsigned char *fp = TS->bbStack.top().address;
+      if (TS->bbStack.top().traced())
+        addToEntryCache(Entry(RecordType::BBType, bbid, TS->tid, fp));
+      TS->bbStack.pop();
     }
   }
+  pthread_mutex_unlock(&ThreadListMutex);
 
   // Create an end entry to terminate the log.
-  addToEntryCache(Entry(RecordType::ENType, 0));
+  addToEntryCache(endEntry());
+  commitSegment(&cache[segmentStart], index - segmentStart - 1, CurrentChunk);
 
   size_t len = sizeof(Entry) * index;
-  // Unmap the data. This should force it to be written to disk.
-  msync(cache, len, MS_SYNC);
-  munmap(cache, len);
+  // Write the data to disk.
+  sink->putWindow(fd, cache, len, fileOffset, true);
+  BytesWritten.fetch_add(len, std::memory_order_relaxed);
+  sink->drain();
 
   // Truncate the file to be the actual size for small traces
-  ftruncate(fd, len + fileOffset);
+  if (sink->seekable())
+    ftruncate(fd, len + fileOffset);
+}
+
+void EntryCache::closeOnSignal() {
+  // Keep one slot for the end record. The thread list is walked without its
+  // lock, which the interrupted thread may hold.
+  for (ThreadState *TS = ThreadList; TS; TS = TS->next) {
+    Entry hits(RecordType::SHType, 0);
+    if (index + 1 < segmentEnd && TS->takeStrideHits(hits))
+      cache[index++] = hits;
+    Entry branches(RecordType::BRType, 0);
+    if (index + 1 < segmentEnd && TS->takeBranches(branches))
+      cache[index++] = branches;
+    for (unsigned i = TS->bbStack.size(); i-- > 0 && index + 1 < segmentEnd; ) {
+      const BBRecord &BB = TS->bbStack[i];
+      if (BB.traced())
+        cache[index++] = Entry(RecordType::BBType, BB.id, TS->tid, BB.address);
+    }
+  }
+  if (index < segmentEnd)
+    cache[index++] = endEntry();
+  commitSegment(&cache[segmentStart], index - segmentStart - 1, CurrentChunk);
+  sink->writeOnSignal(fd, cache, sizeof(Entry) * index, fileOffset);
+  BytesWritten.fetch_add(sizeof(Entry) * index, std::memory_order_relaxed);
+}
+
+void ThreadState::newSegment() {
+  uint64_t start = monotonicNanos();
+  bool switching = segment;
+  if (segment)
+    closeSegment();
+
+  // Carve the next segment out of the trace file.  This is the only place
+  // where the per-thread buffer mode synchronizes, once per segment. The
+  // segment is mapped before unlocking since another thread may switch to the
+  // next chunk and close the file.
+  pthread_mutex_lock(&SegmentMutex);
+  if (ChunkBytes && SegmentFileEnd + TraceSegmentBytes > ChunkBytes &&
+      nextChunk(SegmentFileEnd))
+    SegmentFileEnd = 0;
+  off_t offset = SegmentFileEnd;
+  SegmentFileEnd += TraceSegmentBytes;
+  if (!reserveWindow(record, offset, TraceSegmentBytes)) {
+    ERROR("[GIRI] Error extending trace file: %s\n", strerror(errno));
+    abort();
+  }
+  chunk = CurrentChunk;
+  segment = (Entry *)mmap(0,
+                          TraceSegmentBytes,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED,
+                          record,
+                          offset);
+  pthread_mutex_unlock(&SegmentMutex);
+  if (segment == MAP_FAILED) {
+    ERROR("[GIRI] Error mapping trace segment: %s\n", strerror(errno));
+    abort();
+  }
+  prepareWindow(segment, TraceSegmentBytes);
+
+  capacity = TraceSegmentBytes / sizeof(Entry);
+  SegmentHeader *header = reinterpret_cast<SegmentHeader *>(segment);
+  header->type = RecordType::SGType;
+  header->flags = Ordering == SequenceOrder ? SequencedSegment
+                                            : TimestampedSegment;
+  header->tid = tid;
+  header->capacity = capacity;
+  header->count = 0;
+  index = 1;
+  if (switching)
+    Flusher.addStall(monotonicNanos() - start);
+}
+
+void ThreadState::closeSegment() {
+  commitSegment(segment, index - 1, chunk);
+  Flusher.flush(segment, TraceSegmentBytes, false);
+  BytesWritten.fetch_add(TraceSegmentBytes, std::memory_order_relaxed);
+  segment = nullptr;
+  index = capacity = 0;
+}
+
+void ThreadState::closeOnSignal(bool last) {
+  if (!segment)
+    return;
+  syncWindow();
+  // Keep one slot for the end record if this thread writes it.
+  unsigned reserved = last ? 1 : 0;
+  Entry hits(RecordType::SHType, 0);
+  if (index + reserved < capacity && takeStrideHits(hits)) {
+    hits.tid = nextStamp();
+    segment[index++] = hits;
+  }
+  Entry branches(RecordType::BRType, 0);
+  if (index + reserved < capacity && takeBranches(branches)) {
+    branches.tid = nextStamp();
+    segment[index++] = branches;
+  }
+  for (unsigned i = bbStack.size(); i-- > 0 && index + reserved < capacity; ) {
+    const BBRecord &BB = bbStack[i];
+    if (!BB.traced())
+      continue;
+    Entry entry(RecordType::BBType, BB.id, tid, BB.address);
+    entry.tid = nextStamp();
+    segment[index++] = entry;
+  }
+  if (last && index < capacity) {
+    Entry entry = endEntry();
+    entry.tid = nextStamp();
+    segment[index++] = entry;
+  }
+  commitSegment(segment, index - 1, chunk);
+  BytesWritten.fetch_add(TraceSegmentBytes, std::memory_order_relaxed);
+}
+
+//===----------------------------------------------------------------------===//
+//                        Flight Recorder Ring Buffer
+//===----------------------------------------------------------------------===//
+
+/// \class Keeps only the most recent records of the trace in memory.
+///
+/// Nothing is written while the program runs. The ring is dumped to the trace
+/// file as a flat trace on exit, on a fatal signal and whenever the program
+/// receives SIGUSR2, each dump replacing the previous one. Like the entry
+/// cache, a dump ends with termination records for the basic blocks that are
+/// still active and an end record, so the tail of a long run can be sliced.
+class RingBuffer {
+public:
+  /// Allocate a ring of the given size in bytes for the trace file FD.
+  void init(int FD, unsigned long bytes);
+
+  /// Add one entry, overwriting the oldest one if the ring is full.
+  inline void add(const Entry &entry) {
+    ring[index] = entry;
+    if (++index == capacity) {
+      index = 0;
+      wrapped = true;
+    }
+  }
+
+  /// Write the ring to the trace file. This is async-signal-safe, but records
+  /// added by other threads while dumping may tear the oldest entries.
+  void dump();
+
+private:
+  Entry *ring; ///< The ring of entries
+  unsigned long index; ///< The slot of the next entry, i.e. the oldest one
+  unsigned long capacity; ///< Number of entries in the ring
+  bool wrapped; ///< Whether the ring has been filled at least once
+  int fd; ///< The trace file
+};
+
+void RingBuffer::init(int FD, unsigned long bytes) {
+  fd = FD;
+  index = 0;
+  wrapped = false;
+  capacity = bytes / sizeof(Entry);
+  ring = (Entry *)mmap(0,
+                       capacity * sizeof(Entry),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                       -1,
+                       0);
+  if (ring == MAP_FAILED) {
+    ERROR("[GIRI] Error mapping flight recorder: %s\n", strerror(errno));
+    abort();
+  }
+  prepareWindow(ring, capacity * sizeof(Entry));
+}
+
+void RingBuffer::dump() {
+  unsigned long end = index;
+  off_t offset = 0;
+  if (ftruncate(fd, 0) == -1)
+    return;
+
+  // The oldest records follow the newest one if the ring has wrapped around.
+  if (wrapped) {
+    size_t older = (capacity - end) * sizeof(Entry);
+    writeAll(fd, ring + end, older, offset);
+    offset += older;
+  }
+  writeAll(fd, ring, end * sizeof(Entry), offset);
+  offset += end * sizeof(Entry);
+
+  // Terminate the basic blocks which are still active, innermost first. The
+  // stacks are left alone since the program may go on after a dump, and the
+  // thread list is walked without its lock since we may be in a signal handler.
+  for (ThreadState *TS = ThreadList; TS; TS = TS->next) {
+    for (unsigned i = TS->bbStack.size(); i-- > 0; ) {
+      const BBRecord &BB = TS->bbStack[i];
+      if (!BB.traced())
+        continue;
+      Entry entry(RecordType::BBType, BB.id, TS->tid, BB.address);
+      writeAll(fd, &entry, sizeof(Entry), offset);
+      offset += sizeof(Entry);
+    }
+  }
+
+  Entry last = endEntry();
+  writeAll(fd, &last, sizeof(Entry), offset);
+  offset += sizeof(Entry);
+  BytesWritten.fetch_add(offset, std::memory_order_relaxed);
 }
 
 //===----------------------------------------------------------------------===//
@@ -236,35 +1117,453 @@ void EntryCache::closeCacheFile() {
 /// This is the very entry cache used by all record functions
 /// Call entryCache.init(fd) before usage
 static EntryCache entryCache;
+/// The ring buffer used instead of the entry cache in the flight recorder mode
+static RingBuffer ringBuffer;
 /// the mutex of modifying the EntryCache
 static pthread_mutex_t EntryCacheMutex;
 
+void ThreadState::armWindow() {
+  syncWindow();
+  if (!FastPath || !segment || !tracing())
+    return;
+  unsigned end = capacity;
+  if (CheckpointInterval && CheckpointInterval - sinceCheckpoint < end - index)
+    end = index + (CheckpointInterval - sinceCheckpoint);
+  if (index == end)
+    return;
+  window.cursor = segment + index;
+  window.limit = segment + end;
+  window.epoch = TracingEpoch.load(std::memory_order_relaxed);
+}
+
+/// Put one entry of the given thread into the segment of the thread, into the
+/// flight recorder or into the shared entry cache.
+static inline void putEntry(ThreadState *TS, const Entry &entry) {
+  ++TS->records[counterIndex(entry.type)];
+  if (Buffering == PerThreadBuffers)
+    TS->append(entry);
+  else if (Buffering == FlightRecorder)
+    ringBuffer.add(entry);
+  else
+    entryCache.addToEntryCache(entry);
+}
+
+/// Write one entry of the given thread. A load or store whose access the
+/// stride predictor of the thread predicted is held back as a hit, and the
+/// hits are written before any other entry of the thread.
+static inline void writeEntry(ThreadState *TS, const Entry &entry) {
+  if (PredictStrides) {
+    if (unsigned key = StridePredictor::getKey(entry.type, entry.id)) {
+      if (!TS->predictor)
+        TS->predictor = new StridePredictor();
+      if (TS->predictor->update(key, entry.address, entry.length)) {
+        ++TS->strideHits;
+        TS->strideKeys[TS->strideCount++] = key;
+        if (TS->strideCount < StrideHitsPerRecord)
+          return;
+        Entry hits(RecordType::SHType, 0);
+        TS->takeStrideHits(hits);
+        putEntry(TS, hits);
+        return;
+      }
+    }
+    Entry hits(RecordType::SHType, 0);
+    if (TS->takeStrideHits(hits))
+      putEntry(TS, hits);
+  }
+  putEntry(TS, entry);
+}
+
+/// Write the stride hits and branch outcomes a thread holds back when it
+/// exits, so that they come before the records of the thread which joins it.
+static void flushThread(void *state) {
+  ThreadState *TS = static_cast<ThreadState *>(state);
+  if (Buffering != PerThreadBuffers)
+    pthread_mutex_lock(&EntryCacheMutex);
+  TS->syncWindow();
+  Entry hits(RecordType::SHType, 0);
+  if (TS->takeStrideHits(hits))
+    putEntry(TS, hits);
+  Entry branches(RecordType::BRType, 0);
+  if (TS->takeBranches(branches))
+    putEntry(TS, branches);
+  if (Buffering != PerThreadBuffers)
+    pthread_mutex_unlock(&EntryCacheMutex);
+}
+
+/// Write a checkpoint of the traced calls the thread is executing. Untraced
+/// ones get no records later on, so they are left out.
+static void writeCheckpoint(ThreadState *TS) {
+  unsigned frames = 0;
+  for (unsigned i = 0; i < TS->fnStack.size(); ++i)
+    frames += TS->fnStack[i].traced;
+
+  writeEntry(TS, Entry(RecordType::CKType, frames, TS->tid, nullptr,
+                       CheckpointBegin));
+  for (unsigned i = 0; i < TS->fnStack.size(); ++i) {
+    const FunRecord &Fn = TS->fnStack[i];
+    if (Fn.traced)
+      writeEntry(TS, Entry(RecordType::CKType, Fn.id, TS->tid, Fn.fnAddress,
+                           CallFrame));
+  }
+  TS->sinceCheckpoint = 0;
+}
+
+/// Whether loads are linked to the stores they read (GIRI_LAST_WRITER)
+static bool LinkStores = false;
+
+/// The last store of every granule of memory (GIRI_SHADOW_GRANULARITY)
+static ShadowMemory Shadow;
+
+/// Most last writer records of one load
+static const unsigned MaxLoadLinks = 8;
+
+/// Track the stores in shadow memory, and follow a load with the last writer
+/// records of the stores it reads.
+static void linkLastWriters(ThreadState *TS, const Entry &entry) {
+  switch (entry.type) {
+    case RecordType::STType: {
+      // The stores of a thread without a number can't be linked to.
+      uint64_t writer = ShadowMemory::Mixed;
+      ++TS->stores;
+      if (TS->tid < MaxLinkedThreads)
+        writer = (static_cast<uint64_t>(TS->tid) << OrdinalBits) |
+                 TS->stores;
+      Shadow.store(entry.address, entry.length, writer);
+      break;
+    }
+    case RecordType::ALType:
+      // A new object holds nothing stored by the program.
+      Shadow.store(entry.address, entry.length, 0);
+      break;
+    case RecordType::LDType: {
+      uint64_t writers[MaxLoadLinks];
+      int count = Shadow.load(entry.address, entry.length, writers,
+                              MaxLoadLinks);
+      for (int i = 0; i < count; ++i) {
+        uintptr_t ordinal = writers[i] & ((1ULL << OrdinalBits) - 1);
+        pthread_t writer = ordinal ? writers[i] >> OrdinalBits : 0;
+        writeEntry(TS, Entry(RecordType::LWType, i, TS->tid,
+                             reinterpret_cast<unsigned char *>(ordinal),
+                             writer));
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/// Add one entry to the trace, preceded by a checkpoint of the thread every
+/// CheckpointInterval records, and followed by the last writer records of a
+/// load if loads are linked. Entries of a basic block which isn't traced are
+/// dropped.
+static inline void addToTrace(const Entry &entry) {
+  ThreadState *TS = threadState();
+  if (!TS->tracing())
+    return;
+  if (CheckpointInterval && ++TS->sinceCheckpoint > CheckpointInterval)
+    writeCheckpoint(TS);
+  writeEntry(TS, entry);
+  if (LinkStores)
+    linkLastWriters(TS, entry);
+  TS->armWindow();
+}
+
+/// Finish the per-thread segments: terminate the basic blocks still active in
+/// every thread, append the end record and seal all segments.
+static void closeThreadSegments() {
+  pthread_mutex_lock(&ThreadListMutex);
+  for (ThreadState *TS = ThreadList; TS; TS = TS->next) {
+    TS->syncWindow();
+    Entry hits(RecordType::SHType, 0);
+    if (TS->takeStrideHits(hits))
+      TS->append(hits);
+    Entry branches(RecordType::BRType, 0);
+    if (TS->takeBranches(branches))
+      TS->append(branches);
+    while (!TS->bbStack.empty()) {
+      const BBRecord &BB = TS->bbStack.top();
+      if (BB.traced())
+        TS->append(Entry(RecordType::BBType, BB.id, TS->tid, BB.address));
+      TS->bbStack.pop();
+    }
+  }
+  pthread_mutex_unlock(&ThreadListMutex);
+
+  // The end record gets the last stamp, so it ends the merged trace.
+  threadState()->append(endEntry());
+
+  for (ThreadState *TS = ThreadList; TS; TS = TS->next)
+    if (TS->segment)
+      TS->closeSegment();
+}
+
 /// helper function which is registered at atexit()
 static void finish() {
   DEBUG("[GIRI] Writing cache data to trace file and closing.\n");
   // Make sure that we flush the entry cache on exit.
-  entryCache.closeCacheFile();
+  if (Buffering == PerThreadBuffers)
+    closeThreadSegments();
+  else if (Buffering == FlightRecorder)
+    ringBuffer.dump();
+  else
+    entryCache.closeCacheFile();
+  Flusher.stop();
+  Flusher.report();
+  writeManifest(true);
+  writeTelemetry(0);
 
   // destroy the mutexes
   pthread_mutex_destroy(&EntryCacheMutex);
 }
 
+/// Print the abnormal termination message using only async-signal-safe calls.
+static void printSignal(int signum) {
+  char buf[64] = "[GIRI] Abnormal termination, signal number ";
+  size_t len = strlen(buf);
+  char digits[12];
+  unsigned n = 0;
+  do {
+    digits[n++] = '0' + signum % 10;
+    signum /= 10;
+  } while (signum);
+  while (n)
+    buf[len++] = digits[--n];
+  buf[len++] = '\n';
+  write(STDERR_FILENO, buf, len);
+}
+
 /// Signal handler to write only tracing data to file
+///
+/// The buffered records already live in shared mappings of the trace file, so
+/// committing the open segments is enough to keep them once the process dies.
+/// This only uses async-signal-safe calls. The signal is then raised again
+/// with its default action, so the program terminates just like without the
+/// run-time, e.g. with a core dump.
 static void cleanup_only_tracing(int signum) {
-  ERROR("[GIRI] Abnormal termination, signal number %d\n", signum);
-  exit(signum);
+  static volatile sig_atomic_t handling = 0;
+  if (!handling) {
+    handling = 1;
+    printSignal(signum);
+    if (Buffering == PerThreadBuffers) {
+      for (ThreadState *TS = ThreadList; TS; TS = TS->next)
+        TS->closeOnSignal(TS == CurrentThread);
+    } else if (Buffering == FlightRecorder) {
+      ringBuffer.dump();
+    } else {
+      entryCache.closeOnSignal();
+    }
+    writeManifest(true);
+    writeTelemetry(signum);
+  }
+
+  signal(signum, SIG_DFL);
+  raise(signum);
+}
+
+/// Signal handler to dump the flight recorder on request
+static void dump_flight_recorder(int) {
+  int savedErrno = errno;
+  ringBuffer.dump();
+  errno = savedErrno;
+}
+
+/// Signal handler to pause or resume tracing
+static void toggle_tracing(int) {
+  if (tracingPaused())
+    giriTracingResume();
+  else
+    giriTracingPause();
+}
+
+/// Get the size of the flight recorder in bytes from GIRI_RING_BUFFER_MB.
+static unsigned long ringBufferBytes() {
+  static const unsigned long DefaultMB = 64;
+  const char *size = getenv("GIRI_RING_BUFFER_MB");
+  if (!size)
+    return DefaultMB << 20;
+  char *end;
+  unsigned long MB = strtoul(size, &end, 10);
+  if (*end || MB == 0) {
+    ERROR("[GIRI] Invalid GIRI_RING_BUFFER_MB %s, using %lu\n",
+          size, DefaultMB);
+    MB = DefaultMB;
+  }
+  return MB << 20;
+}
+
+/// Get the memory budget of the windows of the entry cache in bytes from
+/// GIRI_WINDOW_MB. By default the windows take a tenth of the physical memory,
+/// but no more than DefaultMaxMB, so that big hosts don't map huge windows.
+static unsigned long windowBudget() {
+  static const unsigned long DefaultMaxMB = 1024;
+  const char *size = getenv("GIRI_WINDOW_MB");
+  if (size) {
+    char *end;
+    unsigned long MB = strtoul(size, &end, 10);
+    if (!*end && MB)
+      return MB << 20;
+    ERROR("[GIRI] Invalid GIRI_WINDOW_MB %s, using the default\n", size);
+  }
+  unsigned long bytes = static_cast<unsigned long>(sysconf(_SC_PHYS_PAGES)) /
+                        10 * sysconf(_SC_PAGE_SIZE);
+  return bytes < (DefaultMaxMB << 20) ? bytes : DefaultMaxMB << 20;
+}
+
+/// Get the size of a trace chunk in bytes from GIRI_CHUNK_MB, rounded up to
+/// whole segments, or 0 if the trace shouldn't be chunked.
+static unsigned long chunkBytes() {
+  const char *size = getenv("GIRI_CHUNK_MB");
+  if (!size)
+    return 0;
+  char *end;
+  unsigned long MB = strtoul(size, &end, 10);
+  if (*end || MB == 0) {
+    ERROR("[GIRI] Invalid GIRI_CHUNK_MB %s, not chunking the trace\n", size);
+    return 0;
+  }
+  unsigned long bytes = MB << 20;
+  return (bytes + TraceSegmentBytes - 1) / TraceSegmentBytes * TraceSegmentBytes;
 }
 
 void recordInit(const char *name) {
+  pthread_key_create(&ExitKey, flushThread);
+
+  // Select how the trace is buffered. The per-thread buffers are only mapped
+  // once a thread records its first entry.
+  const char *mode = getenv("GIRI_BUFFER_MODE");
+  if (mode && !strcmp(mode, "per-thread"))
+    Buffering = PerThreadBuffers;
+  else if (mode && !strcmp(mode, "ring"))
+    Buffering = FlightRecorder;
+  else if (mode && strcmp(mode, "shared"))
+    ERROR("[GIRI] Unknown GIRI_BUFFER_MODE %s, using shared\n", mode);
+
+  // Select what orders the records of the per-thread buffers. The time stamp
+  // counter is only used if it is consistent across the cores.
+  const char *order = getenv("GIRI_ORDER");
+  if (order && Buffering != PerThreadBuffers) {
+    ERROR("[GIRI] GIRI_ORDER only applies to the per-thread buffer mode\n");
+  } else if (order && !strcmp(order, "tsc")) {
+    const char *reason;
+    if (tscIsSynchronized(reason)) {
+      Ordering = TSCOrder;
+    } else {
+      ERROR("[GIRI] Not ordering by the time stamp counter as %s, "
+            "using CLOCK_MONOTONIC_RAW\n", reason);
+      Ordering = ClockOrder;
+    }
+  } else if (order && !strcmp(order, "clock")) {
+    Ordering = ClockOrder;
+  } else if (order && strcmp(order, "sequence")) {
+    ERROR("[GIRI] Unknown GIRI_ORDER %s, using sequence\n", order);
+  }
+
+  // Select the backend writing the entry cache. Per-thread segments are
+  // always mapped.
+  TraceSink *Sink = nullptr;
+  const char *sinkSpec = getenv("GIRI_SINK");
+  if (Buffering == SharedCache)
+    Sink = TraceSink::create(sinkSpec, name, Flusher);
+  else if (sinkSpec)
+    ERROR("[GIRI] GIRI_SINK only applies to the shared buffer mode\n");
+
+  // Split the trace into chunks if requested. The flight recorder writes a
+  // single dump which isn't chunked, and a pipe or a shared memory stream
+  // can't be split either.
+  ChunkBytes = chunkBytes();
+  if (ChunkBytes && Buffering == FlightRecorder) {
+    ERROR("[GIRI] The flight recorder doesn't support GIRI_CHUNK_MB\n");
+    ChunkBytes = 0;
+  }
+  if (ChunkBytes && Sink && !Sink->seekable()) {
+    ERROR("[GIRI] A sink which can't seek doesn't support "
+          "GIRI_CHUNK_MB\n");
+    ChunkBytes = 0;
+  }
+
+  // Write a checkpoint every GIRI_CHECKPOINT_INTERVAL records of a thread, or
+  // never if it is 0.
+  const char *interval = getenv("GIRI_CHECKPOINT_INTERVAL");
+  if (interval) {
+    char *end;
+    unsigned long records = strtoul(interval, &end, 10);
+    if (*end)
+      ERROR("[GIRI] Invalid GIRI_CHECKPOINT_INTERVAL %s, using %lu\n",
+            interval, CheckpointInterval);
+    else
+      CheckpointInterval = records;
+  }
+
+  // Link every load to the stores it reads if requested. The flight recorder
+  // drops the stores the ordinals count. The shadow memory tracks every byte
+  // by default, since a granule partly written by a narrower store links no
+  // load reading it.
+  const char *lastWriter = getenv("GIRI_LAST_WRITER");
+  if (lastWriter && !strcmp(lastWriter, "1")) {
+    const char *granularity = getenv("GIRI_SHADOW_GRANULARITY");
+    const char *reason;
+    if (Buffering == FlightRecorder)
+      ERROR("[GIRI] The flight recorder doesn't support GIRI_LAST_WRITER\n");
+    else if (!Shadow.init(granularity ? atoi(granularity) : 1, reason))
+      ERROR("[GIRI] Not linking loads to stores as %s\n", reason);
+    else
+      LinkStores = true;
+  }
+
+  // Predict the addresses of loads and stores if requested. The trace reader
+  // replays the predictions, so it needs every record before a hit, which the
+  // flight recorder drops. The last writer records follow their load, which a
+  // hit doesn't write.
+  const char *strides = getenv("GIRI_STRIDE_PREDICTION");
+  if (strides && !strcmp(strides, "1")) {
+    if (Buffering == FlightRecorder)
+      ERROR("[GIRI] The flight recorder doesn't support "
+            "GIRI_STRIDE_PREDICTION\n");
+    else if (LinkStores)
+      ERROR("[GIRI] GIRI_STRIDE_PREDICTION can't be used with "
+            "GIRI_LAST_WRITER\n");
+    else
+      PredictStrides = true;
+  }
+  FastPath = Buffering == PerThreadBuffers && !LinkStores && !PredictStrides;
+
   // Open the file for recording the trace if it hasn't been opened already.
   // Truncate it in case this dynamic trace is shorter than the last one
-  // stored in the file.
+  // stored in the file. In the chunked mode this file is the manifest.
   record = open(name, O_RDWR | O_CREAT | O_TRUNC, 0640u);
   assert(record != -1 && "Failed to open tracing file!\n");
   DEBUG("[GIRI] Opened trace file: %s\n", name);
+  strncpy(TraceName, name, sizeof(TraceName) - 1);
+
+  // Tell this run from the earlier ones which wrote a trace of the same name.
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  RunID = (static_cast<uintptr_t>(now.tv_sec) * 1000000000 + now.tv_nsec) ^
+          (static_cast<uintptr_t>(getpid()) << 44);
+  if (ChunkBytes) {
+    ManifestFD = record;
+    record = openChunk(0);
+    writeManifest(false);
+  }
+
+  // Prefault the windows and back them with huge pages if requested.
+  const char *prefault = getenv("GIRI_PREFAULT");
+  PrefaultWindows = prefault && !strcmp(prefault, "1");
+  const char *hugePages = getenv("GIRI_HUGE_PAGES");
+  HugePageWindows = hugePages && !strcmp(hugePages, "1");
+
+  // Write full windows back on a background thread if requested.
+  const char *async = getenv("GIRI_ASYNC_FLUSH");
+  if (async && !strcmp(async, "1"))
+    Flusher.start();
 
   // Initialize the entry cache by giving it a memory buffer to use.
-  entryCache.init(record);
+  if (Buffering == SharedCache)
+    entryCache.init(record, Sink, windowBudget());
+  else if (Buffering == FlightRecorder)
+    ringBuffer.init(record, ringBufferBytes());
   pthread_mutex_init(&EntryCacheMutex, NULL);
 
   atexit(finish);
@@ -278,19 +1577,70 @@ void recordInit(const char *name) {
   signal(SIGKILL, cleanup_only_tracing);
   signal(SIGILL, cleanup_only_tracing);
   signal(SIGFPE, cleanup_only_tracing);
+  if (Buffering == FlightRecorder)
+    signal(SIGUSR2, dump_flight_recorder);
+
+  // Start paused if requested, and flip tracing on GIRI_TOGGLE_SIGNAL, which
+  // defaults to SIGRTMIN when starting paused. The signal is left to the
+  // program unless one of them is set.
+  const char *paused = getenv("GIRI_START_PAUSED");
+  bool startPaused = paused && !strcmp(paused, "1");
+  if (startPaused)
+    giriTracingPause();
+  const char *toggle = getenv("GIRI_TOGGLE_SIGNAL");
+  int toggleSignal = toggle ? atoi(toggle) : startPaused ? SIGRTMIN : 0;
+  if (toggleSignal)
+    signal(toggleSignal, toggle_tracing);
+}
+
+/// Pause tracing. The shadow stacks are still maintained while paused, so that
+/// the records after resuming are matched with the right calls.
+void giriTracingPause(void) {
+  unsigned epoch = TracingEpoch.load();
+  while (!(epoch & 1) &&
+         !TracingEpoch.compare_exchange_weak(epoch, epoch + 1))
+    ;
+  giriTracingEnabled = !tracingPaused();
+}
+
+/// Resume tracing. The basic blocks active at this point are not traced, since
+/// they have missed the records while paused.
+void giriTracingResume(void) {
+  unsigned epoch = TracingEpoch.load();
+  while ((epoch & 1) &&
+         !TracingEpoch.compare_exchange_weak(epoch, epoch + 1))
+    ;
+  giriTracingEnabled = !tracingPaused();
 }
 
 /// \brief Lock the entry cache mutex. This function is instrumented before
 /// one Load/Store was executed. The load / and store sequence should be
 /// guaranteed in the way they happen. 
+///
+/// In the per-thread buffer mode the global order comes from the stamps of the
+/// records instead. A record and its memory access are then no longer atomic,
+/// which is still exact for data race free programs: conflicting accesses are
+/// ordered by the program's own synchronization, and so are their stamps as
+/// long as the synchronization takes longer than a tick of the clock.
 void recordLock(const char *inst_name) {
-  pthread_mutex_lock(&EntryCacheMutex);
+  if (Buffering == PerThreadBuffers)
+    return;
+  // Only time the lock when another thread holds it.
+  if (pthread_mutex_trylock(&EntryCacheMutex)) {
+    uint64_t start = monotonicNanos();
+    pthread_mutex_lock(&EntryCacheMutex);
+    threadState()->lockWaitNanos += monotonicNanos() - start;
+  }
   DEBUG("[GIRI] Lock for instruction: %s\n", inst_name);
+  (void)inst_name;
 }
 
 /// \brief Unlock the entry cache mutex.
 void recordUnlock(const char *inst_name) {
+  if (Buffering == PerThreadBuffers)
+    return;
   DEBUG("[GIRI] Release the lock for instruction: %s\n", inst_name);
+  (void)inst_name;
   pthread_mutex_unlock(&EntryCacheMutex);
 }
 
@@ -299,10 +1649,10 @@ void recordUnlock(const char *inst_name) {
 /// block termination if the program terminates before the basic blocks
 /// complete execution.
 void recordStartBB(unsigned id, unsigned char *fp) {
-  pthread_t tid = pthread_self();
-
   // Push the basic block identifier on to the back of the stack.
-  BBStack[tid].push(BBRecord(id, fp));
+  ThreadState *TS = threadState();
+  TS->bbStack.push(BBRecord(id, fp));
+  TS->armWindow();
 }
 
 /// Record that a basic block has finished execution.
@@ -313,19 +1663,21 @@ void recordBB(unsigned id, unsigned char *fp, unsigned lastBB) {
 
   // Record that this basic block has been executed.
   unsigned callID = 0;
-  pthread_t tid = pthread_self();
+  ThreadState *TS = threadState();
+  ShadowStack<FunRecord> &Functions = TS->fnStack;
 
   // If this is the last BB of this function invocation, take the function id
   // off the FFStack. We have recorded that it has finished execution. Store
   // the call id to record the end of function call at the end of the last BB.
   if (lastBB) {
-    if (!FNStack[tid].empty()) {
-      if (FNStack[tid].top().fnAddress != fp ) {
+    if (!Functions.empty()) {
+      if (Functions.top().fnAddress != fp ) {
         ERROR("[GIRI] Function id on stack doesn't match for id %u.\
                MAY be due to function call from external code\n", id);
       } else {
-        callID = FNStack[tid].top().id;
-        FNStack[tid].pop();
+        // A call which wasn't traced has no matching call record either.
+        callID = Functions.top().traced ? Functions.top().id : ~0;
+        Functions.pop();
       }
     } else {
       // If nothing in stack, it is main function return which doesn't have a
@@ -334,32 +1686,82 @@ void recordBB(unsigned id, unsigned char *fp, unsigned lastBB) {
     }
   }
 
-  entryCache.addToEntryCache(Entry(RecordType::BBType, id, tid, fp, callID));
+  addToTrace(Entry(RecordType::BBType, id, TS->tid, fp, callID));
 
   // Take the basic block off the basic block stack.  We have recorded that it
   // has finished execution.
-  BBStack[tid].pop();
+  TS->bbStack.pop();
+  TS->armWindow();
+}
+
+/// Record the loads, stores and selects of a basic block instrumented with
+/// -giri-batch-blocks, followed by the end of the block. The records are the
+/// same as those of the individual record functions, but are all written when
+/// the block finishes execution.
+/// \param count - The number of loads, stores and selects.
+/// \param ops - The type, ID and access size of each of them.
+/// \param values - The address of each load and store, and the flag of each
+///                 select.
+void recordBlock(unsigned id, unsigned char *fp, unsigned lastBB,
+                 unsigned count, const BlockOp *ops, const uintptr_t *values) {
+  if (!tracingPaused()) {
+    pthread_t tid = threadState()->tid;
+    for (unsigned i = 0; i < count; ++i)
+      addToTrace(Entry(ops[i].type,
+                       ops[i].id,
+                       tid,
+                       reinterpret_cast<unsigned char *>(values[i]),
+                       ops[i].length));
+  }
+  recordBB(id, fp, lastBB);
 }
 
 /// Record that a load has been executed.
 void recordLoad(unsigned id, unsigned char *p, uintptr_t length) {
-  pthread_t tid = pthread_self();
+  if (tracingPaused())
+    return;
+  pthread_t tid = threadState()->tid;
   DEBUG("[GIRI] Inside %s: id = %u, len = %lx\n", __func__, id, length);
-  entryCache.addToEntryCache(Entry(RecordType::LDType, id, tid, p, length));
+  addToTrace(Entry(RecordType::LDType, id, tid, p, length));
+}
+
+/// Record a load or store of a size known when instrumenting. The tracing pass
+/// calls the instances below for accesses of 1, 2, 4, 8 and 16 bytes, so that
+/// the size isn't passed on every call.
+template <RecordType Type, uintptr_t Length>
+static inline void recordSized(unsigned id, unsigned char *p) {
+  if (tracingPaused())
+    return;
+  addToTrace(Entry(Type, id, threadState()->tid, p, Length));
 }
 
+#define GIRI_DEFINE_SIZED_RECORDS(N)                                           \
+  void recordLoad##N(unsigned id, unsigned char *p) {                          \
+    recordSized<RecordType::LDType, N>(id, p);                                 \
+  }                                                                            \
+  void recordStore##N(unsigned id, unsigned char *p) {                         \
+    recordSized<RecordType::STType, N>(id, p);                                 \
+  }
+GIRI_DEFINE_SIZED_RECORDS(1)
+GIRI_DEFINE_SIZED_RECORDS(2)
+GIRI_DEFINE_SIZED_RECORDS(4)
+GIRI_DEFINE_SIZED_RECORDS(8)
+GIRI_DEFINE_SIZED_RECORDS(16)
+
 /// Record that a string has been read.
 void recordStrLoad(unsigned id, char *p) {
+  if (tracingPaused())
+    return;
   // First determine the length of the string.  Add one byte to include the
   // string terminator character.
   uintptr_t length = strlen(p) + 1;
   DEBUG("[GIRI] Inside %s: id = %u, leng = %lx\n", __func__, id, length);
   // Record that a load has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::LDType,
-                                   id,
-                                   pthread_self(),
-                                   (unsigned char *)p,
-                                   length));
+  addToTrace(Entry(RecordType::LDType,
+                   id,
+                   threadState()->tid,
+                   (unsigned char *)p,
+                   length));
 }
 
 /// Record that a store has occurred.
@@ -367,36 +1769,42 @@ void recordStrLoad(unsigned id, char *p) {
 /// \param p      - The starting address of the store.
 /// \param length - The length, in bytes, of the stored data.
 void recordStore(unsigned id, unsigned char *p, uintptr_t length) {
+  if (tracingPaused())
+    return;
   DEBUG("[GIRI] Inside %s: id = %u, length = %lx\n", __func__, id, length);
   // Record that a store has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::STType,
-                                   id,
-                                   pthread_self(),
-                                   p,
-                                   length));
+  addToTrace(Entry(RecordType::STType,
+                   id,
+                   threadState()->tid,
+                   p,
+                   length));
 }
 
 /// Record that a string has been written.
 /// \param id - The ID of the instruction that wrote to the string.
 /// \param p  - A pointer to the string.
 void recordStrStore(unsigned id, char *p) {
+  if (tracingPaused())
+    return;
   // First determine the length of the string.  Add one byte to include the
   // string terminator character.
   uintptr_t length = strlen(p) + 1;
   DEBUG("[GIRI] Inside %s: id = %u, length = %lx\n", __func__, id, length);
   // Record that there has been a store starting at the first address of the
   // string and continuing for the length of the string.
-  entryCache.addToEntryCache(Entry(RecordType::STType,
-                                   id,
-                                   pthread_self(),
-                                   (unsigned char *)p,
-                                   length));
+  addToTrace(Entry(RecordType::STType,
+                   id,
+                   threadState()->tid,
+                   (unsigned char *)p,
+                   length));
 }
 
 /// Record that a string has been written on strcat.
 /// \param id - The ID of the instruction that wrote to the string.
 /// \param  p  - A pointer to the string.
 void recordStrcatStore(unsigned id, char *p, char *s) {
+  if (tracingPaused())
+    return;
   // Determine where the new string will be added Don't. add one byte
   // to include the string terminator character, as write will start
   // from there. Then determine the length of the written string.
@@ -406,11 +1814,11 @@ void recordStrcatStore(unsigned id, char *p, char *s) {
   // Record that there has been a store starting at the firstlast
   // address (the position of null termination char) of the string and
   // continuing for the length of the source string.
-  entryCache.addToEntryCache(Entry(RecordType::STType,
-                                   id,
-                                   pthread_self(),
-                                   (unsigned char *)start,
-                                   length));
+  addToTrace(Entry(RecordType::STType,
+                   id,
+                   threadState()->tid,
+                   (unsigned char *)start,
+                   length));
 }
 
 /// Record that a call instruction was executed.
@@ -418,12 +1826,48 @@ void recordStrcatStore(unsigned id, char *p, char *s) {
 /// \param fp - The address of the function that was called.
 void recordCall(unsigned id, unsigned char *fp) {
   DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
-  pthread_t tid = pthread_self();
+  ThreadState *TS = threadState();
 
   // Record that a call has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::CLType, id, tid, fp));
+  bool traced = TS->tracing();
+  if (traced)
+    addToTrace(Entry(RecordType::CLType, id, TS->tid, fp));
   // Push the Function call identifier on to the back of the stack.
-  FNStack[tid].push(FunRecord(id, fp));
+  TS->fnStack.push(FunRecord(id, traced, fp));
+}
+
+/// Record that a call to a function instrumented with -giri-dual-clone was
+/// executed. The call isn't pushed yet, since the function runs its untraced
+/// clone while tracing is paused, which doesn't pop it.
+/// \param id - The ID of the call instruction.
+/// \param fp - The address of the function that was called.
+void recordClonedCall(unsigned id, unsigned char *fp) {
+  DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
+  ThreadState *TS = threadState();
+
+  bool traced = TS->tracing();
+  if (traced)
+    addToTrace(Entry(RecordType::CLType, id, TS->tid, fp));
+  TS->pendingCall = id;
+  TS->pendingTraced = traced;
+  TS->pendingEntry = fp;
+  TS->pendingEpoch = TracingEpoch.load(std::memory_order_relaxed);
+}
+
+/// Record that a function instrumented with -giri-dual-clone entered its
+/// instrumented body, whose last basic block pops its call. The call is the
+/// one recorded last if it called this function and tracing wasn't paused
+/// since. Otherwise the function was called by an untraced clone or external
+/// code, and its call has no record.
+/// \param fp - The address of the function.
+void recordTracedEntry(unsigned char *fp) {
+  ThreadState *TS = threadState();
+  if (TS->pendingEntry == fp &&
+      TS->pendingEpoch == TracingEpoch.load(std::memory_order_relaxed))
+    TS->fnStack.push(FunRecord(TS->pendingCall, TS->pendingTraced, fp));
+  else
+    TS->fnStack.push(FunRecord(~0U, false, fp));
+  TS->pendingEntry = nullptr;
 }
 
 // FIXME: Do we still need it after adding separate return records????
@@ -431,22 +1875,29 @@ void recordCall(unsigned id, unsigned char *fp) {
 /// \param id - The ID of the call instruction.
 /// \param fp - The address of the function that was called.
 void recordExtCall(unsigned id, unsigned char *fp) {
+  // A function entered through this call needs no function entry record.
+  ThreadState *TS = threadState();
+  TS->expectedEntry = fp;
+  if (tracingPaused())
+    return;
   DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
   // Record that a call has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::CLType,
-                                   id,
-                                   pthread_self(),
-                                   fp));
+  addToTrace(Entry(RecordType::CLType,
+                   id,
+                   TS->tid,
+                   fp));
 }
 
 /// Record that a function has finished execution by adding a return trace entry
 void recordReturn(unsigned id, unsigned char *fp) {
+  if (tracingPaused())
+    return;
   DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
   // Record that a call has returned.
-  entryCache.addToEntryCache(Entry(RecordType::RTType,
-                                   id,
-                                   pthread_self(),
-                                   fp));
+  addToTrace(Entry(RecordType::RTType,
+                   id,
+                   threadState()->tid,
+                   fp));
 }
 
 /// Record that an external function has finished execution by updating function
@@ -455,13 +1906,13 @@ void recordReturn(unsigned id, unsigned char *fp) {
 ///       Not needed anymore as we don't add external function call records
 void recordExtCallRet(unsigned callID, unsigned char *fp) {
   DEBUG("[GIRI] Inside %s: callID = %u\n", __func__, callID); 
-  pthread_t tid = pthread_self();
-  assert(!FNStack[tid].empty());
-  if (FNStack[tid].top().fnAddress != fp)
+  ShadowStack<FunRecord> &Functions = threadState()->fnStack;
+  assert(!Functions.empty());
+  if (Functions.top().fnAddress != fp)
 	ERROR("[GIRI] Function id on stack doesn't match for id %u. \
            MAY be due to function call from external code\n", callID);
   else
-     FNStack[tid].pop();
+     Functions.pop();
 }
 
 /// This function records which input of a select instruction was selected.
@@ -469,10 +1920,185 @@ void recordExtCallRet(unsigned callID, unsigned char *fp) {
 /// \param flag - The boolean value (true or false) used to determine the select
 ///               instruction's output.
 void recordSelect(unsigned id, unsigned char flag) {
+  if (tracingPaused())
+    return;
   DEBUG("[GIRI] Inside %s: id = %u, flag = %c\n", __func__, id, flag);
   // Record that a store has been executed.
-  entryCache.addToEntryCache(Entry(RecordType::PDType,
-                                   id,
-                                   pthread_self(),
-                                   reinterpret_cast<unsigned char *>(flag)));
+  addToTrace(Entry(RecordType::PDType,
+                   id,
+                   threadState()->tid,
+                   reinterpret_cast<unsigned char *>(flag)));
+}
+
+/// Append one outcome to the branch outcome stream of a thread, writing the
+/// stream out whenever a record is full. The stream isn't paused with tracing,
+/// since the trace reader can't follow the control flow past a gap.
+static inline void addBranchBit(ThreadState *TS, bool bit) {
+  unsigned count = TS->branchCount++;
+  TS->branchBits[count / 64] |= static_cast<uint64_t>(bit) << (count % 64);
+  if (TS->branchCount == BranchRecordBits) {
+    Entry entry(RecordType::BRType, 0);
+    TS->takeBranches(entry);
+    writeEntry(TS, entry);
+  }
+}
+
+/// Record the outcome of a conditional branch, or the condition of a select
+/// instrumented with -giri-branch-trace.
+/// \param taken - Whether the condition was true.
+void recordBranch(unsigned char taken) {
+  ThreadState *TS = threadState();
+  addBranchBit(TS, taken);
+  TS->armWindow();
+}
+
+/// Record the condition of a switch instrumented with -giri-branch-trace.
+/// \param value - The condition, zero-extended or truncated to 64 bits.
+void recordSwitch(uint64_t value) {
+  ThreadState *TS = threadState();
+  do {
+    for (unsigned i = 0; i < 7; ++i)
+      addBranchBit(TS, (value >> i) & 1);
+    value >>= 7;
+    addBranchBit(TS, value != 0);
+  } while (value);
+  TS->armWindow();
+}
+
+/// Record that an instrumented function was entered, if it wasn't entered
+/// through the call the thread has recorded last.
+/// \param id - The ID of the entry block of the function.
+/// \param fp - The address of the function.
+void recordEnter(unsigned id, unsigned char *fp) {
+  ThreadState *TS = threadState();
+  if (TS->expectedEntry != fp) {
+    DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
+    writeEntry(TS, Entry(RecordType::FNType, id, TS->tid, fp));
+  }
+  TS->expectedEntry = nullptr;
+  TS->armWindow();
+}
+
+/// This function records a pthread synchronization event.
+/// \param id - The ID of the call to the pthread function
+/// \param kind - The SyncRecord kind of the event
+/// \param object - The address of the synchronization object, the address of
+///                 the pthread_t of ThreadCreated, or the pthread_t of the
+///                 thread joined by ThreadJoin
+/// \param result - The result of the call for an acquire
+void recordSync(unsigned id, unsigned kind, uintptr_t object, int result) {
+  if (tracingPaused())
+    return;
+  DEBUG("[GIRI] Inside %s: id = %u, kind = %u\n", __func__, id, kind);
+
+  // Nothing is acquired by a call which failed, e.g. a trylock.
+  bool succeeded = result == 0;
+  if (kind == BarrierLeave)
+    succeeded |= result == PTHREAD_BARRIER_SERIAL_THREAD;
+  if (!succeeded)
+    return;
+
+  // Threads are identified by their number, as a pthread_t may be reused. A
+  // created thread which has started since the ThreadCreate record has its
+  // number, and one which hasn't is numbered now, and takes the number when it
+  // starts. The number of a thread which never started is taken over. A joined
+  // thread is the newest one with its pthread_t, as no other thread can get it
+  // before the join.
+  ThreadState *TS = threadState();
+  if (kind == ThreadCreate || kind == ThreadCreated || kind == ThreadJoin) {
+    pthread_mutex_lock(&ThreadListMutex);
+    if (kind == ThreadCreate) {
+      TS->creating = ++ThreadEvents;
+    } else if (kind == ThreadCreated) {
+      pthread_t self = *reinterpret_cast<pthread_t *>(object);
+      ThreadState *Created = findThread(self);
+      if (!Created || (Created->started && Created->started < TS->creating))
+        Created = addThread(self);
+      object = static_cast<uintptr_t>(Created->tid);
+    } else {
+      ThreadState *Joined = findThread(static_cast<pthread_t>(object));
+      object = Joined ? static_cast<uintptr_t>(Joined->tid) : 0;
+    }
+    pthread_mutex_unlock(&ThreadListMutex);
+  }
+  addToTrace(Entry(RecordType::SYType,
+                   id,
+                   TS->tid,
+                   reinterpret_cast<unsigned char *>(object),
+                   kind));
+}
+
+/// This function records the allocation of a heap object or a stack variable.
+/// No store to the object's memory before the allocation can be read from it.
+/// \param id - The ID of the allocating call or alloca instruction
+/// \param p  - The address of the object, or null if the allocation failed
+/// \param length - The size of the object in bytes
+void recordAlloc(unsigned id, unsigned char *p, uintptr_t length) {
+  if (tracingPaused() || !p)
+    return;
+  DEBUG("[GIRI] Inside %s: id = %u, length = %lx\n", __func__, id, length);
+  addToTrace(Entry(RecordType::ALType,
+                   id,
+                   threadState()->tid,
+                   p,
+                   length));
+}
+
+/// This function records the deallocation of a heap object.
+/// \param id - The ID of the call to free()
+/// \param p  - The address of the object
+void recordFree(unsigned id, unsigned char *p) {
+  if (tracingPaused() || !p)
+    return;
+  DEBUG("[GIRI] Inside %s: id = %u\n", __func__, id);
+  addToTrace(Entry(RecordType::FRType,
+                   id,
+                   threadState()->tid,
+                   p));
+}
+
+/// This function records a call to realloc(). An object resized in place keeps
+/// its contents, so it is only recorded as a new object if it moved.
+/// \param id - The ID of the call to realloc()
+/// \param old - The address of the object before the call
+/// \param p  - The address of the object after the call
+/// \param length - The new size of the object in bytes
+void recordRealloc(unsigned id, unsigned char *old, unsigned char *p,
+                   uintptr_t length) {
+  if (p == old || !p)
+    return;
+  recordFree(id, old);
+  recordAlloc(id, p, length);
+}
+
+/// This function writes the table of the instrumented functions to the file
+/// NAME.functions next to the trace, so that the slicer can map the function
+/// addresses in the trace to functions without searching the trace for calls.
+/// The first line holds the ID of the run, which the end record of the trace
+/// holds as well, so that the slicer can tell a table left by another run.
+/// Each following line holds the ID of the entry block of a function and its
+/// address.
+/// \param count - The number of functions
+/// \param ids - The IDs of the entry blocks of the functions
+/// \param addresses - The addresses of the functions
+void recordFunctions(unsigned count, const unsigned *ids,
+                     unsigned char *const *addresses) {
+  static const char Suffix[] = ".functions";
+  char name[PATH_MAX + sizeof(Suffix)];
+  size_t len = strlen(TraceName);
+  memcpy(name, TraceName, len);
+  memcpy(name + len, Suffix, sizeof(Suffix));
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0640u);
+  if (fd == -1) {
+    ERROR("[GIRI] Failed to open the function table %s\n", name);
+    return;
+  }
+
+  TextWriter W(fd);
+  W << static_cast<unsigned long>(RunID) << "\n";
+  for (unsigned i = 0; i < count; ++i)
+    W << static_cast<unsigned long>(ids[i]) << " "
+      << reinterpret_cast<unsigned long>(addresses[i]) << "\n";
+  W.close();
+  close(fd);
 }
@@ -0,0 +1,71 @@
+//===- FastPath.cpp - The inlineable fast path of the run-time ------------===//
+//
+//                     Giri: Dynamic Slicing in LLVM
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the record functions which the tracing pass calls and
+// inlines instead of the ones of the run-time with -giri-inline-runtime. Each
+// one appends its record through the window of the calling thread, and only
+// calls the run-time if the window has no room.
+//
+//===----------------------------------------------------------------------===//
+
+#include "FastPath.h"
+
+using namespace giri;
+
+//===----------------------------------------------------------------------===//
+//                           Forward declearation
+//===----------------------------------------------------------------------===//
+extern "C" void recordLock(const char *inst_name);
+extern "C" void recordUnlock(const char *inst_name);
+extern "C" void recordLoad(unsigned id, unsigned char *p, uintptr_t);
+extern "C" void recordStore(unsigned id, unsigned char *p, uintptr_t);
+extern "C" void recordSelect(unsigned id, unsigned char flag);
+
+extern "C" void giriFastLock(const char *inst_name);
+extern "C" void giriFastUnlock(const char *inst_name);
+extern "C" void giriFastLoad(unsigned id, unsigned char *p, uintptr_t length);
+extern "C" void giriFastStore(unsigned id, unsigned char *p, uintptr_t length);
+extern "C" void giriFastSelect(unsigned id, unsigned char flag);
+
+//===----------------------------------------------------------------------===//
+//                            Record Functions
+//===----------------------------------------------------------------------===//
+
+/// Lock the entry cache, unless the thread appends to its own segment. Threads
+/// have no window in the shared buffer mode and the flight recorder.
+void giriFastLock(const char *inst_name) {
+  if (!CurrentWindow)
+    recordLock(inst_name);
+}
+
+/// Unlock the entry cache, unless the thread appends to its own segment.
+void giriFastUnlock(const char *inst_name) {
+  if (!CurrentWindow)
+    recordUnlock(inst_name);
+}
+
+/// Record that a load has been executed.
+void giriFastLoad(unsigned id, unsigned char *p, uintptr_t length) {
+  if (!appendFast(RecordType::LDType, id, reinterpret_cast<uintptr_t>(p),
+                  length))
+    recordLoad(id, p, length);
+}
+
+/// Record that a store has occurred.
+void giriFastStore(unsigned id, unsigned char *p, uintptr_t length) {
+  if (!appendFast(RecordType::STType, id, reinterpret_cast<uintptr_t>(p),
+                  length))
+    recordStore(id, p, length);
+}
+
+/// Record which input of a select instruction was selected.
+void giriFastSelect(unsigned id, unsigned char flag) {
+  if (!appendFast(RecordType::PDType, id, flag, 0))
+    recordSelect(id, flag);
+}
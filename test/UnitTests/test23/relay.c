@@ -0,0 +1,44 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NTHREADS 4
+#define ROUNDS 100
+
+/* The threads take turns in the order of their numbers, each adding to the
+ * value left by the thread before it. */
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t next = PTHREAD_COND_INITIALIZER;
+long turn;
+unsigned long value;
+
+void *relay(void *arg)
+{
+    long id = (long)arg, round;
+
+    for (round = 0; round < ROUNDS; round++) {
+        pthread_mutex_lock(&lock);
+        while (turn % NTHREADS != id)
+            pthread_cond_wait(&next, &lock);
+        value = value * 3 + id;
+        turn++;
+        pthread_cond_broadcast(&next);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t tid[NTHREADS];
+    long i;
+
+    value = atol(argv[1]);
+    for (i = 0; i < NTHREADS; i++)
+        pthread_create(&tid[i], NULL, relay, (void *)i);
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join(tid[i], NULL);
+
+    printf("The value is: %lu\n", value);
+    return value % 31;
+}
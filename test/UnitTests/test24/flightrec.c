@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define LENGTH 128
+
+/* Fill the flight recorder with records the slice doesn't depend on. */
+void spin(long n)
+{
+  volatile long noise = 0;
+  long i;
+
+  for (i = 0; i < n; i++)
+    noise += i;
+}
+
+int main(int argc, char *argv[])
+{
+  spin(1L << 16);
+
+  char *input = (char *)malloc(LENGTH);
+  memset(input, 0, LENGTH);
+  
+  strcpy(input, argv[1]);
+  strcat(input, argv[2]);
+
+  printf("%s\n", input);
+  printf("%zd\n", strlen(input));
+
+  return strlen(input);
+}
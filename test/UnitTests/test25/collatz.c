@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+#define LIMIT 3000
+
+/* Find the longest Collatz sequence starting below a limit. The trace takes
+ * many megabytes, although every value is read soon after it is written. */
+int main(void)
+{
+    unsigned long start, n, steps, longest = 0;
+
+    for (start = 1; start < LIMIT; start++) {
+        steps = 0;
+        for (n = start; n != 1; steps++)
+            n = n % 2 ? 3 * n + 1 : n / 2;
+        if (steps > longest)
+            longest = steps;
+    }
+
+    printf("The longest sequence takes %lu steps\n", longest);
+    return longest % 31;
+}
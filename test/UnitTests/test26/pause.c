@@ -0,0 +1,33 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Sum the first n elements of a. */
+long sum(long *a, long n)
+{
+  long i, s = 0;
+
+  for (i = 0; i < n; i++)
+    s += a[i];
+  return s;
+}
+
+int main(int argc, char *argv[])
+{
+  long i, n, result = 0;
+  long *a;
+
+  n = atoi(argv[1]);
+  a = (long *)malloc(n * sizeof(long));
+  for (i = 0; i < n; i++)
+    a[i] = i * i;
+
+  /* Tracing starts paused, so the array is filled untraced. The signal
+     resumes it, and the blocks starting from here on are traced. */
+  raise(SIGRTMIN);
+  if (n > 0)
+    result = sum(a, n);
+
+  printf("%ld\n", result);
+  return result % 31;
+}
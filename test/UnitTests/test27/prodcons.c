@@ -0,0 +1,65 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NTHREADS 4
+
+/** Shared variables guarded by lock */
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+long pending; /* number of items produced but not consumed yet */
+long total; /* sum of the items */
+
+pthread_barrier_t done;
+long nitems; /* number of items consumed by each thread */
+
+void *consume(void *vargp);
+
+int main(int argc, char **argv)
+{
+    long i;
+    pthread_t tid[NTHREADS];
+
+    /* Read the number of items, and produce random ones */
+    if (fscanf(stdin, "%ld", &nitems) != 1) {
+        fprintf(stderr, "Usage: echo <nitems> | %s\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    srand(time(NULL));
+    pthread_barrier_init(&done, NULL, NTHREADS + 1);
+
+    for (i = 0; i < NTHREADS; i++)
+        pthread_create(&tid[i], NULL, consume, NULL);
+    for (i = 0; i < NTHREADS * nitems; i++) {
+        pthread_mutex_lock(&lock);
+        pending++;
+        total += rand() % 2;
+        pthread_cond_signal(&ready);
+        pthread_mutex_unlock(&lock);
+    }
+    pthread_barrier_wait(&done);
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join(tid[i], NULL);
+
+    printf("The total is: %ld\n", total);
+
+    return total % 31;
+}
+
+void *consume(void *vargp)
+{
+    long i;
+
+    for (i = 0; i < nitems; i++) {
+        pthread_mutex_lock(&lock);
+        while (pending == 0)
+            pthread_cond_wait(&ready, &lock);
+        pending--;
+        total += i;
+        pthread_mutex_unlock(&lock);
+    }
+    pthread_barrier_wait(&done);
+
+    return NULL;
+}
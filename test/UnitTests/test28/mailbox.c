@@ -0,0 +1,56 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ITEMS 200
+
+/* A producer passes items to a consumer through a mailbox holding one item,
+ * so every item the consumer takes was put by the producer just before. */
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+long mailbox, full, factor, total;
+
+void *produce(void *arg)
+{
+    long i;
+
+    for (i = 1; i <= ITEMS; i++) {
+        pthread_mutex_lock(&lock);
+        while (full)
+            pthread_cond_wait(&changed, &lock);
+        mailbox = i * factor;
+        full = 1;
+        pthread_cond_signal(&changed);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+void *consume(void *arg)
+{
+    long i;
+
+    for (i = 1; i <= ITEMS; i++) {
+        pthread_mutex_lock(&lock);
+        while (!full)
+            pthread_cond_wait(&changed, &lock);
+        total += mailbox;
+        full = 0;
+        pthread_cond_signal(&changed);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t producer, consumer;
+
+    factor = atol(argv[1]);
+    pthread_create(&consumer, NULL, consume, NULL);
+    pthread_create(&producer, NULL, produce, NULL);
+    pthread_join(consumer, NULL);
+    pthread_join(producer, NULL);
+    printf("The total is: %ld\n", total);
+    return total % 31;
+}
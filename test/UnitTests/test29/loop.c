@@ -0,0 +1,37 @@
+#include <pthread.h>
+#include <stdio.h>
+
+#define NTHREADS 4
+
+/* The input of the running thread, and the outputs of all threads */
+long input;
+long output[NTHREADS];
+
+void *work(void *arg)
+{
+    long i = (long)arg;
+    output[i] = input + 1;
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t tid;
+    long i, result = 0;
+
+    /* Every thread reuses the pthread_t of the one joined before it. */
+    for (i = 0; i < NTHREADS; i++) {
+        if (i == 0)
+            input = 1;
+        else
+            input = i * 2;
+        pthread_create(&tid, NULL, work, (void *)i);
+        pthread_join(tid, NULL);
+    }
+
+    for (i = 0; i < NTHREADS; i++)
+        result += output[i];
+
+    printf("The result is: %ld\n", result);
+    return result % 31;
+}
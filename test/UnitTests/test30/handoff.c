@@ -0,0 +1,39 @@
+#include <pthread.h>
+#include <stdio.h>
+
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+long box, full, result;
+
+void *produce(void *arg)
+{
+    pthread_mutex_lock(&lock);
+    box = 42;
+    full = 1;
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void *consume(void *arg)
+{
+    long value = 0;
+    while (!value) {
+        pthread_mutex_lock(&lock);
+        if (full)
+            value = box;
+        pthread_mutex_unlock(&lock);
+    }
+    result = value * 2;
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t producer, consumer;
+
+    pthread_create(&consumer, NULL, consume, NULL);
+    pthread_create(&producer, NULL, produce, NULL);
+    pthread_join(consumer, NULL);
+    pthread_join(producer, NULL);
+    printf("The result is: %ld\n", result);
+    return result % 31;
+}
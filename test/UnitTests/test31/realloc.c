@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv)
+{
+    long *old, *p, *guard, *big, result;
+
+    /* A new object over a freed one holds the stale contents of the old one. */
+    old = malloc(4 * sizeof(long));
+    old[2] = argc + 40;
+    free(old);
+    p = malloc(4 * sizeof(long));
+    result = p[2];
+    free(p);
+
+    /* realloc() can't grow the object in place, so it moves it over a freed
+     * object and copies its contents over the stale ones. */
+    p = malloc(sizeof(long));
+    p[0] = argc;
+    guard = malloc(sizeof(long));
+    big = malloc(256 * sizeof(long));
+    big[0] = argc + 50;
+    free(big);
+    p = realloc(p, 256 * sizeof(long));
+    result += p[0];
+
+    free(p);
+    free(guard);
+    printf("The result is: %ld\n", result);
+    return result % 31;
+}
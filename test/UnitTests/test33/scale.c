@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 64
+
+/* The loops call no function, so each of their blocks is recorded by a single
+ * call to recordBlock(), while the blocks calling atoi() and printf() record
+ * their loads and stores one by one. */
+int a[N], b[N];
+
+int main(int argc, char **argv)
+{
+    int i, sum = 0;
+    int k = atoi(argv[1]);
+
+    for (i = 0; i < N; i++)
+        a[i] = i * k;
+    for (i = 1; i < N; i++)
+        b[i] = a[i] - a[i - 1];
+    for (i = 0; i < N; i++)
+        sum += b[i];
+
+    printf("The sum is: %d\n", sum);
+    return sum % 31;
+}
@@ -0,0 +1,25 @@
+#include <stdio.h>
+
+struct record {
+    char c;
+    short s;
+    int i;
+    long l;
+    __int128 w;
+};
+
+int main(int argc, char **argv)
+{
+    struct record r;
+    long result;
+
+    r.c = argc;
+    r.s = r.c + 1;
+    r.i = r.s + 2;
+    r.l = r.i + 3;
+    r.w = r.l + 4;
+    result = (long)r.w;
+
+    printf("The result is: %ld\n", result);
+    return result % 31;
+}
@@ -0,0 +1,58 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NTHREADS 2
+#define N 100
+
+/* Each thread scores its share of the numbers through a switch, an if and a
+ * recursive call, so that the outcomes of its branches lead the rebuilt blocks
+ * through several successors and in and out of several frames. */
+long score[NTHREADS];
+long base;
+
+long digits(long n)
+{
+    long d = 1;
+    if (n >= 10)
+        d += digits(n / 10);
+    return d;
+}
+
+void *work(void *arg)
+{
+    long id = (long)arg, i, s = 0;
+
+    for (i = id; i < N; i += NTHREADS) {
+        switch ((base + i) % 4) {
+        case 0:
+            s += digits(base * i);
+            break;
+        case 1:
+            s += 3;
+            break;
+        default:
+            if (i % 3 == 0)
+                s -= 1;
+        }
+    }
+    score[id] = s;
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t tid[NTHREADS];
+    long i, total = 0;
+
+    base = atol(argv[1]);
+    for (i = 0; i < NTHREADS; i++)
+        pthread_create(&tid[i], NULL, work, (void *)i);
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join(tid[i], NULL);
+    for (i = 0; i < NTHREADS; i++)
+        total += score[i];
+
+    printf("The total is: %ld\n", total);
+    return total % 31;
+}
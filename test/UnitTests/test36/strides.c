@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 256
+
+/* Walks of several strides: the elements of an array, a field of an array of
+ * structures, and a column of a matrix walked backwards. */
+struct point {
+    long x, y, z;
+};
+
+long line[N];
+struct point points[N];
+long matrix[N][8];
+
+int main(int argc, char **argv)
+{
+    long i, k = atol(argv[1]), sum = 0;
+
+    for (i = 0; i < N; i++)
+        line[i] = i * k;
+    for (i = 0; i < N; i++)
+        points[i].y = line[i] + 1;
+    for (i = 0; i < N; i++)
+        matrix[i][3] = points[i].y * 2;
+    for (i = N - 1; i >= 0; i--)
+        sum += matrix[i][3];
+
+    printf("The sum is: %ld\n", sum);
+    return sum % 31;
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ROUNDS 40000
+#define SLOTS 16
+
+/* Mix a pseudo-random sequence into a few slots, long enough for the trace to
+ * fill many windows of 1 MB. */
+unsigned long ring[SLOTS];
+
+int main(int argc, char **argv)
+{
+    unsigned long i, seed = atol(argv[1]), mix = 0;
+
+    for (i = 0; i < ROUNDS; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        ring[i % SLOTS] ^= seed >> 33;
+    }
+    for (i = 0; i < SLOTS; i++)
+        mix += ring[i];
+
+    printf("The mix is: %lu\n", mix);
+    return mix % 31;
+}
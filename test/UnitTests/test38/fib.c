@@ -0,0 +1,21 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ROUNDS 50000
+#define MODULUS 1000003
+
+/* Fibonacci numbers modulo a prime, kept in a pair of words which each round
+ * overwrites in turn. */
+unsigned long fib[2];
+
+int main(int argc, char **argv)
+{
+    unsigned long i;
+
+    fib[1] = atol(argv[1]);
+    for (i = 0; i < ROUNDS; i++)
+        fib[i % 2] = (fib[0] + fib[1]) % MODULUS;
+
+    printf("The result is: %lu\n", fib[ROUNDS % 2]);
+    return fib[ROUNDS % 2] % 31;
+}
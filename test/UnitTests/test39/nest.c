@@ -0,0 +1,44 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NWORKERS 3
+#define DEPTH 8
+
+/* The workers do the same work, which nests DEPTH calls, so that each of them
+ * makes as many records and reaches the same depths. */
+long partial[NWORKERS];
+long scale;
+
+long nest(long n)
+{
+    long r = scale;
+    if (n > 1)
+        r += nest(n - 1);
+    return r;
+}
+
+void *work(void *arg)
+{
+    long id = (long)arg;
+
+    partial[id] = nest(DEPTH);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t tid[NWORKERS];
+    long i, total = 0;
+
+    scale = atol(argv[1]);
+    for (i = 0; i < NWORKERS; i++)
+        pthread_create(&tid[i], NULL, work, (void *)i);
+    for (i = 0; i < NWORKERS; i++)
+        pthread_join(tid[i], NULL);
+    for (i = 0; i < NWORKERS; i++)
+        total += partial[i];
+
+    printf("The total is: %ld\n", total);
+    return total % 31;
+}
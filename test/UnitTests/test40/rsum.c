@@ -0,0 +1,22 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Sum 1, ..., n with n nested calls. */
+long rsum(long n)
+{
+    long s = 0;
+
+    if (n > 0)
+        s = n + rsum(n - 1);
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    long n, result;
+
+    n = atoi(argv[1]);
+    result = rsum(n);
+    printf("The sum is: %ld\n", result);
+    return result % 31;
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "Giri/TracingControl.h"
+
+long total;
+
+/* Sum the first n elements of a into total. */
+void sum(long *a, long n)
+{
+    long i, s = 0;
+
+    for (i = 0; i < n; i++)
+        s += a[i];
+    total = s;
+}
+
+/* Fill a untraced, and resume tracing before summing it. */
+void fill(long *a, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        a[i] = i * i;
+    giriTracingResume();
+    sum(a, n);
+}
+
+int main(int argc, char *argv[])
+{
+    long n;
+    long *a;
+
+    n = atoi(argv[1]);
+    a = (long *)malloc(n * sizeof(long));
+
+    /* fill() is entered while paused, so it runs its untraced clone. */
+    giriTracingPause();
+    if (n > 0)
+        fill(a, n);
+    printf("%ld\n", total);
+    return total % 31;
+}
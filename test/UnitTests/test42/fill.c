@@ -0,0 +1,41 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NTHREADS 4
+#define N 1000
+
+/* Each thread fills and sums a row of its own, so that it makes the same
+ * records whichever way they are appended. */
+long data[NTHREADS][N];
+long sums[NTHREADS];
+long base;
+
+void *fill(void *arg)
+{
+    long id = (long)arg, i, s = 0;
+
+    for (i = 0; i < N; i++)
+        data[id][i] = base + id * i;
+    for (i = 0; i < N; i++)
+        s += data[id][i];
+    sums[id] = s;
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t tid[NTHREADS];
+    long i, total = 0;
+
+    base = atol(argv[1]);
+    for (i = 0; i < NTHREADS; i++)
+        pthread_create(&tid[i], NULL, fill, (void *)i);
+    for (i = 0; i < NTHREADS; i++)
+        pthread_join(tid[i], NULL);
+    for (i = 0; i < NTHREADS; i++)
+        total += sums[i];
+
+    printf("The total is: %ld\n", total);
+    return total % 31;
+}
@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Data narrower than a pointer, several elements to the word */
+char word[16];
+short lengths[4];
+int counts[4];
+
+int main(int argc, char **argv)
+{
+    int i, total = 0;
+    int n = atoi(argv[1]) % 16;
+
+    for (i = 0; i < n; i++)
+        word[i] = 'a' + i;
+    for (i = 0; i < 4; i++)
+        lengths[i] = n - i;
+    for (i = 0; i < 4; i++)
+        counts[i] = word[i] + lengths[i];
+    for (i = 0; i < 4; i++)
+        total += counts[i];
+
+    printf("The total is: %d\n", total);
+    return total % 31;
+}
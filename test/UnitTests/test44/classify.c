@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Count the digits, letters and other characters of the input. Some of the
+ * branches are never taken for the given input. */
+int classify(char c)
+{
+    if (c >= '0' && c <= '9')
+        return 0;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+        return 1;
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    int counts[3] = { 0, 0, 0 };
+    const char *s;
+
+    for (s = argv[1]; *s; s++)
+        counts[classify(*s)]++;
+
+    if (counts[2] > 0)
+        printf("Other characters: %d\n", counts[2]);
+    printf("Digits: %d, letters: %d\n", counts[0], counts[1]);
+    return counts[0] + counts[1];
+}
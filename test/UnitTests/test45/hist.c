@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BUCKETS 16
+
+/* A histogram of a pseudo-random sequence, long enough for its trace to wrap
+ * around the ring of a small trace stream several times. */
+unsigned long histogram[BUCKETS];
+
+int main(int argc, char **argv)
+{
+    unsigned long seed = 1, n = atol(argv[1]), i, max = 0;
+
+    for (i = 0; i < n; i++) {
+        seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+        histogram[seed >> 60]++;
+    }
+    for (i = 0; i < BUCKETS; i++)
+        if (histogram[i] > max)
+            max = histogram[i];
+
+    printf("The largest bucket holds: %lu\n", max);
+    return max % 31;
+}
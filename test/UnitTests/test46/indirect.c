@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Two functions recursing into each other only through function pointers, so
+ * that no call names them. */
+typedef long (*step_t)(long n);
+
+long even(long n);
+long odd(long n);
+
+step_t steps[2] = { even, odd };
+
+long even(long n)
+{
+    long r = n;
+    if (n > 0)
+        r = steps[1](n - 1) + 2;
+    return r;
+}
+
+long odd(long n)
+{
+    long r = n;
+    if (n > 0)
+        r = steps[0](n - 1) + 1;
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    long n = atol(argv[1]);
+    long result = steps[n % 2](n);
+
+    printf("The result is: %ld\n", result);
+    return result % 31;
+}
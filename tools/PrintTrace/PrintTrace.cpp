@@ -13,9 +13,12 @@
 //===----------------------------------------------------------------------===//
 
 #include "Giri/TraceFile.h"
+#include "Utility/TraceReader.h"
+#include "Utility/TraceStream.h"
 
 #include "llvm/Support/CommandLine.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cassert>
 #include <fcntl.h>
@@ -23,85 +26,223 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <vector>
 
 static cl::opt<std::string>
 InputFilename(cl::Positional, cl::desc("trace file name"), cl::init("-"));
 
-int main(int argc, char ** argv) {
-  // Parse the command line options.
-  cl::ParseCommandLineOptions(argc, argv, "Print Trace Utility\n");
+static cl::opt<std::string>
+StreamName("stream",
+           cl::desc("Print the trace a running program publishes in the "
+                    "given shared memory stream ('default' for the one of "
+                    "the trace file)"),
+           cl::init(""));
+
+static cl::opt<bool>
+Loaded("loaded",
+       cl::desc("Print the trace as the slicer loads it, merged and with the "
+                "stride hits expanded, instead of the records of the file"),
+       cl::init(false));
+
+/// Print one entry with the given index.
+/// \return true if it is the end record.
+static bool printEntry(const Entry &entry, unsigned index) {
+  printf("%10u: ", index);
+
+  // Print the entry's type
+  switch (entry.type) {
+    case RecordType::BBType:
+      printf("BasicBlock  : ");
+      break;
+    case RecordType::LDType:
+      printf("Load        : ");
+      break;
+    case RecordType::STType:
+      printf("Store       : ");
+      break;
+    case RecordType::PDType:
+      printf("Select      : ");
+      break;
+    case RecordType::CLType:
+      printf("Call        : ");
+      break;
+    case RecordType::RTType:
+      printf("Return      : ");
+      break;
+    case RecordType::ENType:
+      printf("End         : ");
+      break;
+    case RecordType::SGType:
+      printf("Segment     : ");
+      break;
+    case RecordType::CKType:
+      printf("Checkpoint  : ");
+      break;
+    case RecordType::SYType:
+      printf("Sync        : ");
+      break;
+    case RecordType::ALType:
+      printf("Alloc       : ");
+      break;
+    case RecordType::FRType:
+      printf("Free        : ");
+      break;
+    case RecordType::LWType:
+      printf("LastWriter  : ");
+      break;
+    case RecordType::BRType:
+      printf("Branches    : ");
+      break;
+    case RecordType::FNType:
+      printf("Enter       : ");
+      break;
+    case RecordType::SHType:
+      printf("StrideHits  : ");
+      break;
+  }
 
-  // Open the trace file for read-only access.
-  int fd = 0;
-  if (InputFilename == "-")
-    fd = STDIN_FILENO;
+  // Print the value associated with the entry. For a segment header print
+  // the flags, owning thread, capacity and number of records instead. Note
+  // that records of sequenced segments carry the sequence number as TID.
+  if (entry.type == RecordType::SGType) {
+    const SegmentHeader &header =
+      reinterpret_cast<const SegmentHeader &>(entry);
+    printf("%6x: %8lu: %16lu: %8lu\n",
+           header.flags,
+           header.tid,
+           header.capacity,
+           header.count);
+  } else if (entry.type == RecordType::BBType)
+    printf("%6u: %8lu: %16lx: %8lu\n",
+           entry.id,
+           entry.tid,
+           entry.address,
+           entry.length);
   else
-    fd = open (InputFilename.c_str(), O_RDONLY);
-  assert((fd != -1) && "Cannot open file!\n");
+    printf("%6u: %8lu: %16lx: %8lx\n",
+           entry.id,
+           entry.tid,
+           entry.address,
+           entry.length);
 
-  // Print a header that reminds the user of what the fields mean.
-  printf("-----------------------------------------------------------------------------\n");
-  printf("%10s:  Record Type: %6s: %15s: %16s: %8s\n",
-         "Index", "ID", "TID", "Address", "Length");
-  printf("-----------------------------------------------------------------------------\n");
+  return entry.type == RecordType::ENType;
+}
 
+/// Print the entries of one trace file, numbering them from index on. A file
+/// of segments is printed segment by segment: each header is followed by the
+/// records it counts, and the unused slots after them are skipped but still
+/// numbered. An end record doesn't end such a file, since the segments of
+/// other threads may follow the one holding it.
+/// \return true if the end record of a flat trace has been printed.
+static bool printEntries(int fd, unsigned &index) {
   // Read in each entry and print it out.
   Entry entry;
   ssize_t readsize;
-  unsigned index = 0;
+  bool segmented = false;
+  uintptr_t records = 0; // Records of the current segment left to print
+  uintptr_t unused = 0; // Unused slots of the current segment left to skip
   while ((readsize = read(fd, &entry, sizeof(entry))) == sizeof(entry)) {
-    printf("%10u: ", index++);
+    if (records) {
+      --records;
+      printEntry(entry, index++);
+      continue;
+    }
+    if (unused) {
+      --unused;
+      ++index;
+      continue;
+    }
 
-    // Print the entry's type
-    switch (entry.type) {
-      case RecordType::BBType:
-        printf("BasicBlock  : ");
-        break;
-      case RecordType::LDType:
-        printf("Load        : ");
-        break;
-      case RecordType::STType:
-        printf("Store       : ");
-        break;
-      case RecordType::PDType:
-        printf("Select      : ");
-        break;
-      case RecordType::CLType:
-        printf("Call        : ");
-        break;
-      case RecordType::RTType:
-        printf("Return      : ");
-        break;
-      case RecordType::ENType:
-        printf("End         : ");
+    if (entry.type == RecordType::SGType) {
+      const SegmentHeader &header =
+        reinterpret_cast<const SegmentHeader &>(entry);
+      if (header.capacity == 0)
         break;
+      segmented = true;
+      records = std::min<uintptr_t>(header.count, header.capacity - 1);
+      unused = header.capacity - 1 - records;
+      printEntry(entry, index++);
+      continue;
     }
 
-    // Print the value associated with the entry.
-    if (entry.type == RecordType::BBType)
-      printf("%6u: %8lu: %16lx: %8lu\n",
-             entry.id,
-             entry.tid,
-             entry.address,
-             entry.length);
-    else
-      printf("%6u: %8lu: %16lx: %8lx\n",
-             entry.id,
-             entry.tid,
-             entry.address,
-             entry.length);
+    // The segments of a file end at the first slot which isn't a header,
+    // e.g. the unused tail of the file after a crash.
+    if (segmented)
+      break;
 
     // Stop printing entries if we've hit the end of the log.
-    if (entry.type == RecordType::ENType) {
-      readsize = 0;
-      break;
-    }
+    if (printEntry(entry, index++))
+      return true;
   }
 
-  if (readsize != 0) {
+  if (readsize != 0 && readsize != sizeof(entry)) {
     fprintf(stderr, "Read of incorrect size\n");
     exit(1);
   }
 
+  return false;
+}
+
+/// Print the records of a live trace stream as they are published.
+static void printStream(const std::string &Name) {
+  TraceStream Stream(Name);
+  const Entry *Records;
+  unsigned long Count;
+  unsigned index = 0;
+  while (Stream.next(Records, Count))
+    for (unsigned long i = 0; i < Count; ++i)
+      if (printEntry(Records[i], index++))
+        break;
+
+  if (Stream.dropped())
+    fprintf(stderr, "The program dropped %lu windows of the trace\n",
+            Stream.dropped());
+}
+
+int main(int argc, char ** argv) {
+  // Parse the command line options.
+  cl::ParseCommandLineOptions(argc, argv, "Print Trace Utility\n");
+
+  // A chunked trace is printed chunk by chunk as one trace.
+  std::vector<std::string> Files;
+  if (StreamName.empty() &&
+      (InputFilename == "-" || !TraceReader::readManifest(InputFilename, Files)))
+    Files.push_back(InputFilename);
+
+  // Print a header that reminds the user of what the fields mean.
+  printf("-----------------------------------------------------------------------------\n");
+  printf("%10s:  Record Type: %6s: %15s: %16s: %8s\n",
+         "Index", "ID", "TID", "Address", "Length");
+  printf("-----------------------------------------------------------------------------\n");
+
+  if (!StreamName.empty()) {
+    printStream(StreamName == "default" ? TraceStream::defaultName(InputFilename)
+                                        : StreamName);
+    return 0;
+  }
+
+  if (Loaded) {
+    TraceReader Reader(InputFilename);
+    for (unsigned long i = 0; i < Reader.size(); ++i)
+      printEntry(Reader.getEntries()[i], i);
+    return 0;
+  }
+
+  unsigned index = 0;
+  for (unsigned i = 0; i < Files.size(); ++i) {
+    // Open the trace file for read-only access.
+    int fd = 0;
+    if (Files[i] == "-")
+      fd = STDIN_FILENO;
+    else
+      fd = open (Files[i].c_str(), O_RDONLY);
+    assert((fd != -1) && "Cannot open file!\n");
+
+    bool ended = printEntries(fd, index);
+    close(fd);
+    if (ended)
+      break;
+  }
+
   return 0;
 }